@@ -31,19 +31,46 @@
 #include "app.h"
 #include "crc.h"
 #include "packet.h"
+#include "utils.h"
+#include "flash_helper.h"
 
 // Settings
 #define CANDx			CAND1
 #define RX_FRAMES_SIZE	100
 #define RX_BUFFER_SIZE	PACKET_MAX_PL_LEN
+#define SYNC_INT_MS		100		// Interval between time sync frames from the master
+#define SYNC_TIMEOUT_MS	1000	// Drop the lock if no sync has been received for this long
+#define SYNC_STEP_US	1000	// Larger errors than this are treated as outliers or steps
+#define SYNC_OUTLIERS	3		// Consecutive outliers before the offset is stepped
+#define SYNC_KP			0.3		// Offset correction gain
+#define SYNC_KI			0.05	// Drift correction gain
+#define SYNC_DRIFT_MAX	500e-6	// Max drift, crystal tolerances are well below this
+#define STATS_LOAD_TAU	0.1		// Bus load filter constant per timer period, about 1 s
+#define FW_CHUNK_SIZE		6		// Firmware bytes per CAN frame
+#define FW_MAX_CHUNKS		65535
+#define FW_MAX_NODES		16
+#define FW_ERASE_TIMEOUT_MS	10000	// Max time to wait for the nodes to erase
+#define FW_ERASE_QUIET_MS	1000	// Stop waiting for erase replies after this time without one
+#define FW_REPLY_TIMEOUT_MS	100
+#define FW_RETRIES			3
+#define FW_GATHER_PASSES	5
+
+// Firmware distribution reply types
+#define FW_REPLY_ERASED		0
+#define FW_REPLY_MISSING	1
+#define FW_REPLY_VERIFIED	2
 
 // Threads
 static THD_WORKING_AREA(cancom_read_thread_wa, 512);
 static THD_WORKING_AREA(cancom_process_thread_wa, 4096);
 static THD_WORKING_AREA(cancom_status_thread_wa, 1024);
+static THD_WORKING_AREA(cancom_timer_thread_wa, 512);
+static THD_WORKING_AREA(cancom_fw_thread_wa, 1024);
 static THD_FUNCTION(cancom_read_thread, arg);
 static THD_FUNCTION(cancom_status_thread, arg);
 static THD_FUNCTION(cancom_process_thread, arg);
+static THD_FUNCTION(cancom_timer_thread, arg);
+static THD_FUNCTION(cancom_fw_thread, arg);
 
 // Variables
 static can_status_msg stat_msgs[CAN_STATUS_MSGS_TO_STORE];
@@ -51,10 +78,55 @@ static mutex_t can_mtx;
 static uint8_t rx_buffer[RX_BUFFER_SIZE];
 static unsigned int rx_buffer_last_id;
 static CANRxFrame rx_frames[RX_FRAMES_SIZE];
+static uint32_t rx_frame_times[RX_FRAMES_SIZE];
 static int rx_frame_read;
 static int rx_frame_write;
 static thread_t *process_tp;
 
+// Time sync variables
+static volatile bool sync_master;
+static volatile bool sync_locked;
+static volatile int sync_master_id;
+static volatile int32_t sync_offset;
+static volatile float sync_offset_frac;
+static volatile float sync_drift;
+static volatile uint32_t sync_last_local;
+static volatile systime_t sync_last_rx;
+static int sync_outliers;
+static uint8_t sync_seq;
+static uint8_t sync_rx_seq;
+static uint32_t sync_rx_time;
+
+// Bus statistics
+static can_bus_stats stats;
+static volatile uint32_t stats_tx_bits;
+static volatile uint32_t stats_rx_bits;
+static uint32_t stats_bits_last;
+static bool stats_bus_off_last;
+
+// Firmware distribution, receiving side
+static bool fw_rx_active;
+static uint8_t fw_rx_sender_id;
+static uint32_t fw_rx_size;
+static uint16_t fw_rx_crc;
+static uint16_t fw_rx_chunks;
+__attribute__((section(".ram4"))) static uint8_t fw_rx_bitmap[(FW_MAX_CHUNKS + 7) / 8];
+
+// Firmware distribution, sending side
+static thread_t *fw_tp;
+static volatile bool fw_busy;
+static uint32_t fw_size;
+static int fw_nodes_expected;
+static void(*fw_reply_func)(unsigned char *data, unsigned int len);
+static volatile int fw_node_num;
+static uint8_t fw_node_ids[FW_MAX_NODES];
+static uint8_t fw_node_states[FW_MAX_NODES];
+static volatile int fw_reply_id;
+static volatile int fw_reply_type;
+static volatile uint16_t fw_reply_first;
+static volatile uint32_t fw_reply_mask;
+static volatile bool fw_reply_ok;
+
 /*
  * 500KBaud, automatic wakeup, automatic recover
  * from abort mode.
@@ -69,6 +141,20 @@ static CANConfig cancfg = {
 // Private functions
 static void send_packet_wrapper(unsigned char *data, unsigned int len);
 static void set_timing(int brp, int ts1, int ts2);
+static uint32_t local_time_us(void);
+static uint32_t local_to_sync_time(uint32_t local);
+static uint32_t sync_frame_delay_us(int len);
+static void sync_update(uint8_t master_id, uint32_t master_time, uint32_t local_time);
+#if CAN_ENABLE
+static void transmit_frame(CANTxFrame *txmsg);
+#endif
+static int stats_type_index(uint8_t ide, uint32_t eid);
+static uint32_t frame_bits(uint8_t ide, uint8_t dlc);
+static uint32_t baud_bps(void);
+static void fw_rx_frame(uint8_t cmd, uint8_t *data, uint8_t len);
+static void fw_tx_reply(uint8_t *data, uint8_t len);
+static void fw_send_chunk(uint8_t id, uint16_t chunk);
+static bool fw_wait_reply(int node_id, int type);
 
 // Function pointers
 static void(*sid_callback)(uint32_t id, uint8_t *data, uint8_t len) = 0;
@@ -81,6 +167,30 @@ void comm_can_init(void) {
 	rx_frame_read = 0;
 	rx_frame_write = 0;
 
+	sync_master = false;
+	sync_locked = false;
+	sync_master_id = -1;
+	sync_offset = 0;
+	sync_offset_frac = 0.0;
+	sync_drift = 0.0;
+	sync_last_local = 0;
+	sync_last_rx = 0;
+	sync_outliers = 0;
+	sync_seq = 0;
+	sync_rx_seq = 0;
+	sync_rx_time = 0;
+
+	comm_can_reset_stats();
+	stats_tx_bits = 0;
+	stats_rx_bits = 0;
+	stats_bits_last = 0;
+	stats_bus_off_last = false;
+
+	fw_rx_active = false;
+	fw_busy = false;
+	fw_node_num = 0;
+	fw_reply_id = -1;
+
 	chMtxObjectInit(&can_mtx);
 
 	palSetPadMode(GPIOB, 8,
@@ -100,6 +210,10 @@ void comm_can_init(void) {
 			cancom_status_thread, NULL);
 	chThdCreateStatic(cancom_process_thread_wa, sizeof(cancom_process_thread_wa), NORMALPRIO,
 			cancom_process_thread, NULL);
+	chThdCreateStatic(cancom_timer_thread_wa, sizeof(cancom_timer_thread_wa), NORMALPRIO,
+			cancom_timer_thread, NULL);
+	chThdCreateStatic(cancom_fw_thread_wa, sizeof(cancom_fw_thread_wa), NORMALPRIO - 1,
+			cancom_fw_thread, NULL);
 }
 
 void comm_can_set_baud(CAN_BAUD baud) {
@@ -117,19 +231,47 @@ static THD_FUNCTION(cancom_read_thread, arg) {
 	chRegSetThreadName("CAN");
 
 	event_listener_t el;
+	event_listener_t el_err;
 	CANRxFrame rxmsg;
 
 	chEvtRegister(&CANDx.rxfull_event, &el, 0);
+	chEvtRegister(&CANDx.error_event, &el_err, 1);
 
 	while(!chThdShouldTerminateX()) {
-		if (chEvtWaitAnyTimeout(ALL_EVENTS, MS2ST(10)) == 0) {
+		eventmask_t events = chEvtWaitAnyTimeout(ALL_EVENTS, MS2ST(10));
+
+		if (events == 0) {
 			continue;
 		}
 
+		if (events & EVENT_MASK(1)) {
+			eventflags_t flags = chEvtGetAndClearFlags(&el_err);
+			bool bus_off = flags & CAN_BUS_OFF_ERROR;
+
+			if (bus_off && !stats_bus_off_last) {
+				stats.bus_off_events++;
+			}
+			stats_bus_off_last = bus_off;
+
+			if (flags & CAN_FRAMING_ERROR) {
+				stats.framing_errors++;
+			}
+
+			if (flags & CAN_OVERFLOW_ERROR) {
+				stats.rx_overflows++;
+			}
+		}
+
 		msg_t result = canReceive(&CANDx, CAN_ANY_MAILBOX, &rxmsg, TIME_IMMEDIATE);
 
 		while (result == MSG_OK) {
+			// Stamp the frame as early as possible, the time sync relies on it
+			rx_frame_times[rx_frame_write] = local_time_us();
 			rx_frames[rx_frame_write++] = rxmsg;
+
+			stats.rx_frames[stats_type_index(rxmsg.IDE, rxmsg.EID)]++;
+			stats_rx_bits += frame_bits(rxmsg.IDE, rxmsg.DLC);
+
 			if (rx_frame_write == RX_FRAMES_SIZE) {
 				rx_frame_write = 0;
 			}
@@ -141,6 +283,7 @@ static THD_FUNCTION(cancom_read_thread, arg) {
 	}
 
 	chEvtUnregister(&CANDx.rxfull_event, &el);
+	chEvtUnregister(&CANDx.error_event, &el_err);
 }
 
 static THD_FUNCTION(cancom_process_thread, arg) {
@@ -160,6 +303,7 @@ static THD_FUNCTION(cancom_process_thread, arg) {
 		chEvtWaitAny((eventmask_t) 1);
 
 		while (rx_frame_read != rx_frame_write) {
+			uint32_t rx_time_us = rx_frame_times[rx_frame_read];
 			CANRxFrame rxmsg = rx_frames[rx_frame_read++];
 
 			if (rxmsg.IDE == CAN_IDE_EXT) {
@@ -263,6 +407,43 @@ static THD_FUNCTION(cancom_process_thread, arg) {
 						timeout_reset();
 						break;
 
+					case CAN_PACKET_TIME_SYNC:
+						// Only remember the reception time here, the master sends its
+						// transmit time in the follow up frame.
+						if (!sync_master && rxmsg.DLC >= 2) {
+							sync_rx_seq = rxmsg.data8[1];
+							sync_rx_time = rx_time_us;
+						}
+						break;
+
+					case CAN_PACKET_TIME_SYNC_FOLLOW_UP:
+						if (!sync_master && rxmsg.DLC >= 6 && rxmsg.data8[1] == sync_rx_seq) {
+							ind = 2;
+							uint32_t master_time = buffer_get_uint32(rxmsg.data8, &ind);
+							sync_update(rxmsg.data8[0], master_time +
+									sync_frame_delay_us(2), sync_rx_time);
+						}
+						break;
+
+					case CAN_PACKET_SAMPLE_SYNC:
+						if (comm_can_sync_is_valid() && rxmsg.DLC >= 8) {
+							ind = 0;
+							debug_sampling_mode mode = rxmsg.data8[ind++];
+							uint16_t sample_len = buffer_get_uint16(rxmsg.data8, &ind);
+							uint8_t decimation = rxmsg.data8[ind++];
+							uint32_t start_time = buffer_get_uint32(rxmsg.data8, &ind);
+							mc_interface_sample_print_data_at(mode, sample_len, decimation, start_time);
+						}
+						break;
+
+					case CAN_PACKET_FW_BEGIN:
+					case CAN_PACKET_FW_DATA:
+					case CAN_PACKET_FW_GET_MISSING:
+					case CAN_PACKET_FW_VERIFY:
+					case CAN_PACKET_FW_REPLY:
+						fw_rx_frame(cmd, rxmsg.data8, rxmsg.DLC);
+						break;
+
 					default:
 						break;
 					}
@@ -276,6 +457,7 @@ static THD_FUNCTION(cancom_process_thread, arg) {
 							ind = 0;
 							stat_tmp->id = id;
 							stat_tmp->rx_time = chVTGetSystemTime();
+							stat_tmp->rx_time_sync = local_to_sync_time(rx_time_us);
 							stat_tmp->rpm = (float)buffer_get_int32(rxmsg.data8, &ind);
 							stat_tmp->current = (float)buffer_get_int16(rxmsg.data8, &ind) / 10.0;
 							stat_tmp->duty = (float)buffer_get_int16(rxmsg.data8, &ind) / 1000.0;
@@ -325,6 +507,204 @@ static THD_FUNCTION(cancom_status_thread, arg) {
 	}
 }
 
+static THD_FUNCTION(cancom_timer_thread, arg) {
+	(void)arg;
+	chRegSetThreadName("CAN timer");
+
+	for(;;) {
+		// Bus load from the frames seen during the last period. All frames on
+		// the bus pass the acceptance filter, so this covers other nodes too.
+		uint32_t bits = stats_tx_bits + stats_rx_bits;
+		float load_now = (float)(bits - stats_bits_last) /
+				((float)baud_bps() * ((float)SYNC_INT_MS / 1000.0)) * 100.0;
+		stats_bits_last = bits;
+		UTILS_LP_FAST(stats.bus_load, load_now, STATS_LOAD_TAU);
+		if (load_now > stats.bus_load_max) {
+			stats.bus_load_max = load_now;
+		}
+
+		uint32_t esr = CANDx.can->ESR;
+		stats.tec = (esr & CAN_ESR_TEC) >> 16;
+		stats.rec = (esr & CAN_ESR_REC) >> 24;
+		if (!(esr & CAN_ESR_BOFF)) {
+			stats_bus_off_last = false;
+		}
+
+		if (sync_master) {
+			// Two-step sync: the time is taken just before the sync frame is
+			// queued and then sent in a follow up frame, so that the sync frame
+			// itself can be stamped on reception without any processing delay.
+			uint8_t buffer[8];
+			int32_t send_index = 0;
+			uint8_t id = app_get_configuration()->controller_id;
+
+			sync_seq++;
+			buffer[send_index++] = id;
+			buffer[send_index++] = sync_seq;
+			uint32_t tx_time = local_time_us();
+			comm_can_transmit_eid(255 | ((uint32_t)CAN_PACKET_TIME_SYNC << 8),
+					buffer, send_index);
+
+			send_index = 0;
+			buffer[send_index++] = id;
+			buffer[send_index++] = sync_seq;
+			buffer_append_uint32(buffer, tx_time, &send_index);
+			comm_can_transmit_eid(255 | ((uint32_t)CAN_PACKET_TIME_SYNC_FOLLOW_UP << 8),
+					buffer, send_index);
+		} else if (sync_locked && ST2MS(chVTTimeElapsedSinceX(sync_last_rx)) > SYNC_TIMEOUT_MS) {
+			sync_locked = false;
+			sync_master_id = -1;
+		}
+
+		chThdSleepMilliseconds(SYNC_INT_MS);
+	}
+}
+
+static THD_FUNCTION(cancom_fw_thread, arg) {
+	(void)arg;
+	chRegSetThreadName("CAN FW");
+
+	fw_tp = chThdGetSelfX();
+
+	for(;;) {
+		chEvtWaitAny((eventmask_t) 1);
+
+		uint8_t buffer[8];
+		int32_t ind = 0;
+		uint8_t *image = flash_helper_get_new_app_address();
+		uint16_t chunks = (fw_size + FW_CHUNK_SIZE - 1) / FW_CHUNK_SIZE;
+
+		// Let all nodes erase. The system is locked while erasing, so no
+		// frames can be sent until everyone has replied.
+		fw_node_num = 0;
+		buffer[ind++] = app_get_configuration()->controller_id;
+		buffer_append_uint32(buffer, fw_size, &ind);
+		buffer_append_uint16(buffer, crc16(image, fw_size), &ind);
+		comm_can_transmit_eid(255 | ((uint32_t)CAN_PACKET_FW_BEGIN << 8), buffer, ind);
+
+		systime_t erase_start = chVTGetSystemTime();
+		systime_t last_reply = erase_start;
+		int nodes_last = 0;
+		for (;;) {
+			chThdSleepMilliseconds(10);
+
+			if (fw_node_num != nodes_last) {
+				nodes_last = fw_node_num;
+				last_reply = chVTGetSystemTime();
+			}
+
+			if (fw_nodes_expected > 0 && fw_node_num >= fw_nodes_expected) {
+				break;
+			}
+
+			if (fw_nodes_expected <= 0 && fw_node_num > 0 &&
+					ST2MS(chVTTimeElapsedSinceX(last_reply)) > FW_ERASE_QUIET_MS) {
+				break;
+			}
+
+			if (ST2MS(chVTTimeElapsedSinceX(erase_start)) > FW_ERASE_TIMEOUT_MS) {
+				break;
+			}
+		}
+
+		// Broadcast the image once
+		for (uint16_t i = 0;i < chunks;i++) {
+			fw_send_chunk(255, i);
+		}
+
+		// Gather the missing chunks from every node and send them again
+		for (int n = 0;n < fw_node_num;n++) {
+			uint8_t id = fw_node_ids[n];
+
+			if (fw_node_states[n] != CAN_FW_NODE_ERASED) {
+				continue;
+			}
+
+			bool complete = false;
+			for (int pass = 0;pass < FW_GATHER_PASSES && !complete;pass++) {
+				uint16_t start = 0;
+				bool missing = false;
+
+				while (start < chunks) {
+					ind = 0;
+					buffer[ind++] = app_get_configuration()->controller_id;
+					buffer_append_uint16(buffer, start, &ind);
+
+					bool got_reply = false;
+					for (int r = 0;r < FW_RETRIES && !got_reply;r++) {
+						fw_reply_id = -1;
+						comm_can_transmit_eid(id | ((uint32_t)CAN_PACKET_FW_GET_MISSING << 8), buffer, ind);
+						got_reply = fw_wait_reply(id, FW_REPLY_MISSING);
+					}
+
+					if (!got_reply) {
+						pass = FW_GATHER_PASSES;
+						break;
+					}
+
+					uint16_t first = fw_reply_first;
+					uint32_t mask = fw_reply_mask;
+
+					if (first == 0xFFFF) {
+						break;
+					}
+
+					missing = true;
+					fw_send_chunk(id, first);
+					for (int i = 0;i < 32;i++) {
+						if ((mask & ((uint32_t)1 << i)) && (first + 1 + i) < chunks) {
+							fw_send_chunk(id, first + 1 + i);
+						}
+					}
+
+					start = first + 33;
+					if (start <= first) {
+						break;
+					}
+				}
+
+				if (!missing && pass < FW_GATHER_PASSES) {
+					complete = true;
+				}
+			}
+
+			if (complete) {
+				ind = 0;
+				buffer[ind++] = app_get_configuration()->controller_id;
+
+				bool got_reply = false;
+				for (int r = 0;r < FW_RETRIES && !got_reply;r++) {
+					fw_reply_id = -1;
+					comm_can_transmit_eid(id | ((uint32_t)CAN_PACKET_FW_VERIFY << 8), buffer, ind);
+					got_reply = fw_wait_reply(id, FW_REPLY_VERIFIED);
+				}
+
+				fw_node_states[n] = got_reply && fw_reply_ok ? CAN_FW_NODE_OK : CAN_FW_NODE_FAILED;
+			} else {
+				fw_node_states[n] = CAN_FW_NODE_FAILED;
+			}
+		}
+
+		uint8_t reply[3 + 2 * FW_MAX_NODES];
+		ind = 0;
+		reply[ind++] = COMM_CAN_FW_DISTRIBUTE;
+		reply[ind++] = 1;
+		reply[ind++] = fw_node_num;
+		for (int n = 0;n < fw_node_num;n++) {
+			reply[ind++] = fw_node_ids[n];
+			reply[ind++] = fw_node_states[n];
+		}
+
+		if (fw_reply_func) {
+			fw_reply_func(reply, ind);
+		} else {
+			commands_send_packet(reply, ind);
+		}
+
+		fw_busy = false;
+	}
+}
+
 void comm_can_transmit_eid(uint32_t id, uint8_t *data, uint8_t len) {
 	if (len > 8) {
 		len = 8;
@@ -338,9 +718,7 @@ void comm_can_transmit_eid(uint32_t id, uint8_t *data, uint8_t len) {
 	txmsg.DLC = len;
 	memcpy(txmsg.data8, data, len);
 
-	chMtxLock(&can_mtx);
-	canTransmit(&CANDx, CAN_ANY_MAILBOX, &txmsg, MS2ST(20));
-	chMtxUnlock(&can_mtx);
+	transmit_frame(&txmsg);
 
 #else
 	(void)id;
@@ -362,9 +740,7 @@ void comm_can_transmit_sid(uint32_t id, uint8_t *data, uint8_t len) {
 	txmsg.DLC = len;
 	memcpy(txmsg.data8, data, len);
 
-	chMtxLock(&can_mtx);
-	canTransmit(&CANDx, CAN_ANY_MAILBOX, &txmsg, MS2ST(20));
-	chMtxUnlock(&can_mtx);
+	transmit_frame(&txmsg);
 
 #else
 	(void)id;
@@ -575,6 +951,166 @@ can_status_msg *comm_can_get_status_msg_id(int id) {
 	return 0;
 }
 
+/**
+ * Make this controller the time master on the CAN bus. The master broadcasts
+ * its time regularly and all other controllers estimate their offset and
+ * drift relative to it. Only one controller on the bus should be master.
+ *
+ * @param master
+ * true to become master, false to follow the master on the bus.
+ */
+void comm_can_set_sync_master(bool master) {
+	sync_locked = false;
+	sync_master_id = -1;
+	sync_master = master;
+}
+
+/**
+ * Check if this controller is the time master.
+ *
+ * @return
+ * true if this controller is master, false otherwise.
+ */
+bool comm_can_is_sync_master(void) {
+	return sync_master;
+}
+
+/**
+ * Check if the synchronized time can be compared to the time of other
+ * controllers on the bus.
+ *
+ * @return
+ * true if this controller is master or locked to a master, false otherwise.
+ */
+bool comm_can_sync_is_valid(void) {
+	return sync_master || sync_locked;
+}
+
+/**
+ * Get the synchronized bus time. This function can be called from any
+ * context, including interrupts.
+ *
+ * @return
+ * The synchronized time in microseconds. Wraps around after about 71 minutes.
+ * If the time is not synchronized the local time is returned.
+ */
+uint32_t comm_can_sync_time_us(void) {
+	return local_to_sync_time(local_time_us());
+}
+
+/**
+ * Get the time synchronization state.
+ *
+ * @param master_id
+ * The ID of the master we are locked to, -1 if not locked.
+ *
+ * @param offset_us
+ * The estimated offset to the master time in microseconds.
+ *
+ * @param drift_ppm
+ * The estimated drift relative to the master in ppm.
+ */
+void comm_can_get_sync_state(int *master_id, float *offset_us, float *drift_ppm) {
+	syssts_t sts = chSysGetStatusAndLockX();
+	*master_id = sync_master_id;
+	*offset_us = (float)sync_offset + sync_offset_frac;
+	*drift_ppm = sync_drift * 1e6;
+	chSysRestoreStatusX(sts);
+}
+
+/**
+ * Start a debug sample capture on all controllers on the bus at the same
+ * synchronized instant, including this one. Controllers that are not
+ * synchronized ignore the request.
+ *
+ * @param mode
+ * The sampling mode.
+ *
+ * @param len
+ * The number of samples.
+ *
+ * @param decimation
+ * The sample decimation.
+ *
+ * @param delay_ms
+ * The time from now until the capture should start. Has to be longer than
+ * the time it takes to get the request out on the bus.
+ *
+ * @return
+ * The synchronized start time in microseconds.
+ */
+uint32_t comm_can_sample_sync(debug_sampling_mode mode, uint16_t len, uint8_t decimation, int delay_ms) {
+	uint32_t start_time = comm_can_sync_time_us() + (uint32_t)delay_ms * 1000;
+
+	int32_t send_index = 0;
+	uint8_t buffer[8];
+	buffer[send_index++] = mode;
+	buffer_append_uint16(buffer, len, &send_index);
+	buffer[send_index++] = decimation;
+	buffer_append_uint32(buffer, start_time, &send_index);
+	comm_can_transmit_eid(255 | ((uint32_t)CAN_PACKET_SAMPLE_SYNC << 8), buffer, send_index);
+
+	mc_interface_sample_print_data_at(mode, len, decimation, start_time);
+
+	return start_time;
+}
+
+/**
+ * Get a copy of the bus statistics.
+ *
+ * @param s
+ * Pointer to where the statistics should be stored.
+ */
+void comm_can_get_stats(can_bus_stats *s) {
+	*s = stats;
+}
+
+/**
+ * Reset all bus statistics counters.
+ */
+void comm_can_reset_stats(void) {
+	memset(&stats, 0, sizeof(stats));
+}
+
+/**
+ * Distribute the firmware image in the new app area of this controller to
+ * all other controllers on the bus at once. The image is broadcast once,
+ * after which every node is asked for the chunks it missed and only those
+ * are sent again to that node. The image must have been written with
+ * COMM_ERASE_NEW_APP and COMM_WRITE_NEW_APP_DATA before calling this.
+ *
+ * This function returns immediately and the distribution runs in the
+ * background. The result is sent as a COMM_CAN_FW_DISTRIBUTE packet.
+ *
+ * @param size
+ * Size of the image in bytes.
+ *
+ * @param nodes_expected
+ * The number of nodes to wait for after erasing. 0 means waiting until
+ * no new node has replied for a while.
+ *
+ * @param reply_func
+ * Function used to send the result.
+ *
+ * @return
+ * true if the distribution was started, false if one already is running
+ * or the size is invalid.
+ */
+bool comm_can_fw_distribute(uint32_t size, int nodes_expected,
+		void(*reply_func)(unsigned char *data, unsigned int len)) {
+	if (fw_busy || size == 0 || size > (FW_MAX_CHUNKS * FW_CHUNK_SIZE)) {
+		return false;
+	}
+
+	fw_size = size;
+	fw_nodes_expected = nodes_expected;
+	fw_reply_func = reply_func;
+	fw_busy = true;
+	chEvtSignal(fw_tp, (eventmask_t) 1);
+
+	return true;
+}
+
 static void send_packet_wrapper(unsigned char *data, unsigned int len) {
 	comm_can_send_buffer(rx_buffer_last_id, data, len, true);
 }
@@ -590,3 +1126,342 @@ static void set_timing(int brp, int ts1, int ts2) {
 	canStop(&CANDx);
 	canStart(&CANDx, &cancfg);
 }
+
+/**
+ * Local time with microsecond resolution, derived from the system tick count
+ * and the SysTick down counter.
+ */
+static uint32_t local_time_us(void) {
+	syssts_t sts = chSysGetStatusAndLockX();
+	uint32_t ticks = chVTGetSystemTimeX();
+	uint32_t val = SysTick->VAL;
+
+	// The counter has wrapped, but the tick interrupt has not run yet
+	if (SCB->ICSR & SCB_ICSR_PENDSTSET_Msk) {
+		val = SysTick->VAL;
+		ticks++;
+	}
+
+	uint32_t load = SysTick->LOAD;
+	chSysRestoreStatusX(sts);
+
+	return ticks * (1000000 / CH_CFG_ST_FREQUENCY) +
+			(load - val) / (SYSTEM_CORE_CLOCK / 1000000);
+}
+
+static uint32_t local_to_sync_time(uint32_t local) {
+	if (sync_master || !sync_locked) {
+		return local;
+	}
+
+	syssts_t sts = chSysGetStatusAndLockX();
+	float corr = sync_offset_frac + sync_drift * (float)(int32_t)(local - sync_last_local);
+	uint32_t res = local + sync_offset + (int32_t)corr;
+	chSysRestoreStatusX(sts);
+
+	return res;
+}
+
+/**
+ * Approximate time from the start of a frame transmission until it has been
+ * received, without bit stuffing.
+ */
+static uint32_t sync_frame_delay_us(int len) {
+	return frame_bits(CAN_IDE_EXT, len) * 1000000 / baud_bps();
+}
+
+/**
+ * Update the offset and drift estimate with a new measurement.
+ * A PI loop on the offset error, where the integral part tracks the
+ * drift between the local oscillator and the master.
+ */
+static void sync_update(uint8_t master_id, uint32_t master_time, uint32_t local_time) {
+	if (sync_master_id >= 0 && sync_master_id != master_id) {
+		// Another master is talking, stay with the one we have
+		return;
+	}
+
+	int32_t meas = (int32_t)(master_time - local_time);
+
+	chSysLock();
+
+	if (!sync_locked) {
+		sync_offset = meas;
+		sync_offset_frac = 0.0;
+		sync_drift = 0.0;
+		sync_last_local = local_time;
+		sync_master_id = master_id;
+		sync_outliers = 0;
+		sync_locked = true;
+	} else {
+		int32_t dt = (int32_t)(local_time - sync_last_local);
+		float pred = sync_offset_frac + sync_drift * (float)dt;
+		float err = (float)(meas - sync_offset) - pred;
+
+		if (fabsf(err) > SYNC_STEP_US && sync_outliers < SYNC_OUTLIERS) {
+			// Most likely a sync frame that got delayed by arbitration
+			sync_outliers++;
+		} else {
+			if (fabsf(err) > SYNC_STEP_US) {
+				// The master time has jumped, e.g. after a reboot
+				sync_offset = meas;
+				pred = 0.0;
+				err = 0.0;
+				sync_drift = 0.0;
+			}
+
+			sync_outliers = 0;
+			sync_offset_frac = pred + SYNC_KP * err;
+
+			if (dt > 0) {
+				float drift = sync_drift + SYNC_KI * err / (float)dt;
+				utils_truncate_number(&drift, -SYNC_DRIFT_MAX, SYNC_DRIFT_MAX);
+				sync_drift = drift;
+			}
+
+			// Keep the fractional part small so that float precision is not lost
+			int32_t whole = (int32_t)sync_offset_frac;
+			sync_offset += whole;
+			sync_offset_frac -= (float)whole;
+			sync_last_local = local_time;
+		}
+	}
+
+	sync_last_rx = chVTGetSystemTimeX();
+
+	chSysUnlock();
+}
+
+#if CAN_ENABLE
+/**
+ * Transmit a frame and keep track of how long it had to wait for the bus.
+ */
+static void transmit_frame(CANTxFrame *txmsg) {
+	uint32_t t_start = local_time_us();
+
+	chMtxLock(&can_mtx);
+
+	chSysLock();
+	bool mailbox_full = !can_lld_is_tx_empty(&CANDx, CAN_ANY_MAILBOX);
+	chSysUnlock();
+
+	msg_t res = canTransmit(&CANDx, CAN_ANY_MAILBOX, txmsg, MS2ST(20));
+
+	uint32_t wait = local_time_us() - t_start;
+	int type = stats_type_index(txmsg->IDE, txmsg->EID);
+
+	if (mailbox_full) {
+		stats.tx_mailbox_full++;
+	}
+
+	if (res == MSG_OK) {
+		stats.tx_frames[type]++;
+		stats_tx_bits += frame_bits(txmsg->IDE, txmsg->DLC);
+	} else {
+		stats.tx_timeouts++;
+	}
+
+	stats.tx_wait_sum_us += wait;
+	if (wait > stats.tx_wait_max_us) {
+		stats.tx_wait_max_us = wait;
+	}
+
+	chMtxUnlock(&can_mtx);
+}
+#endif
+
+static int stats_type_index(uint8_t ide, uint32_t eid) {
+	if (ide == CAN_IDE_EXT && (eid >> 8) < (CAN_STATS_PACKET_TYPES - 1)) {
+		return eid >> 8;
+	}
+
+	// Standard frames and unknown commands share the last slot
+	return CAN_STATS_PACKET_TYPES - 1;
+}
+
+/**
+ * Approximate number of bits a frame occupies on the bus, including the
+ * inter frame space but without bit stuffing.
+ */
+static uint32_t frame_bits(uint8_t ide, uint8_t dlc) {
+	return (ide == CAN_IDE_EXT ? 67 : 47) + 8 * dlc;
+}
+
+static uint32_t baud_bps(void) {
+	switch (app_get_configuration()->can_baud_rate) {
+	case CAN_BAUD_125K: return 125000;
+	case CAN_BAUD_250K: return 250000;
+	case CAN_BAUD_500K: return 500000;
+	case CAN_BAUD_1M: return 1000000;
+	default: return 500000;
+	}
+}
+
+/**
+ * Handle the firmware distribution frames, both as a receiving node and as
+ * the node that distributes the firmware.
+ */
+static void fw_rx_frame(uint8_t cmd, uint8_t *data, uint8_t len) {
+	int32_t ind = 0;
+	uint8_t buffer[8];
+
+	switch (cmd) {
+	case CAN_PACKET_FW_BEGIN: {
+		if (len < 7 || fw_busy) {
+			break;
+		}
+
+		fw_rx_sender_id = data[ind++];
+		uint32_t size = buffer_get_uint32(data, &ind);
+		fw_rx_crc = buffer_get_uint16(data, &ind);
+
+		if (size == 0 || size > (FW_MAX_CHUNKS * FW_CHUNK_SIZE)) {
+			break;
+		}
+
+		fw_rx_size = size;
+		fw_rx_chunks = (size + FW_CHUNK_SIZE - 1) / FW_CHUNK_SIZE;
+		memset(fw_rx_bitmap, 0, sizeof(fw_rx_bitmap));
+
+		bool ok = flash_helper_erase_new_app(size) == FLASH_COMPLETE;
+		fw_rx_active = ok;
+
+		ind = 0;
+		buffer[ind++] = app_get_configuration()->controller_id;
+		buffer[ind++] = FW_REPLY_ERASED;
+		buffer[ind++] = ok;
+		fw_tx_reply(buffer, ind);
+	} break;
+
+	case CAN_PACKET_FW_DATA: {
+		if (!fw_rx_active || len < 3) {
+			break;
+		}
+
+		uint16_t chunk = buffer_get_uint16(data, &ind);
+		if (chunk >= fw_rx_chunks || (fw_rx_bitmap[chunk / 8] & (1 << (chunk % 8)))) {
+			break;
+		}
+
+		if (flash_helper_write_new_app_data(chunk * FW_CHUNK_SIZE, data + ind, len - ind) == FLASH_COMPLETE) {
+			fw_rx_bitmap[chunk / 8] |= 1 << (chunk % 8);
+		}
+	} break;
+
+	case CAN_PACKET_FW_GET_MISSING: {
+		if (!fw_rx_active || len < 3) {
+			break;
+		}
+
+		fw_rx_sender_id = data[ind++];
+		uint16_t start = buffer_get_uint16(data, &ind);
+		uint16_t first = 0xFFFF;
+		uint32_t mask = 0;
+
+		for (uint32_t i = start;i < fw_rx_chunks;i++) {
+			if (!(fw_rx_bitmap[i / 8] & (1 << (i % 8)))) {
+				first = i;
+				break;
+			}
+		}
+
+		if (first != 0xFFFF) {
+			for (int i = 0;i < 32 && (first + 1 + i) < fw_rx_chunks;i++) {
+				uint32_t c = first + 1 + i;
+				if (!(fw_rx_bitmap[c / 8] & (1 << (c % 8)))) {
+					mask |= (uint32_t)1 << i;
+				}
+			}
+		}
+
+		ind = 0;
+		buffer[ind++] = app_get_configuration()->controller_id;
+		buffer[ind++] = FW_REPLY_MISSING;
+		buffer_append_uint16(buffer, first, &ind);
+		buffer_append_uint32(buffer, mask, &ind);
+		fw_tx_reply(buffer, ind);
+	} break;
+
+	case CAN_PACKET_FW_VERIFY: {
+		if (len < 1) {
+			break;
+		}
+
+		fw_rx_sender_id = data[ind++];
+
+		ind = 0;
+		buffer[ind++] = app_get_configuration()->controller_id;
+		buffer[ind++] = FW_REPLY_VERIFIED;
+		buffer[ind++] = fw_rx_active &&
+				crc16(flash_helper_get_new_app_address(), fw_rx_size) == fw_rx_crc;
+		fw_tx_reply(buffer, ind);
+		fw_rx_active = false;
+	} break;
+
+	case CAN_PACKET_FW_REPLY: {
+		if (!fw_busy || len < 3) {
+			break;
+		}
+
+		uint8_t id = data[ind++];
+		uint8_t type = data[ind++];
+
+		if (type == FW_REPLY_ERASED) {
+			if (fw_node_num < FW_MAX_NODES) {
+				fw_node_ids[fw_node_num] = id;
+				fw_node_states[fw_node_num] = data[ind] ? CAN_FW_NODE_ERASED : CAN_FW_NODE_FAILED;
+				fw_node_num++;
+			}
+		} else {
+			if (type == FW_REPLY_MISSING && len >= 8) {
+				fw_reply_first = buffer_get_uint16(data, &ind);
+				fw_reply_mask = buffer_get_uint32(data, &ind);
+			} else {
+				fw_reply_ok = data[ind];
+			}
+
+			fw_reply_type = type;
+			fw_reply_id = id;
+			chEvtSignal(fw_tp, (eventmask_t) 2);
+		}
+	} break;
+
+	default:
+		break;
+	}
+}
+
+static void fw_tx_reply(uint8_t *data, uint8_t len) {
+	comm_can_transmit_eid(fw_rx_sender_id |
+			((uint32_t)CAN_PACKET_FW_REPLY << 8), data, len);
+}
+
+static void fw_send_chunk(uint8_t id, uint16_t chunk) {
+	uint8_t buffer[8];
+	int32_t ind = 0;
+	uint32_t offset = (uint32_t)chunk * FW_CHUNK_SIZE;
+	uint32_t send_len = FW_CHUNK_SIZE;
+
+	if ((offset + send_len) > fw_size) {
+		send_len = fw_size - offset;
+	}
+
+	buffer_append_uint16(buffer, chunk, &ind);
+	memcpy(buffer + ind, flash_helper_get_new_app_address() + offset, send_len);
+	ind += send_len;
+
+	comm_can_transmit_eid(id | ((uint32_t)CAN_PACKET_FW_DATA << 8), buffer, ind);
+}
+
+static bool fw_wait_reply(int node_id, int type) {
+	systime_t start = chVTGetSystemTime();
+
+	while (ST2MS(chVTTimeElapsedSinceX(start)) < FW_REPLY_TIMEOUT_MS) {
+		chEvtWaitAnyTimeout((eventmask_t) 2, MS2ST(10));
+		if (fw_reply_id == node_id && fw_reply_type == type) {
+			return true;
+		}
+	}
+
+	return false;
+}
@@ -25,6 +25,23 @@
 // Settings
 #define CAN_STATUS_MSG_INT_MS		1
 #define CAN_STATUS_MSGS_TO_STORE	10
+#define CAN_STATS_PACKET_TYPES		32
+
+typedef struct {
+	uint32_t tx_frames[CAN_STATS_PACKET_TYPES];
+	uint32_t rx_frames[CAN_STATS_PACKET_TYPES];
+	uint32_t tx_mailbox_full;
+	uint32_t tx_timeouts;
+	uint32_t tx_wait_sum_us;
+	uint32_t tx_wait_max_us;
+	uint32_t bus_off_events;
+	uint32_t framing_errors;
+	uint32_t rx_overflows;
+	uint8_t tec;
+	uint8_t rec;
+	float bus_load;
+	float bus_load_max;
+} can_bus_stats;
 
 // Functions
 void comm_can_init(void);
@@ -41,5 +58,15 @@ void comm_can_set_current_rel(uint8_t controller_id, float current_rel);
 void comm_can_set_current_brake_rel(uint8_t controller_id, float current_rel);
 can_status_msg *comm_can_get_status_msg_index(int index);
 can_status_msg *comm_can_get_status_msg_id(int id);
+void comm_can_set_sync_master(bool master);
+bool comm_can_is_sync_master(void);
+bool comm_can_sync_is_valid(void);
+uint32_t comm_can_sync_time_us(void);
+void comm_can_get_sync_state(int *master_id, float *offset_us, float *drift_ppm);
+void comm_can_get_stats(can_bus_stats *s);
+void comm_can_reset_stats(void);
+bool comm_can_fw_distribute(uint32_t size, int nodes_expected,
+		void(*reply_func)(unsigned char *data, unsigned int len));
+uint32_t comm_can_sample_sync(debug_sampling_mode mode, uint16_t len, uint8_t decimation, int delay_ms);
 
 #endif /* COMM_CAN_H_ */
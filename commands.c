@@ -39,6 +39,7 @@
 #include "packet.h"
 #include "encoder.h"
 #include "nrf_driver.h"
+#include "conf_table.h"
 
 #include <math.h>
 #include <string.h>
@@ -64,6 +65,9 @@ static void(*send_func_last)(unsigned char *data, unsigned int len) = 0;
 static void(*appdata_func)(unsigned char *data, unsigned int len) = 0;
 static disp_pos_mode display_position_mode;
 
+// Private functions
+static void apply_mcconf_hw_limits(mc_configuration *conf);
+
 void commands_init(void) {
 	chThdCreateStatic(detect_thread_wa, sizeof(detect_thread_wa), NORMALPRIO, detect_thread, NULL);
 }
@@ -162,6 +166,27 @@ void commands_process_packet(unsigned char *data, unsigned int len) {
 		commands_send_packet(send_buffer, ind);
 		break;
 
+	case COMM_CAN_FW_DISTRIBUTE: {
+		// Firmware size and the number of nodes
+		bool ok = len >= 5;
+
+		if (ok) {
+			ind = 0;
+			uint32_t fw_size = buffer_get_uint32(data, &ind);
+			int nodes_expected = data[ind++];
+
+			// The result is sent when the distribution is done
+			ok = comm_can_fw_distribute(fw_size, nodes_expected, send_func);
+		}
+
+		if (!ok) {
+			ind = 0;
+			send_buffer[ind++] = COMM_CAN_FW_DISTRIBUTE;
+			send_buffer[ind++] = 0;
+			commands_send_packet(send_buffer, ind);
+		}
+	} break;
+
 	case COMM_GET_VALUES:
 		ind = 0;
 		send_buffer[ind++] = COMM_GET_VALUES;
@@ -252,36 +277,16 @@ void commands_process_packet(unsigned char *data, unsigned int len) {
 	case COMM_SET_MCCONF:
 		mcconf = *mc_interface_get_configuration();
 
+		// The reply is followed by 1 when the configuration was applied and
+		// by 0 when the packet did not contain a configuration in this layout.
 		ind = 0;
-		mcconf.pwm_mode = data[ind++];
-		mcconf.comm_mode = data[ind++];
-		mcconf.motor_type = data[ind++];
-		mcconf.sensor_mode = data[ind++];
-
-		mcconf.l_current_max = buffer_get_float32_auto(data, &ind);
-		mcconf.l_current_min = buffer_get_float32_auto(data, &ind);
-		mcconf.l_in_current_max = buffer_get_float32_auto(data, &ind);
-		mcconf.l_in_current_min = buffer_get_float32_auto(data, &ind);
-		mcconf.l_abs_current_max = buffer_get_float32_auto(data, &ind);
-		mcconf.l_min_erpm = buffer_get_float32_auto(data, &ind);
-		mcconf.l_max_erpm = buffer_get_float32_auto(data, &ind);
-		mcconf.l_erpm_start = buffer_get_float32_auto(data, &ind);
-		mcconf.l_max_erpm_fbrake = buffer_get_float32_auto(data, &ind);
-		mcconf.l_max_erpm_fbrake_cc = buffer_get_float32_auto(data, &ind);
-		mcconf.l_min_vin = buffer_get_float32_auto(data, &ind);
-		mcconf.l_max_vin = buffer_get_float32_auto(data, &ind);
-		mcconf.l_battery_cut_start = buffer_get_float32_auto(data, &ind);
-		mcconf.l_battery_cut_end = buffer_get_float32_auto(data, &ind);
-		mcconf.l_slow_abs_current = data[ind++];
-		mcconf.l_temp_fet_start = buffer_get_float32_auto(data, &ind);
-		mcconf.l_temp_fet_end = buffer_get_float32_auto(data, &ind);
-		mcconf.l_temp_motor_start = buffer_get_float32_auto(data, &ind);
-		mcconf.l_temp_motor_end = buffer_get_float32_auto(data, &ind);
-		mcconf.l_temp_accel_dec = buffer_get_float32_auto(data, &ind);
-		mcconf.l_min_duty = buffer_get_float32_auto(data, &ind);
-		mcconf.l_max_duty = buffer_get_float32_auto(data, &ind);
-		mcconf.l_watt_max = buffer_get_float32_auto(data, &ind);
-		mcconf.l_watt_min = buffer_get_float32_auto(data, &ind);
+		if (!conf_table_deserialize(CONF_TABLE_MCCONF, &mcconf, data, len, &ind)) {
+			ind = 0;
+			send_buffer[ind++] = packet_id;
+			send_buffer[ind++] = 0;
+			commands_send_packet(send_buffer, ind);
+			break;
+		}
 
 		mcconf.lo_current_max = mcconf.l_current_max;
 		mcconf.lo_current_min = mcconf.l_current_min;
@@ -290,110 +295,7 @@ void commands_process_packet(unsigned char *data, unsigned int len) {
 		mcconf.lo_current_motor_max_now = mcconf.l_current_max;
 		mcconf.lo_current_motor_min_now = mcconf.l_current_min;
 
-		mcconf.sl_min_erpm = buffer_get_float32_auto(data, &ind);
-		mcconf.sl_min_erpm_cycle_int_limit = buffer_get_float32_auto(data, &ind);
-		mcconf.sl_max_fullbreak_current_dir_change = buffer_get_float32_auto(data, &ind);
-		mcconf.sl_cycle_int_limit = buffer_get_float32_auto(data, &ind);
-		mcconf.sl_phase_advance_at_br = buffer_get_float32_auto(data, &ind);
-		mcconf.sl_cycle_int_rpm_br = buffer_get_float32_auto(data, &ind);
-		mcconf.sl_bemf_coupling_k = buffer_get_float32_auto(data, &ind);
-
-		memcpy(mcconf.hall_table, data + ind, 8);
-		ind += 8;
-		mcconf.hall_sl_erpm = buffer_get_float32_auto(data, &ind);
-
-		mcconf.foc_current_kp = buffer_get_float32_auto(data, &ind);
-		mcconf.foc_current_ki = buffer_get_float32_auto(data, &ind);
-		mcconf.foc_f_sw = buffer_get_float32_auto(data, &ind);
-		mcconf.foc_dt_us = buffer_get_float32_auto(data, &ind);
-		mcconf.foc_encoder_inverted = data[ind++];
-		mcconf.foc_encoder_offset = buffer_get_float32_auto(data, &ind);
-		mcconf.foc_encoder_ratio = buffer_get_float32_auto(data, &ind);
-		mcconf.foc_sensor_mode = data[ind++];
-		mcconf.foc_pll_kp = buffer_get_float32_auto(data, &ind);
-		mcconf.foc_pll_ki = buffer_get_float32_auto(data, &ind);
-		mcconf.foc_motor_l = buffer_get_float32_auto(data, &ind);
-		mcconf.foc_motor_r = buffer_get_float32_auto(data, &ind);
-		mcconf.foc_motor_flux_linkage = buffer_get_float32_auto(data, &ind);
-		mcconf.foc_observer_gain = buffer_get_float32_auto(data, &ind);
-		mcconf.foc_observer_gain_slow = buffer_get_float32_auto(data, &ind);
-		mcconf.foc_duty_dowmramp_kp = buffer_get_float32_auto(data, &ind);
-		mcconf.foc_duty_dowmramp_ki = buffer_get_float32_auto(data, &ind);
-		mcconf.foc_openloop_rpm = buffer_get_float32_auto(data, &ind);
-		mcconf.foc_sl_openloop_hyst = buffer_get_float32_auto(data, &ind);
-		mcconf.foc_sl_openloop_time = buffer_get_float32_auto(data, &ind);
-		mcconf.foc_sl_d_current_duty = buffer_get_float32_auto(data, &ind);
-		mcconf.foc_sl_d_current_factor = buffer_get_float32_auto(data, &ind);
-		memcpy(mcconf.foc_hall_table, data + ind, 8);
-		ind += 8;
-		mcconf.foc_sl_erpm = buffer_get_float32_auto(data, &ind);
-		mcconf.foc_sample_v0_v7 = data[ind++];
-		mcconf.foc_sample_high_current = data[ind++];
-		mcconf.foc_sat_comp = buffer_get_float32_auto(data, &ind);
-		mcconf.foc_temp_comp = data[ind++];
-		mcconf.foc_temp_comp_base_temp = buffer_get_float32_auto(data, &ind);
-
-		mcconf.s_pid_kp = buffer_get_float32_auto(data, &ind);
-		mcconf.s_pid_ki = buffer_get_float32_auto(data, &ind);
-		mcconf.s_pid_kd = buffer_get_float32_auto(data, &ind);
-		mcconf.s_pid_min_erpm = buffer_get_float32_auto(data, &ind);
-		mcconf.s_pid_allow_braking = data[ind++];
-
-		mcconf.p_pid_kp = buffer_get_float32_auto(data, &ind);
-		mcconf.p_pid_ki = buffer_get_float32_auto(data, &ind);
-		mcconf.p_pid_kd = buffer_get_float32_auto(data, &ind);
-		mcconf.p_pid_ang_div = buffer_get_float32_auto(data, &ind);
-
-		mcconf.cc_startup_boost_duty = buffer_get_float32_auto(data, &ind);
-		mcconf.cc_min_current = buffer_get_float32_auto(data, &ind);
-		mcconf.cc_gain = buffer_get_float32_auto(data, &ind);
-		mcconf.cc_ramp_step_max = buffer_get_float32_auto(data, &ind);
-
-		mcconf.m_fault_stop_time_ms = buffer_get_int32(data, &ind);
-		mcconf.m_duty_ramp_step = buffer_get_float32_auto(data, &ind);
-		mcconf.m_current_backoff_gain = buffer_get_float32_auto(data, &ind);
-		mcconf.m_encoder_counts = buffer_get_uint32(data, &ind);
-		mcconf.m_sensor_port_mode = data[ind++];
-		mcconf.m_invert_direction = data[ind++];
-		mcconf.m_drv8301_oc_mode = data[ind++];
-		mcconf.m_drv8301_oc_adj = data[ind++];
-		mcconf.m_bldc_f_sw_min = buffer_get_float32_auto(data, &ind);
-		mcconf.m_bldc_f_sw_max = buffer_get_float32_auto(data, &ind);
-		mcconf.m_dc_f_sw = buffer_get_float32_auto(data, &ind);
-		mcconf.m_ntc_motor_beta = buffer_get_float32_auto(data, &ind);
-
-		// Apply limits if they are defined
-#ifndef DISABLE_HW_LIMITS
-#ifdef HW_LIM_CURRENT
-		utils_truncate_number(&mcconf.l_current_max, HW_LIM_CURRENT);
-		utils_truncate_number(&mcconf.l_current_min, HW_LIM_CURRENT);
-#endif
-#ifdef HW_LIM_CURRENT_IN
-		utils_truncate_number(&mcconf.l_in_current_max, HW_LIM_CURRENT_IN);
-		utils_truncate_number(&mcconf.l_in_current_min, HW_LIM_CURRENT);
-#endif
-#ifdef HW_LIM_CURRENT_ABS
-		utils_truncate_number(&mcconf.l_abs_current_max, HW_LIM_CURRENT_ABS);
-#endif
-#ifdef HW_LIM_VIN
-		utils_truncate_number(&mcconf.l_max_vin, HW_LIM_VIN);
-		utils_truncate_number(&mcconf.l_min_vin, HW_LIM_VIN);
-#endif
-#ifdef HW_LIM_ERPM
-		utils_truncate_number(&mcconf.l_max_erpm, HW_LIM_ERPM);
-		utils_truncate_number(&mcconf.l_min_erpm, HW_LIM_ERPM);
-#endif
-#ifdef HW_LIM_DUTY_MIN
-		utils_truncate_number(&mcconf.l_min_duty, HW_LIM_DUTY_MIN);
-#endif
-#ifdef HW_LIM_DUTY_MAX
-		utils_truncate_number(&mcconf.l_max_duty, HW_LIM_DUTY_MAX);
-#endif
-#ifdef HW_LIM_TEMP_FET
-		utils_truncate_number(&mcconf.l_temp_fet_start, HW_LIM_TEMP_FET);
-		utils_truncate_number(&mcconf.l_temp_fet_end, HW_LIM_TEMP_FET);
-#endif
-#endif
+		apply_mcconf_hw_limits(&mcconf);
 
 		conf_general_store_mc_configuration(&mcconf);
 		mc_interface_set_configuration(&mcconf);
@@ -401,9 +303,127 @@ void commands_process_packet(unsigned char *data, unsigned int len) {
 
 		ind = 0;
 		send_buffer[ind++] = packet_id;
+		send_buffer[ind++] = 1;
 		commands_send_packet(send_buffer, ind);
 		break;
 
+	case COMM_SET_MCCONF_FIELDS: {
+		// [store] [field count] followed by [field id] [value] pairs
+		mcconf = *mc_interface_get_configuration();
+
+		ind = 0;
+		bool store = data[ind++];
+		int fields = data[ind++];
+		int fields_set = 0;
+
+		for (int i = 0;i < fields;i++) {
+			if ((ind + 2) > (int32_t)len) {
+				break;
+			}
+
+			const conf_field *field = conf_table_field(CONF_TABLE_MCCONF, buffer_get_uint16(data, &ind));
+			if (!field || (ind + conf_table_field_size(field)) > (int32_t)len) {
+				break;
+			}
+
+			conf_table_field_get(field, &mcconf, data, &ind);
+			fields_set++;
+		}
+
+		// Only apply the update if all fields could be decoded
+		if (fields_set == fields) {
+			mcconf.lo_current_max = mcconf.l_current_max;
+			mcconf.lo_current_min = mcconf.l_current_min;
+			mcconf.lo_in_current_max = mcconf.l_in_current_max;
+			mcconf.lo_in_current_min = mcconf.l_in_current_min;
+			mcconf.lo_current_motor_max_now = mcconf.l_current_max;
+			mcconf.lo_current_motor_min_now = mcconf.l_current_min;
+
+			apply_mcconf_hw_limits(&mcconf);
+
+			if (store) {
+				conf_general_store_mc_configuration(&mcconf);
+			}
+			mc_interface_set_configuration(&mcconf);
+		}
+
+		ind = 0;
+		send_buffer[ind++] = packet_id;
+		send_buffer[ind++] = fields_set == fields;
+		send_buffer[ind++] = fields_set;
+		commands_send_packet(send_buffer, ind);
+	} break;
+
+	case COMM_GET_MCCONF_FIELDS: {
+		// [field count] followed by field ids. The reply has the same format as
+		// COMM_SET_MCCONF_FIELDS without the store byte. Unknown fields are skipped.
+		mcconf = *mc_interface_get_configuration();
+
+		int32_t ind_rx = 0;
+		int fields = data[ind_rx++];
+		int fields_sent = 0;
+
+		ind = 0;
+		send_buffer[ind++] = packet_id;
+		send_buffer[ind++] = 0;
+
+		for (int i = 0;i < fields && (ind_rx + 2) <= (int32_t)len;i++) {
+			uint16_t id = buffer_get_uint16(data, &ind_rx);
+			const conf_field *field = conf_table_field(CONF_TABLE_MCCONF, id);
+
+			if (field && (ind + 2 + conf_table_field_size(field)) <= PACKET_MAX_PL_LEN) {
+				buffer_append_uint16(send_buffer, id, &ind);
+				conf_table_field_append(field, &mcconf, send_buffer, &ind);
+				fields_sent++;
+			}
+		}
+
+		send_buffer[1] = fields_sent;
+		commands_send_packet(send_buffer, ind);
+	} break;
+
+	case COMM_GET_CONF_SCHEMA: {
+		// [table] [first field index]. The reply contains as many field descriptors
+		// as fit in one packet, so the host has to ask again from start + count
+		// until it has all of them.
+		int32_t ind_rx = 0;
+		conf_table_type table = data[ind_rx++];
+		int start = buffer_get_uint16(data, &ind_rx);
+		int total = conf_table_field_count(table);
+
+		ind = 0;
+		send_buffer[ind++] = packet_id;
+		send_buffer[ind++] = table;
+		buffer_append_uint32(send_buffer, conf_table_hash(table), &ind);
+		buffer_append_uint16(send_buffer, total, &ind);
+		buffer_append_uint16(send_buffer, start, &ind);
+		int count_ind = ind++;
+		int count = 0;
+
+		for (int i = start;i < total && count < 255;i++) {
+			const conf_field *field = conf_table_field_at(table, i);
+			float def = field->def;
+
+			if ((ind + 12) > PACKET_MAX_PL_LEN) {
+				break;
+			}
+
+			if (field->type == CONF_TYPE_BYTES) {
+				def = 0.0;
+			}
+
+			buffer_append_uint16(send_buffer, field->id, &ind);
+			send_buffer[ind++] = field->type;
+			send_buffer[ind++] = conf_table_field_size(field);
+			buffer_append_float32_auto(send_buffer, field->scale, &ind);
+			buffer_append_float32_auto(send_buffer, def, &ind);
+			count++;
+		}
+
+		send_buffer[count_ind] = count;
+		commands_send_packet(send_buffer, ind);
+	} break;
+
 	case COMM_GET_MCCONF:
 	case COMM_GET_MCCONF_DEFAULT:
 		if (packet_id == COMM_GET_MCCONF) {
@@ -415,107 +435,7 @@ void commands_process_packet(unsigned char *data, unsigned int len) {
 		ind = 0;
 		send_buffer[ind++] = packet_id;
 
-		send_buffer[ind++] = mcconf.pwm_mode;
-		send_buffer[ind++] = mcconf.comm_mode;
-		send_buffer[ind++] = mcconf.motor_type;
-		send_buffer[ind++] = mcconf.sensor_mode;
-
-		buffer_append_float32_auto(send_buffer, mcconf.l_current_max, &ind);
-		buffer_append_float32_auto(send_buffer, mcconf.l_current_min, &ind);
-		buffer_append_float32_auto(send_buffer, mcconf.l_in_current_max, &ind);
-		buffer_append_float32_auto(send_buffer, mcconf.l_in_current_min, &ind);
-		buffer_append_float32_auto(send_buffer, mcconf.l_abs_current_max, &ind);
-		buffer_append_float32_auto(send_buffer, mcconf.l_min_erpm, &ind);
-		buffer_append_float32_auto(send_buffer, mcconf.l_max_erpm, &ind);
-		buffer_append_float32_auto(send_buffer, mcconf.l_erpm_start, &ind);
-		buffer_append_float32_auto(send_buffer, mcconf.l_max_erpm_fbrake, &ind);
-		buffer_append_float32_auto(send_buffer, mcconf.l_max_erpm_fbrake_cc, &ind);
-		buffer_append_float32_auto(send_buffer, mcconf.l_min_vin, &ind);
-		buffer_append_float32_auto(send_buffer, mcconf.l_max_vin, &ind);
-		buffer_append_float32_auto(send_buffer, mcconf.l_battery_cut_start, &ind);
-		buffer_append_float32_auto(send_buffer, mcconf.l_battery_cut_end, &ind);
-		send_buffer[ind++] = mcconf.l_slow_abs_current;
-		buffer_append_float32_auto(send_buffer, mcconf.l_temp_fet_start, &ind);
-		buffer_append_float32_auto(send_buffer, mcconf.l_temp_fet_end, &ind);
-		buffer_append_float32_auto(send_buffer, mcconf.l_temp_motor_start, &ind);
-		buffer_append_float32_auto(send_buffer, mcconf.l_temp_motor_end, &ind);
-		buffer_append_float32_auto(send_buffer, mcconf.l_temp_accel_dec, &ind);
-		buffer_append_float32_auto(send_buffer, mcconf.l_min_duty, &ind);
-		buffer_append_float32_auto(send_buffer, mcconf.l_max_duty, &ind);
-		buffer_append_float32_auto(send_buffer, mcconf.l_watt_max, &ind);
-		buffer_append_float32_auto(send_buffer, mcconf.l_watt_min, &ind);
-
-		buffer_append_float32_auto(send_buffer, mcconf.sl_min_erpm, &ind);
-		buffer_append_float32_auto(send_buffer, mcconf.sl_min_erpm_cycle_int_limit, &ind);
-		buffer_append_float32_auto(send_buffer, mcconf.sl_max_fullbreak_current_dir_change, &ind);
-		buffer_append_float32_auto(send_buffer, mcconf.sl_cycle_int_limit, &ind);
-		buffer_append_float32_auto(send_buffer, mcconf.sl_phase_advance_at_br, &ind);
-		buffer_append_float32_auto(send_buffer, mcconf.sl_cycle_int_rpm_br, &ind);
-		buffer_append_float32_auto(send_buffer, mcconf.sl_bemf_coupling_k, &ind);
-
-		memcpy(send_buffer + ind, mcconf.hall_table, 8);
-		ind += 8;
-		buffer_append_float32_auto(send_buffer, mcconf.hall_sl_erpm, &ind);
-
-		buffer_append_float32_auto(send_buffer, mcconf.foc_current_kp, &ind);
-		buffer_append_float32_auto(send_buffer, mcconf.foc_current_ki, &ind);
-		buffer_append_float32_auto(send_buffer, mcconf.foc_f_sw, &ind);
-		buffer_append_float32_auto(send_buffer, mcconf.foc_dt_us, &ind);
-		send_buffer[ind++] = mcconf.foc_encoder_inverted;
-		buffer_append_float32_auto(send_buffer, mcconf.foc_encoder_offset, &ind);
-		buffer_append_float32_auto(send_buffer, mcconf.foc_encoder_ratio, &ind);
-		send_buffer[ind++] = mcconf.foc_sensor_mode;
-		buffer_append_float32_auto(send_buffer, mcconf.foc_pll_kp, &ind);
-		buffer_append_float32_auto(send_buffer, mcconf.foc_pll_ki, &ind);
-		buffer_append_float32_auto(send_buffer, mcconf.foc_motor_l, &ind);
-		buffer_append_float32_auto(send_buffer, mcconf.foc_motor_r, &ind);
-		buffer_append_float32_auto(send_buffer, mcconf.foc_motor_flux_linkage, &ind);
-		buffer_append_float32_auto(send_buffer, mcconf.foc_observer_gain, &ind);
-		buffer_append_float32_auto(send_buffer, mcconf.foc_observer_gain_slow, &ind);
-		buffer_append_float32_auto(send_buffer, mcconf.foc_duty_dowmramp_kp, &ind);
-		buffer_append_float32_auto(send_buffer, mcconf.foc_duty_dowmramp_ki, &ind);
-		buffer_append_float32_auto(send_buffer, mcconf.foc_openloop_rpm, &ind);
-		buffer_append_float32_auto(send_buffer, mcconf.foc_sl_openloop_hyst, &ind);
-		buffer_append_float32_auto(send_buffer, mcconf.foc_sl_openloop_time, &ind);
-		buffer_append_float32_auto(send_buffer, mcconf.foc_sl_d_current_duty, &ind);
-		buffer_append_float32_auto(send_buffer, mcconf.foc_sl_d_current_factor, &ind);
-		memcpy(send_buffer + ind, mcconf.foc_hall_table, 8);
-		ind += 8;
-		buffer_append_float32_auto(send_buffer, mcconf.foc_sl_erpm, &ind);
-		send_buffer[ind++] = mcconf.foc_sample_v0_v7;
-		send_buffer[ind++] = mcconf.foc_sample_high_current;
-		buffer_append_float32_auto(send_buffer, mcconf.foc_sat_comp, &ind);
-		send_buffer[ind++] = mcconf.foc_temp_comp;
-		buffer_append_float32_auto(send_buffer, mcconf.foc_temp_comp_base_temp, &ind);
-
-		buffer_append_float32_auto(send_buffer, mcconf.s_pid_kp, &ind);
-		buffer_append_float32_auto(send_buffer, mcconf.s_pid_ki, &ind);
-		buffer_append_float32_auto(send_buffer, mcconf.s_pid_kd, &ind);
-		buffer_append_float32_auto(send_buffer, mcconf.s_pid_min_erpm, &ind);
-		send_buffer[ind++] = mcconf.s_pid_allow_braking;
-
-		buffer_append_float32_auto(send_buffer, mcconf.p_pid_kp, &ind);
-		buffer_append_float32_auto(send_buffer, mcconf.p_pid_ki, &ind);
-		buffer_append_float32_auto(send_buffer, mcconf.p_pid_kd, &ind);
-		buffer_append_float32_auto(send_buffer, mcconf.p_pid_ang_div, &ind);
-
-		buffer_append_float32_auto(send_buffer, mcconf.cc_startup_boost_duty, &ind);
-		buffer_append_float32_auto(send_buffer, mcconf.cc_min_current, &ind);
-		buffer_append_float32_auto(send_buffer, mcconf.cc_gain, &ind);
-		buffer_append_float32_auto(send_buffer, mcconf.cc_ramp_step_max, &ind);
-
-		buffer_append_int32(send_buffer, mcconf.m_fault_stop_time_ms, &ind);
-		buffer_append_float32_auto(send_buffer, mcconf.m_duty_ramp_step, &ind);
-		buffer_append_float32_auto(send_buffer, mcconf.m_current_backoff_gain, &ind);
-		buffer_append_uint32(send_buffer, mcconf.m_encoder_counts, &ind);
-		send_buffer[ind++] = mcconf.m_sensor_port_mode;
-		send_buffer[ind++] = mcconf.m_invert_direction;
-		send_buffer[ind++] = mcconf.m_drv8301_oc_mode;
-		send_buffer[ind++] = mcconf.m_drv8301_oc_adj;
-		buffer_append_float32_auto(send_buffer, mcconf.m_bldc_f_sw_min, &ind);
-		buffer_append_float32_auto(send_buffer, mcconf.m_bldc_f_sw_max, &ind);
-		buffer_append_float32_auto(send_buffer, mcconf.m_dc_f_sw, &ind);
-		buffer_append_float32_auto(send_buffer, mcconf.m_ntc_motor_beta, &ind);
+		conf_table_serialize(CONF_TABLE_MCCONF, &mcconf, send_buffer, &ind);
 
 		commands_send_packet(send_buffer, ind);
 		break;
@@ -523,79 +443,15 @@ void commands_process_packet(unsigned char *data, unsigned int len) {
 	case COMM_SET_APPCONF:
 		appconf = *app_get_configuration();
 
+		// Same reply as for COMM_SET_MCCONF
 		ind = 0;
-		appconf.controller_id = data[ind++];
-		appconf.timeout_msec = buffer_get_uint32(data, &ind);
-		appconf.timeout_brake_current = buffer_get_float32_auto(data, &ind);
-		appconf.send_can_status = data[ind++];
-		appconf.send_can_status_rate_hz = buffer_get_uint16(data, &ind);
-		appconf.can_baud_rate = data[ind++];
-
-		appconf.app_to_use = data[ind++];
-
-		appconf.app_ppm_conf.ctrl_type = data[ind++];
-		appconf.app_ppm_conf.pid_max_erpm = buffer_get_float32_auto(data, &ind);
-		appconf.app_ppm_conf.hyst = buffer_get_float32_auto(data, &ind);
-		appconf.app_ppm_conf.pulse_start = buffer_get_float32_auto(data, &ind);
-		appconf.app_ppm_conf.pulse_end = buffer_get_float32_auto(data, &ind);
-		appconf.app_ppm_conf.pulse_center = buffer_get_float32_auto(data, &ind);
-		appconf.app_ppm_conf.median_filter = data[ind++];
-		appconf.app_ppm_conf.safe_start = data[ind++];
-		appconf.app_ppm_conf.throttle_exp = buffer_get_float32_auto(data, &ind);
-		appconf.app_ppm_conf.throttle_exp_brake = buffer_get_float32_auto(data, &ind);
-		appconf.app_ppm_conf.throttle_exp_mode = data[ind++];
-		appconf.app_ppm_conf.ramp_time_pos = buffer_get_float32_auto(data, &ind);
-		appconf.app_ppm_conf.ramp_time_neg = buffer_get_float32_auto(data, &ind);
-		appconf.app_ppm_conf.multi_esc = data[ind++];
-		appconf.app_ppm_conf.tc = data[ind++];
-		appconf.app_ppm_conf.tc_max_diff = buffer_get_float32_auto(data, &ind);
-
-		appconf.app_adc_conf.ctrl_type = data[ind++];
-		appconf.app_adc_conf.hyst = buffer_get_float32_auto(data, &ind);
-		appconf.app_adc_conf.voltage_start = buffer_get_float32_auto(data, &ind);
-		appconf.app_adc_conf.voltage_end = buffer_get_float32_auto(data, &ind);
-		appconf.app_adc_conf.voltage_center = buffer_get_float32_auto(data, &ind);
-		appconf.app_adc_conf.voltage2_start = buffer_get_float32_auto(data, &ind);
-		appconf.app_adc_conf.voltage2_end = buffer_get_float32_auto(data, &ind);
-		appconf.app_adc_conf.use_filter = data[ind++];
-		appconf.app_adc_conf.safe_start = data[ind++];
-		appconf.app_adc_conf.cc_button_inverted = data[ind++];
-		appconf.app_adc_conf.rev_button_inverted = data[ind++];
-		appconf.app_adc_conf.voltage_inverted = data[ind++];
-		appconf.app_adc_conf.voltage2_inverted = data[ind++];
-		appconf.app_adc_conf.throttle_exp = buffer_get_float32_auto(data, &ind);
-		appconf.app_adc_conf.throttle_exp_brake = buffer_get_float32_auto(data, &ind);
-		appconf.app_adc_conf.throttle_exp_mode = data[ind++];
-		appconf.app_adc_conf.ramp_time_pos = buffer_get_float32_auto(data, &ind);
-		appconf.app_adc_conf.ramp_time_neg = buffer_get_float32_auto(data, &ind);
-		appconf.app_adc_conf.multi_esc = data[ind++];
-		appconf.app_adc_conf.tc = data[ind++];
-		appconf.app_adc_conf.tc_max_diff = buffer_get_float32_auto(data, &ind);
-		appconf.app_adc_conf.update_rate_hz = buffer_get_uint16(data, &ind);
-
-		appconf.app_uart_baudrate = buffer_get_uint32(data, &ind);
-
-		appconf.app_chuk_conf.ctrl_type = data[ind++];
-		appconf.app_chuk_conf.hyst = buffer_get_float32_auto(data, &ind);
-		appconf.app_chuk_conf.ramp_time_pos = buffer_get_float32_auto(data, &ind);
-		appconf.app_chuk_conf.ramp_time_neg = buffer_get_float32_auto(data, &ind);
-		appconf.app_chuk_conf.stick_erpm_per_s_in_cc = buffer_get_float32_auto(data, &ind);
-		appconf.app_chuk_conf.throttle_exp = buffer_get_float32_auto(data, &ind);
-		appconf.app_chuk_conf.throttle_exp_brake = buffer_get_float32_auto(data, &ind);
-		appconf.app_chuk_conf.throttle_exp_mode = data[ind++];
-		appconf.app_chuk_conf.multi_esc = data[ind++];
-		appconf.app_chuk_conf.tc = data[ind++];
-		appconf.app_chuk_conf.tc_max_diff = buffer_get_float32_auto(data, &ind);
-
-		appconf.app_nrf_conf.speed = data[ind++];
-		appconf.app_nrf_conf.power = data[ind++];
-		appconf.app_nrf_conf.crc_type = data[ind++];
-		appconf.app_nrf_conf.retry_delay = data[ind++];
-		appconf.app_nrf_conf.retries = data[ind++];
-		appconf.app_nrf_conf.channel = data[ind++];
-		memcpy(appconf.app_nrf_conf.address, data + ind, 3);
-		ind += 3;
-		appconf.app_nrf_conf.send_crc_ack = data[ind++];
+		if (!conf_table_deserialize(CONF_TABLE_APPCONF, &appconf, data, len, &ind)) {
+			ind = 0;
+			send_buffer[ind++] = packet_id;
+			send_buffer[ind++] = 0;
+			commands_send_packet(send_buffer, ind);
+			break;
+		}
 
 		conf_general_store_app_configuration(&appconf);
 		app_set_configuration(&appconf);
@@ -604,6 +460,7 @@ void commands_process_packet(unsigned char *data, unsigned int len) {
 
 		ind = 0;
 		send_buffer[ind++] = packet_id;
+		send_buffer[ind++] = 1;
 		commands_send_packet(send_buffer, ind);
 		break;
 
@@ -704,6 +561,60 @@ void commands_process_packet(unsigned char *data, unsigned int len) {
 	}
 	break;
 
+	case COMM_AUTOTUNE_PID: {
+		bool res = false;
+		float ku, tu, kp, ki, kd, rise_time, settling_time, overshoot;
+
+		send_func_last = send_func;
+
+		if (len >= 10) {
+			const volatile mc_configuration *conf = mc_interface_get_configuration();
+
+			ind = 0;
+			bool pos = data[ind++];
+			float setpoint = buffer_get_float32(data, 1e3, &ind);
+			float current = buffer_get_float32(data, 1e3, &ind);
+			int rule = data[ind++];
+
+			// Same checks as the autotune_pid terminal command
+			if ((pos || (setpoint != 0.0 && fabsf(setpoint) >= conf->s_pid_min_erpm)) &&
+					current > 0.0 && current <= conf->l_current_max &&
+					rule >= PID_TUNE_RULE_ZN_PID && rule <= PID_TUNE_RULE_NO_OVERSHOOT) {
+				res = conf_general_autotune_pid(pos, setpoint, current, rule, &ku, &tu,
+						&kp, &ki, &kd, &rise_time, &settling_time, &overshoot);
+			}
+		}
+
+		if (!res) {
+			ku = 0.0;
+			tu = 0.0;
+			kp = 0.0;
+			ki = 0.0;
+			kd = 0.0;
+			rise_time = 0.0;
+			settling_time = 0.0;
+			overshoot = 0.0;
+		}
+
+		ind = 0;
+		send_buffer[ind++] = COMM_AUTOTUNE_PID;
+		send_buffer[ind++] = res;
+		buffer_append_float32(send_buffer, ku, 1e6, &ind);
+		buffer_append_float32(send_buffer, tu, 1e6, &ind);
+		buffer_append_float32(send_buffer, kp, 1e6, &ind);
+		buffer_append_float32(send_buffer, ki, 1e6, &ind);
+		buffer_append_float32(send_buffer, kd, 1e6, &ind);
+		buffer_append_float32(send_buffer, rise_time, 1e6, &ind);
+		buffer_append_float32(send_buffer, settling_time, 1e6, &ind);
+		buffer_append_float32(send_buffer, overshoot, 1e3, &ind);
+		if (send_func_last) {
+			send_func_last(send_buffer, ind);
+		} else {
+			commands_send_packet(send_buffer, ind);
+		}
+	}
+	break;
+
 	case COMM_DETECT_ENCODER: {
 		if (encoder_is_configured()) {
 			mcconf = *mc_interface_get_configuration();
@@ -855,6 +766,42 @@ void commands_process_packet(unsigned char *data, unsigned int len) {
 		commands_send_packet(send_buffer, ind);
 		break;
 
+	case COMM_GET_CAN_STATS: {
+		can_bus_stats stats;
+		comm_can_get_stats(&stats);
+
+		uint32_t tx_tot = stats.tx_timeouts;
+		for (int i = 0;i < CAN_STATS_PACKET_TYPES;i++) {
+			tx_tot += stats.tx_frames[i];
+		}
+
+		ind = 0;
+		send_buffer[ind++] = packet_id;
+		buffer_append_float32_auto(send_buffer, stats.bus_load, &ind);
+		buffer_append_float32_auto(send_buffer, stats.bus_load_max, &ind);
+		send_buffer[ind++] = stats.tec;
+		send_buffer[ind++] = stats.rec;
+		buffer_append_uint32(send_buffer, stats.bus_off_events, &ind);
+		buffer_append_uint32(send_buffer, stats.framing_errors, &ind);
+		buffer_append_uint32(send_buffer, stats.rx_overflows, &ind);
+		buffer_append_uint32(send_buffer, stats.tx_mailbox_full, &ind);
+		buffer_append_uint32(send_buffer, stats.tx_timeouts, &ind);
+		buffer_append_float32_auto(send_buffer, tx_tot > 0 ?
+				(float)stats.tx_wait_sum_us / (float)tx_tot : 0.0, &ind);
+		buffer_append_uint32(send_buffer, stats.tx_wait_max_us, &ind);
+		send_buffer[ind++] = CAN_STATS_PACKET_TYPES;
+		for (int i = 0;i < CAN_STATS_PACKET_TYPES;i++) {
+			buffer_append_uint32(send_buffer, stats.tx_frames[i], &ind);
+			buffer_append_uint32(send_buffer, stats.rx_frames[i], &ind);
+		}
+		commands_send_packet(send_buffer, ind);
+
+		// An optional first byte set to 1 resets the counters after reading them
+		if (len > 0 && data[0]) {
+			comm_can_reset_stats();
+		}
+	} break;
+
 	default:
 		break;
 	}
@@ -923,79 +870,7 @@ void commands_send_app_data(unsigned char *data, unsigned int len) {
 void commands_send_appconf(COMM_PACKET_ID packet_id, app_configuration *appconf) {
 	int32_t ind = 0;
 	send_buffer[ind++] = packet_id;
-	send_buffer[ind++] = appconf->controller_id;
-	buffer_append_uint32(send_buffer, appconf->timeout_msec, &ind);
-	buffer_append_float32_auto(send_buffer, appconf->timeout_brake_current, &ind);
-	send_buffer[ind++] = appconf->send_can_status;
-	buffer_append_uint16(send_buffer, appconf->send_can_status_rate_hz, &ind);
-	send_buffer[ind++] = appconf->can_baud_rate;
-
-	send_buffer[ind++] = appconf->app_to_use;
-
-	send_buffer[ind++] = appconf->app_ppm_conf.ctrl_type;
-	buffer_append_float32_auto(send_buffer, appconf->app_ppm_conf.pid_max_erpm, &ind);
-	buffer_append_float32_auto(send_buffer, appconf->app_ppm_conf.hyst, &ind);
-	buffer_append_float32_auto(send_buffer, appconf->app_ppm_conf.pulse_start, &ind);
-	buffer_append_float32_auto(send_buffer, appconf->app_ppm_conf.pulse_end, &ind);
-	buffer_append_float32_auto(send_buffer, appconf->app_ppm_conf.pulse_center, &ind);
-	send_buffer[ind++] = appconf->app_ppm_conf.median_filter;
-	send_buffer[ind++] = appconf->app_ppm_conf.safe_start;
-	buffer_append_float32_auto(send_buffer, appconf->app_ppm_conf.throttle_exp, &ind);
-	buffer_append_float32_auto(send_buffer, appconf->app_ppm_conf.throttle_exp_brake, &ind);
-	send_buffer[ind++] = appconf->app_ppm_conf.throttle_exp_mode;
-	buffer_append_float32_auto(send_buffer, appconf->app_ppm_conf.ramp_time_pos, &ind);
-	buffer_append_float32_auto(send_buffer, appconf->app_ppm_conf.ramp_time_neg, &ind);
-	send_buffer[ind++] = appconf->app_ppm_conf.multi_esc;
-	send_buffer[ind++] = appconf->app_ppm_conf.tc;
-	buffer_append_float32_auto(send_buffer, appconf->app_ppm_conf.tc_max_diff, &ind);
-
-	send_buffer[ind++] = appconf->app_adc_conf.ctrl_type;
-	buffer_append_float32_auto(send_buffer, appconf->app_adc_conf.hyst, &ind);
-	buffer_append_float32_auto(send_buffer, appconf->app_adc_conf.voltage_start, &ind);
-	buffer_append_float32_auto(send_buffer, appconf->app_adc_conf.voltage_end, &ind);
-	buffer_append_float32_auto(send_buffer, appconf->app_adc_conf.voltage_center, &ind);
-	buffer_append_float32_auto(send_buffer, appconf->app_adc_conf.voltage2_start, &ind);
-	buffer_append_float32_auto(send_buffer, appconf->app_adc_conf.voltage2_end, &ind);
-	send_buffer[ind++] = appconf->app_adc_conf.use_filter;
-	send_buffer[ind++] = appconf->app_adc_conf.safe_start;
-	send_buffer[ind++] = appconf->app_adc_conf.cc_button_inverted;
-	send_buffer[ind++] = appconf->app_adc_conf.rev_button_inverted;
-	send_buffer[ind++] = appconf->app_adc_conf.voltage_inverted;
-	send_buffer[ind++] = appconf->app_adc_conf.voltage2_inverted;
-	buffer_append_float32_auto(send_buffer, appconf->app_adc_conf.throttle_exp, &ind);
-	buffer_append_float32_auto(send_buffer, appconf->app_adc_conf.throttle_exp_brake, &ind);
-	send_buffer[ind++] = appconf->app_adc_conf.throttle_exp_mode;
-	buffer_append_float32_auto(send_buffer, appconf->app_adc_conf.ramp_time_pos, &ind);
-	buffer_append_float32_auto(send_buffer, appconf->app_adc_conf.ramp_time_neg, &ind);
-	send_buffer[ind++] = appconf->app_adc_conf.multi_esc;
-	send_buffer[ind++] = appconf->app_adc_conf.tc;
-	buffer_append_float32_auto(send_buffer, appconf->app_adc_conf.tc_max_diff, &ind);
-	buffer_append_uint16(send_buffer, appconf->app_adc_conf.update_rate_hz, &ind);
-
-	buffer_append_uint32(send_buffer, appconf->app_uart_baudrate, &ind);
-
-	send_buffer[ind++] = appconf->app_chuk_conf.ctrl_type;
-	buffer_append_float32_auto(send_buffer, appconf->app_chuk_conf.hyst, &ind);
-	buffer_append_float32_auto(send_buffer, appconf->app_chuk_conf.ramp_time_pos, &ind);
-	buffer_append_float32_auto(send_buffer, appconf->app_chuk_conf.ramp_time_neg, &ind);
-	buffer_append_float32_auto(send_buffer, appconf->app_chuk_conf.stick_erpm_per_s_in_cc, &ind);
-	buffer_append_float32_auto(send_buffer, appconf->app_chuk_conf.throttle_exp, &ind);
-	buffer_append_float32_auto(send_buffer, appconf->app_chuk_conf.throttle_exp_brake, &ind);
-	send_buffer[ind++] = appconf->app_chuk_conf.throttle_exp_mode;
-	send_buffer[ind++] = appconf->app_chuk_conf.multi_esc;
-	send_buffer[ind++] = appconf->app_chuk_conf.tc;
-	buffer_append_float32_auto(send_buffer, appconf->app_chuk_conf.tc_max_diff, &ind);
-
-	send_buffer[ind++] = appconf->app_nrf_conf.speed;
-	send_buffer[ind++] = appconf->app_nrf_conf.power;
-	send_buffer[ind++] = appconf->app_nrf_conf.crc_type;
-	send_buffer[ind++] = appconf->app_nrf_conf.retry_delay;
-	send_buffer[ind++] = appconf->app_nrf_conf.retries;
-	send_buffer[ind++] = appconf->app_nrf_conf.channel;
-	memcpy(send_buffer + ind, appconf->app_nrf_conf.address, 3);
-	ind += 3;
-	send_buffer[ind++] = appconf->app_nrf_conf.send_crc_ack;
-
+	conf_table_serialize(CONF_TABLE_APPCONF, appconf, send_buffer, &ind);
 	commands_send_packet(send_buffer, ind);
 }
 
@@ -1031,3 +906,46 @@ static THD_FUNCTION(detect_thread, arg) {
 		}
 	}
 }
+
+/**
+ * Truncate the limits in a motor configuration to what the hardware
+ * supports, if such limits are defined for the hardware.
+ *
+ * @param conf
+ * The configuration to truncate.
+ */
+static void apply_mcconf_hw_limits(mc_configuration *conf) {
+	(void)conf;
+
+#ifndef DISABLE_HW_LIMITS
+#ifdef HW_LIM_CURRENT
+	utils_truncate_number(&conf->l_current_max, HW_LIM_CURRENT);
+	utils_truncate_number(&conf->l_current_min, HW_LIM_CURRENT);
+#endif
+#ifdef HW_LIM_CURRENT_IN
+	utils_truncate_number(&conf->l_in_current_max, HW_LIM_CURRENT_IN);
+	utils_truncate_number(&conf->l_in_current_min, HW_LIM_CURRENT);
+#endif
+#ifdef HW_LIM_CURRENT_ABS
+	utils_truncate_number(&conf->l_abs_current_max, HW_LIM_CURRENT_ABS);
+#endif
+#ifdef HW_LIM_VIN
+	utils_truncate_number(&conf->l_max_vin, HW_LIM_VIN);
+	utils_truncate_number(&conf->l_min_vin, HW_LIM_VIN);
+#endif
+#ifdef HW_LIM_ERPM
+	utils_truncate_number(&conf->l_max_erpm, HW_LIM_ERPM);
+	utils_truncate_number(&conf->l_min_erpm, HW_LIM_ERPM);
+#endif
+#ifdef HW_LIM_DUTY_MIN
+	utils_truncate_number(&conf->l_min_duty, HW_LIM_DUTY_MIN);
+#endif
+#ifdef HW_LIM_DUTY_MAX
+	utils_truncate_number(&conf->l_max_duty, HW_LIM_DUTY_MAX);
+#endif
+#ifdef HW_LIM_TEMP_FET
+	utils_truncate_number(&conf->l_temp_fet_start, HW_LIM_TEMP_FET);
+	utils_truncate_number(&conf->l_temp_fet_end, HW_LIM_TEMP_FET);
+#endif
+#endif
+}
@@ -22,7 +22,7 @@
 
 // Firmware version
 #define FW_VERSION_MAJOR		3
-#define FW_VERSION_MINOR		34
+#define FW_VERSION_MINOR		35
 
 #include "datatypes.h"
 
@@ -123,6 +123,14 @@
 #define SERVO_OUT_PULSE_MAX_US		2000	// Maximum pulse length in microseconds
 #define SERVO_OUT_RATE_HZ			50		// Update rate in Hz
 
+/*
+ * Run the current reconstruction and the Clarke and Park transforms in the
+ * FOC interrupt in fixed point.
+ */
+#ifndef FOC_FIXED_POINT_CURRENTS
+#define FOC_FIXED_POINT_CURRENTS	0
+#endif
+
 // Correction factor for computations that depend on the old resistor division factor
 #define VDIV_CORR					((VIN_R2 / (VIN_R2 + VIN_R1)) / (2.2 / (2.2 + 33.0)))
 
@@ -138,6 +146,12 @@
 #define AS5047_USE_HW_SPI_PINS		0
 #endif
 
+// Read the AS5047 with the hardware SPI and DMA in sync with the PWM timer. Requires
+// AS5047_USE_HW_SPI_PINS and hardware with a SPI port on those pins.
+#ifndef AS5047_USE_HW_SPI_DMA
+#define AS5047_USE_HW_SPI_DMA		0
+#endif
+
 /*
  * MCU
  */
@@ -171,5 +185,12 @@ bool conf_general_detect_motor_param(float current, float min_rpm, float low_dut
 		float *int_limit, float *bemf_coupling_k, int8_t *hall_table, int *hall_res);
 bool conf_general_measure_flux_linkage(float current, float duty,
 		float min_erpm, float res, float *linkage);
+bool conf_general_tune_current_loop(float bandwidth, float current, bool measure,
+		float *kp, float *ki, float *rise_time, float *settling_time, float *overshoot);
+bool conf_general_autotune_pid(bool pos, float setpoint, float current, pid_tune_rule rule,
+		float *ku, float *tu, float *kp, float *ki, float *kd,
+		float *rise_time, float *settling_time, float *overshoot);
+bool conf_general_encoder_nl_cal(float current, float erpm, float *coef);
+bool conf_general_cogging_cal(float time, float *scale);
 
 #endif /* CONF_GENERAL_H_ */
@@ -0,0 +1,663 @@
+/*
+	Copyright 2017 Benjamin Vedder	benjamin@vedder.se
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#include "conf_table.h"
+#include "buffer.h"
+#include "hw.h"
+#include <string.h>
+#include <stddef.h>
+
+// User defined default motor configuration file
+#ifdef MCCONF_DEFAULT_USER
+#include MCCONF_DEFAULT_USER
+#endif
+
+// User defined default app configuration file
+#ifdef APPCONF_DEFAULT_USER
+#include APPCONF_DEFAULT_USER
+#endif
+
+// Default configuration parameters that can be overridden
+#include "mcconf_default.h"
+#include "appconf_default.h"
+
+/*
+ * Field descriptors. The ID of a field is part of the communication protocol,
+ * so IDs must never be changed or reused. New fields get new IDs at the end.
+ * The tables are serialized in order, so COMM_SET_MCCONF and COMM_SET_APPCONF
+ * use the same layout as before the tables were introduced.
+ */
+#define MC_FIELD(id, field, type, scale, def) \
+		{id, offsetof(mc_configuration, field), type, \
+		sizeof(((mc_configuration*)0)->field), scale, def, 0}
+#define MC_BYTES(id, field, def) \
+		{id, offsetof(mc_configuration, field), CONF_TYPE_BYTES, \
+		sizeof(((mc_configuration*)0)->field), 0, 0, def}
+#define APP_FIELD(id, field, type, scale, def) \
+		{id, offsetof(app_configuration, field), type, \
+		sizeof(((app_configuration*)0)->field), scale, def, 0}
+#define APP_BYTES(id, field, def) \
+		{id, offsetof(app_configuration, field), CONF_TYPE_BYTES, \
+		sizeof(((app_configuration*)0)->field), 0, 0, def}
+
+// Defaults for the array fields
+static const int8_t hall_table_default[8] = {
+		MCCONF_HALL_TAB_0, MCCONF_HALL_TAB_1, MCCONF_HALL_TAB_2, MCCONF_HALL_TAB_3,
+		MCCONF_HALL_TAB_4, MCCONF_HALL_TAB_5, MCCONF_HALL_TAB_6, MCCONF_HALL_TAB_7
+};
+
+static const uint8_t foc_hall_table_default[8] = {
+		MCCONF_FOC_HALL_TAB_0, MCCONF_FOC_HALL_TAB_1, MCCONF_FOC_HALL_TAB_2, MCCONF_FOC_HALL_TAB_3,
+		MCCONF_FOC_HALL_TAB_4, MCCONF_FOC_HALL_TAB_5, MCCONF_FOC_HALL_TAB_6, MCCONF_FOC_HALL_TAB_7
+};
+
+static const int8_t foc_cogging_table_default[128] = {0};
+
+static const uint8_t nrf_address_default[3] = {
+		APPCONF_NRF_ADDR_B0, APPCONF_NRF_ADDR_B1, APPCONF_NRF_ADDR_B2
+};
+
+static const conf_field mcconf_fields[] = {
+		MC_FIELD(0, pwm_mode, CONF_TYPE_ENUM, 0, MCCONF_PWM_MODE),
+		MC_FIELD(1, comm_mode, CONF_TYPE_ENUM, 0, MCCONF_COMM_MODE),
+		MC_FIELD(2, motor_type, CONF_TYPE_ENUM, 0, MCCONF_DEFAULT_MOTOR_TYPE),
+		MC_FIELD(3, sensor_mode, CONF_TYPE_ENUM, 0, MCCONF_SENSOR_MODE),
+
+		MC_FIELD(4, l_current_max, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_L_CURRENT_MAX),
+		MC_FIELD(5, l_current_min, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_L_CURRENT_MIN),
+		MC_FIELD(6, l_in_current_max, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_L_IN_CURRENT_MAX),
+		MC_FIELD(7, l_in_current_min, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_L_IN_CURRENT_MIN),
+		MC_FIELD(8, l_abs_current_max, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_L_MAX_ABS_CURRENT),
+		MC_FIELD(9, l_min_erpm, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_L_RPM_MIN),
+		MC_FIELD(10, l_max_erpm, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_L_RPM_MAX),
+		MC_FIELD(11, l_erpm_start, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_L_RPM_START),
+		MC_FIELD(12, l_max_erpm_fbrake, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_L_CURR_MAX_RPM_FBRAKE),
+		MC_FIELD(13, l_max_erpm_fbrake_cc, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_L_CURR_MAX_RPM_FBRAKE_CC),
+		MC_FIELD(14, l_min_vin, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_L_MIN_VOLTAGE),
+		MC_FIELD(15, l_max_vin, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_L_MAX_VOLTAGE),
+		MC_FIELD(16, l_battery_cut_start, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_L_BATTERY_CUT_START),
+		MC_FIELD(17, l_battery_cut_end, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_L_BATTERY_CUT_END),
+		MC_FIELD(18, l_slow_abs_current, CONF_TYPE_BOOL, 0, MCCONF_L_SLOW_ABS_OVERCURRENT),
+		MC_FIELD(19, l_temp_fet_start, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_L_LIM_TEMP_FET_START),
+		MC_FIELD(20, l_temp_fet_end, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_L_LIM_TEMP_FET_END),
+		MC_FIELD(21, l_temp_motor_start, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_L_LIM_TEMP_MOTOR_START),
+		MC_FIELD(22, l_temp_motor_end, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_L_LIM_TEMP_MOTOR_END),
+		MC_FIELD(23, l_temp_accel_dec, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_L_LIM_TEMP_ACCEL_DEC),
+		MC_FIELD(24, l_min_duty, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_L_MIN_DUTY),
+		MC_FIELD(25, l_max_duty, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_L_MAX_DUTY),
+		MC_FIELD(26, l_watt_max, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_L_WATT_MAX),
+		MC_FIELD(27, l_watt_min, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_L_WATT_MIN),
+
+		MC_FIELD(28, sl_min_erpm, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_SL_MIN_RPM),
+		MC_FIELD(29, sl_min_erpm_cycle_int_limit, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_SL_MIN_ERPM_CYCLE_INT_LIMIT),
+		MC_FIELD(30, sl_max_fullbreak_current_dir_change, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_SL_MAX_FB_CURR_DIR_CHANGE),
+		MC_FIELD(31, sl_cycle_int_limit, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_SL_CYCLE_INT_LIMIT),
+		MC_FIELD(32, sl_phase_advance_at_br, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_SL_PHASE_ADVANCE_AT_BR),
+		MC_FIELD(33, sl_cycle_int_rpm_br, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_SL_CYCLE_INT_BR),
+		MC_FIELD(34, sl_bemf_coupling_k, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_SL_BEMF_COUPLING_K),
+
+		MC_BYTES(35, hall_table, hall_table_default),
+		MC_FIELD(36, hall_sl_erpm, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_HALL_ERPM),
+
+		MC_FIELD(37, foc_current_kp, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_FOC_CURRENT_KP),
+		MC_FIELD(38, foc_current_ki, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_FOC_CURRENT_KI),
+		MC_FIELD(39, foc_f_sw, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_FOC_F_SW),
+		MC_FIELD(40, foc_dt_us, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_FOC_DT_US),
+		MC_FIELD(41, foc_encoder_inverted, CONF_TYPE_BOOL, 0, MCCONF_FOC_ENCODER_INVERTED),
+		MC_FIELD(42, foc_encoder_offset, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_FOC_ENCODER_OFFSET),
+		MC_FIELD(43, foc_encoder_ratio, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_FOC_ENCODER_RATIO),
+		MC_FIELD(44, foc_sensor_mode, CONF_TYPE_ENUM, 0, MCCONF_FOC_SENSOR_MODE),
+		MC_FIELD(45, foc_pll_kp, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_FOC_PLL_KP),
+		MC_FIELD(46, foc_pll_ki, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_FOC_PLL_KI),
+		MC_FIELD(47, foc_motor_l, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_FOC_MOTOR_L),
+		MC_FIELD(48, foc_motor_r, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_FOC_MOTOR_R),
+		MC_FIELD(49, foc_motor_flux_linkage, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_FOC_MOTOR_FLUX_LINKAGE),
+		MC_FIELD(50, foc_observer_gain, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_FOC_OBSERVER_GAIN),
+		MC_FIELD(51, foc_observer_gain_slow, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_FOC_OBSERVER_GAIN_SLOW),
+		MC_FIELD(52, foc_duty_dowmramp_kp, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_FOC_DUTY_DOWNRAMP_KP),
+		MC_FIELD(53, foc_duty_dowmramp_ki, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_FOC_DUTY_DOWNRAMP_KI),
+		MC_FIELD(54, foc_openloop_rpm, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_FOC_OPENLOOP_RPM),
+		MC_FIELD(55, foc_sl_openloop_hyst, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_FOC_SL_OPENLOOP_HYST),
+		MC_FIELD(56, foc_sl_openloop_time, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_FOC_SL_OPENLOOP_TIME),
+		MC_FIELD(57, foc_sl_d_current_duty, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_FOC_SL_D_CURRENT_DUTY),
+		MC_FIELD(58, foc_sl_d_current_factor, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_FOC_SL_D_CURRENT_FACTOR),
+		MC_BYTES(59, foc_hall_table, foc_hall_table_default),
+		MC_FIELD(60, foc_sl_erpm, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_FOC_SL_ERPM),
+		MC_FIELD(61, foc_sample_v0_v7, CONF_TYPE_BOOL, 0, MCCONF_FOC_SAMPLE_V0_V7),
+		MC_FIELD(62, foc_sample_high_current, CONF_TYPE_BOOL, 0, MCCONF_FOC_SAMPLE_HIGH_CURRENT),
+		MC_FIELD(63, foc_sat_comp, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_FOC_SAT_COMP),
+		MC_FIELD(64, foc_temp_comp, CONF_TYPE_BOOL, 0, MCCONF_FOC_TEMP_COMP),
+		MC_FIELD(65, foc_temp_comp_base_temp, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_FOC_TEMP_COMP_BASE_TEMP),
+
+		MC_FIELD(66, s_pid_kp, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_S_PID_KP),
+		MC_FIELD(67, s_pid_ki, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_S_PID_KI),
+		MC_FIELD(68, s_pid_kd, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_S_PID_KD),
+		MC_FIELD(69, s_pid_min_erpm, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_S_PID_MIN_RPM),
+		MC_FIELD(70, s_pid_allow_braking, CONF_TYPE_BOOL, 0, MCCONF_S_PID_ALLOW_BRAKING),
+
+		MC_FIELD(71, p_pid_kp, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_P_PID_KP),
+		MC_FIELD(72, p_pid_ki, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_P_PID_KI),
+		MC_FIELD(73, p_pid_kd, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_P_PID_KD),
+		MC_FIELD(74, p_pid_ang_div, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_P_PID_ANG_DIV),
+
+		MC_FIELD(75, cc_startup_boost_duty, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_CC_STARTUP_BOOST_DUTY),
+		MC_FIELD(76, cc_min_current, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_CC_MIN_CURRENT),
+		MC_FIELD(77, cc_gain, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_CC_GAIN),
+		MC_FIELD(78, cc_ramp_step_max, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_CC_RAMP_STEP),
+
+		MC_FIELD(79, m_fault_stop_time_ms, CONF_TYPE_INT32, 0, MCCONF_M_FAULT_STOP_TIME),
+		MC_FIELD(80, m_duty_ramp_step, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_M_RAMP_STEP),
+		MC_FIELD(81, m_current_backoff_gain, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_M_CURRENT_BACKOFF_GAIN),
+		MC_FIELD(82, m_encoder_counts, CONF_TYPE_UINT32, 0, MCCONF_M_ENCODER_COUNTS),
+		MC_FIELD(83, m_sensor_port_mode, CONF_TYPE_ENUM, 0, MCCONF_M_SENSOR_PORT_MODE),
+		MC_FIELD(84, m_invert_direction, CONF_TYPE_BOOL, 0, MCCONF_M_INVERT_DIRECTION),
+		MC_FIELD(85, m_drv8301_oc_mode, CONF_TYPE_ENUM, 0, MCCONF_M_DRV8301_OC_MODE),
+		MC_FIELD(86, m_drv8301_oc_adj, CONF_TYPE_ENUM, 0, MCCONF_M_DRV8301_OC_ADJ),
+		MC_FIELD(87, m_bldc_f_sw_min, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_M_BLDC_F_SW_MIN),
+		MC_FIELD(88, m_bldc_f_sw_max, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_M_BLDC_F_SW_MAX),
+		MC_FIELD(89, m_dc_f_sw, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_M_DC_F_SW),
+		MC_FIELD(90, m_ntc_motor_beta, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_M_NTC_MOTOR_BETA),
+
+		MC_FIELD(91, foc_modulation, CONF_TYPE_ENUM, 0, MCCONF_FOC_MODULATION),
+		MC_FIELD(92, foc_overmod, CONF_TYPE_BOOL, 0, MCCONF_FOC_OVERMOD),
+		MC_FIELD(93, foc_fw_current_max, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_FOC_FW_CURRENT_MAX),
+		MC_FIELD(94, foc_fw_duty_start, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_FOC_FW_DUTY_START),
+		MC_FIELD(95, foc_fw_ramp_time, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_FOC_FW_RAMP_TIME),
+		MC_FIELD(96, foc_cc_decoupling, CONF_TYPE_ENUM, 0, MCCONF_FOC_CC_DECOUPLING),
+		MC_FIELD(97, foc_param_est, CONF_TYPE_ENUM, 0, MCCONF_FOC_PARAM_EST),
+		MC_FIELD(98, foc_param_est_forget, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_FOC_PARAM_EST_FORGET),
+		MC_FIELD(99, foc_hfi_voltage, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_FOC_HFI_VOLTAGE),
+		MC_FIELD(100, foc_observer_sched, CONF_TYPE_BOOL, 0, MCCONF_FOC_OBSERVER_SCHED),
+		MC_FIELD(101, foc_observer_sched_erpm[0], CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_FOC_OBSERVER_SCHED_ERPM_0),
+		MC_FIELD(102, foc_observer_sched_erpm[1], CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_FOC_OBSERVER_SCHED_ERPM_1),
+		MC_FIELD(103, foc_observer_sched_erpm[2], CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_FOC_OBSERVER_SCHED_ERPM_2),
+		MC_FIELD(104, foc_observer_sched_erpm[3], CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_FOC_OBSERVER_SCHED_ERPM_3),
+		MC_FIELD(105, foc_observer_sched_gain[0][0], CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_FOC_OBSERVER_SCHED_GAIN),
+		MC_FIELD(106, foc_observer_sched_gain[0][1], CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_FOC_OBSERVER_SCHED_GAIN),
+		MC_FIELD(107, foc_observer_sched_gain[0][2], CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_FOC_OBSERVER_SCHED_GAIN),
+		MC_FIELD(108, foc_observer_sched_gain[0][3], CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_FOC_OBSERVER_SCHED_GAIN),
+		MC_FIELD(109, foc_observer_sched_gain[1][0], CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_FOC_OBSERVER_SCHED_GAIN),
+		MC_FIELD(110, foc_observer_sched_gain[1][1], CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_FOC_OBSERVER_SCHED_GAIN),
+		MC_FIELD(111, foc_observer_sched_gain[1][2], CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_FOC_OBSERVER_SCHED_GAIN),
+		MC_FIELD(112, foc_observer_sched_gain[1][3], CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_FOC_OBSERVER_SCHED_GAIN),
+		MC_FIELD(113, foc_observer_sched_gain[2][0], CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_FOC_OBSERVER_SCHED_GAIN),
+		MC_FIELD(114, foc_observer_sched_gain[2][1], CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_FOC_OBSERVER_SCHED_GAIN),
+		MC_FIELD(115, foc_observer_sched_gain[2][2], CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_FOC_OBSERVER_SCHED_GAIN),
+		MC_FIELD(116, foc_observer_sched_gain[2][3], CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_FOC_OBSERVER_SCHED_GAIN),
+		MC_FIELD(117, foc_pll_adaptive, CONF_TYPE_BOOL, 0, MCCONF_FOC_PLL_ADAPTIVE),
+		MC_FIELD(118, foc_pll_bw_min, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_FOC_PLL_BW_MIN),
+		MC_FIELD(119, foc_pll_bw_max, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_FOC_PLL_BW_MAX),
+		MC_FIELD(120, foc_pll_bw_erpm, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_FOC_PLL_BW_ERPM),
+		MC_FIELD(121, foc_offset_track, CONF_TYPE_BOOL, 0, MCCONF_FOC_OFFSET_TRACK),
+		MC_FIELD(122, foc_sample_oversample, CONF_TYPE_BOOL, 0, MCCONF_FOC_SAMPLE_OVERSAMPLE),
+		MC_FIELD(123, foc_f_sw_sched, CONF_TYPE_BOOL, 0, MCCONF_FOC_F_SW_SCHED),
+		MC_FIELD(124, foc_f_sw_low, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_FOC_F_SW_LOW),
+		MC_FIELD(125, foc_f_sw_high, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_FOC_F_SW_HIGH),
+		MC_FIELD(126, foc_f_sw_sched_erpm, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_FOC_F_SW_SCHED_ERPM),
+		MC_FIELD(127, foc_encoder_latency_comp, CONF_TYPE_BOOL, 0, MCCONF_FOC_ENCODER_LATENCY_COMP),
+		MC_FIELD(128, foc_encoder_sensor_delay_us, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_FOC_ENCODER_SENSOR_DELAY_US),
+		MC_FIELD(129, foc_encoder_transport_delay_us, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_FOC_ENCODER_TRANSPORT_DELAY_US),
+		MC_FIELD(130, foc_encoder_nl_comp, CONF_TYPE_BOOL, 0, MCCONF_FOC_ENCODER_NL_COMP),
+		MC_FIELD(131, foc_encoder_nl_coef[0], CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_FOC_ENCODER_NL_COEF),
+		MC_FIELD(132, foc_encoder_nl_coef[1], CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_FOC_ENCODER_NL_COEF),
+		MC_FIELD(133, foc_encoder_nl_coef[2], CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_FOC_ENCODER_NL_COEF),
+		MC_FIELD(134, foc_encoder_nl_coef[3], CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_FOC_ENCODER_NL_COEF),
+		MC_FIELD(135, foc_cogging_comp, CONF_TYPE_BOOL, 0, MCCONF_FOC_COGGING_COMP),
+		MC_FIELD(136, foc_cogging_scale, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_FOC_COGGING_SCALE),
+		MC_BYTES(137, foc_cogging_table, foc_cogging_table_default),
+		MC_FIELD(138, foc_hall_learn, CONF_TYPE_BOOL, 0, MCCONF_FOC_HALL_LEARN),
+		MC_FIELD(139, foc_hall_edge[0], CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_FOC_HALL_EDGE),
+		MC_FIELD(140, foc_hall_edge[1], CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_FOC_HALL_EDGE),
+		MC_FIELD(141, foc_hall_edge[2], CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_FOC_HALL_EDGE),
+		MC_FIELD(142, foc_hall_edge[3], CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_FOC_HALL_EDGE),
+		MC_FIELD(143, foc_hall_edge[4], CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_FOC_HALL_EDGE),
+		MC_FIELD(144, foc_hall_edge[5], CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_FOC_HALL_EDGE),
+		MC_FIELD(145, foc_hall_edge[6], CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_FOC_HALL_EDGE),
+		MC_FIELD(146, foc_hall_edge[7], CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_FOC_HALL_EDGE),
+		MC_FIELD(147, m_encoder_sin_gain, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_M_ENCODER_SIN_GAIN),
+		MC_FIELD(148, m_encoder_sin_offset, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_M_ENCODER_SIN_OFFSET),
+		MC_FIELD(149, m_encoder_cos_gain, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_M_ENCODER_COS_GAIN),
+		MC_FIELD(150, m_encoder_cos_offset, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_M_ENCODER_COS_OFFSET),
+		MC_FIELD(151, m_encoder_sincos_phase, CONF_TYPE_FLOAT32_AUTO, 0, MCCONF_M_ENCODER_SINCOS_PHASE),
+};
+
+static const conf_field appconf_fields[] = {
+		APP_FIELD(0, controller_id, CONF_TYPE_UINT8, 0, APPCONF_CONTROLLER_ID),
+		APP_FIELD(1, timeout_msec, CONF_TYPE_UINT32, 0, APPCONF_TIMEOUT_MSEC),
+		APP_FIELD(2, timeout_brake_current, CONF_TYPE_FLOAT32_AUTO, 0, APPCONF_TIMEOUT_BRAKE_CURRENT),
+		APP_FIELD(3, send_can_status, CONF_TYPE_BOOL, 0, APPCONF_SEND_CAN_STATUS),
+		APP_FIELD(4, send_can_status_rate_hz, CONF_TYPE_UINT32_16, 0, APPCONF_SEND_CAN_STATUS_RATE_HZ),
+		APP_FIELD(5, can_baud_rate, CONF_TYPE_ENUM, 0, APPCONF_CAN_BAUD_RATE),
+
+		APP_FIELD(6, app_to_use, CONF_TYPE_ENUM, 0, APPCONF_APP_TO_USE),
+
+		APP_FIELD(7, app_ppm_conf.ctrl_type, CONF_TYPE_ENUM, 0, APPCONF_PPM_CTRL_TYPE),
+		APP_FIELD(8, app_ppm_conf.pid_max_erpm, CONF_TYPE_FLOAT32_AUTO, 0, APPCONF_PPM_PID_MAX_ERPM),
+		APP_FIELD(9, app_ppm_conf.hyst, CONF_TYPE_FLOAT32_AUTO, 0, APPCONF_PPM_HYST),
+		APP_FIELD(10, app_ppm_conf.pulse_start, CONF_TYPE_FLOAT32_AUTO, 0, APPCONF_PPM_PULSE_START),
+		APP_FIELD(11, app_ppm_conf.pulse_end, CONF_TYPE_FLOAT32_AUTO, 0, APPCONF_PPM_PULSE_END),
+		APP_FIELD(12, app_ppm_conf.pulse_center, CONF_TYPE_FLOAT32_AUTO, 0, APPCONF_PPM_PULSE_CENTER),
+		APP_FIELD(13, app_ppm_conf.median_filter, CONF_TYPE_BOOL, 0, APPCONF_PPM_MEDIAN_FILTER),
+		APP_FIELD(14, app_ppm_conf.safe_start, CONF_TYPE_BOOL, 0, APPCONF_PPM_SAFE_START),
+		APP_FIELD(15, app_ppm_conf.throttle_exp, CONF_TYPE_FLOAT32_AUTO, 0, APPCONF_PPM_THROTTLE_EXP),
+		APP_FIELD(16, app_ppm_conf.throttle_exp_brake, CONF_TYPE_FLOAT32_AUTO, 0, APPCONF_PPM_THROTTLE_EXP_BRAKE),
+		APP_FIELD(17, app_ppm_conf.throttle_exp_mode, CONF_TYPE_ENUM, 0, APPCONF_PPM_THROTTLE_EXP_MODE),
+		APP_FIELD(18, app_ppm_conf.ramp_time_pos, CONF_TYPE_FLOAT32_AUTO, 0, APPCONF_PPM_RAMP_TIME_POS),
+		APP_FIELD(19, app_ppm_conf.ramp_time_neg, CONF_TYPE_FLOAT32_AUTO, 0, APPCONF_PPM_RAMP_TIME_NEG),
+		APP_FIELD(20, app_ppm_conf.multi_esc, CONF_TYPE_BOOL, 0, APPCONF_PPM_MULTI_ESC),
+		APP_FIELD(21, app_ppm_conf.tc, CONF_TYPE_BOOL, 0, APPCONF_PPM_TC),
+		APP_FIELD(22, app_ppm_conf.tc_max_diff, CONF_TYPE_FLOAT32_AUTO, 0, APPCONF_PPM_TC_MAX_DIFF),
+
+		APP_FIELD(23, app_adc_conf.ctrl_type, CONF_TYPE_ENUM, 0, APPCONF_ADC_CTRL_TYPE),
+		APP_FIELD(24, app_adc_conf.hyst, CONF_TYPE_FLOAT32_AUTO, 0, APPCONF_ADC_HYST),
+		APP_FIELD(25, app_adc_conf.voltage_start, CONF_TYPE_FLOAT32_AUTO, 0, APPCONF_ADC_VOLTAGE_START),
+		APP_FIELD(26, app_adc_conf.voltage_end, CONF_TYPE_FLOAT32_AUTO, 0, APPCONF_ADC_VOLTAGE_END),
+		APP_FIELD(27, app_adc_conf.voltage_center, CONF_TYPE_FLOAT32_AUTO, 0, APPCONF_ADC_VOLTAGE_CENTER),
+		APP_FIELD(28, app_adc_conf.voltage2_start, CONF_TYPE_FLOAT32_AUTO, 0, APPCONF_ADC_VOLTAGE2_START),
+		APP_FIELD(29, app_adc_conf.voltage2_end, CONF_TYPE_FLOAT32_AUTO, 0, APPCONF_ADC_VOLTAGE2_END),
+		APP_FIELD(30, app_adc_conf.use_filter, CONF_TYPE_BOOL, 0, APPCONF_ADC_USE_FILTER),
+		APP_FIELD(31, app_adc_conf.safe_start, CONF_TYPE_BOOL, 0, APPCONF_ADC_SAFE_START),
+		APP_FIELD(32, app_adc_conf.cc_button_inverted, CONF_TYPE_BOOL, 0, APPCONF_ADC_CC_BUTTON_INVERTED),
+		APP_FIELD(33, app_adc_conf.rev_button_inverted, CONF_TYPE_BOOL, 0, APPCONF_ADC_REV_BUTTON_INVERTED),
+		APP_FIELD(34, app_adc_conf.voltage_inverted, CONF_TYPE_BOOL, 0, APPCONF_ADC_VOLTAGE_INVERTED),
+		APP_FIELD(35, app_adc_conf.voltage2_inverted, CONF_TYPE_BOOL, 0, APPCONF_ADC_VOLTAGE2_INVERTED),
+		APP_FIELD(36, app_adc_conf.throttle_exp, CONF_TYPE_FLOAT32_AUTO, 0, APPCONF_ADC_THROTTLE_EXP),
+		APP_FIELD(37, app_adc_conf.throttle_exp_brake, CONF_TYPE_FLOAT32_AUTO, 0, APPCONF_ADC_THROTTLE_EXP_BRAKE),
+		APP_FIELD(38, app_adc_conf.throttle_exp_mode, CONF_TYPE_ENUM, 0, APPCONF_ADC_THROTTLE_EXP_MODE),
+		APP_FIELD(39, app_adc_conf.ramp_time_pos, CONF_TYPE_FLOAT32_AUTO, 0, APPCONF_ADC_RAMP_TIME_POS),
+		APP_FIELD(40, app_adc_conf.ramp_time_neg, CONF_TYPE_FLOAT32_AUTO, 0, APPCONF_ADC_RAMP_TIME_NEG),
+		APP_FIELD(41, app_adc_conf.multi_esc, CONF_TYPE_BOOL, 0, APPCONF_ADC_MULTI_ESC),
+		APP_FIELD(42, app_adc_conf.tc, CONF_TYPE_BOOL, 0, APPCONF_ADC_TC),
+		APP_FIELD(43, app_adc_conf.tc_max_diff, CONF_TYPE_FLOAT32_AUTO, 0, APPCONF_ADC_TC_MAX_DIFF),
+		APP_FIELD(44, app_adc_conf.update_rate_hz, CONF_TYPE_UINT32_16, 0, APPCONF_ADC_UPDATE_RATE_HZ),
+
+		APP_FIELD(45, app_uart_baudrate, CONF_TYPE_UINT32, 0, APPCONF_UART_BAUDRATE),
+
+		APP_FIELD(46, app_chuk_conf.ctrl_type, CONF_TYPE_ENUM, 0, APPCONF_CHUK_CTRL_TYPE),
+		APP_FIELD(47, app_chuk_conf.hyst, CONF_TYPE_FLOAT32_AUTO, 0, APPCONF_CHUK_HYST),
+		APP_FIELD(48, app_chuk_conf.ramp_time_pos, CONF_TYPE_FLOAT32_AUTO, 0, APPCONF_CHUK_RAMP_TIME_POS),
+		APP_FIELD(49, app_chuk_conf.ramp_time_neg, CONF_TYPE_FLOAT32_AUTO, 0, APPCONF_CHUK_RAMP_TIME_NEG),
+		APP_FIELD(50, app_chuk_conf.stick_erpm_per_s_in_cc, CONF_TYPE_FLOAT32_AUTO, 0, APPCONF_STICK_ERPM_PER_S_IN_CC),
+		APP_FIELD(51, app_chuk_conf.throttle_exp, CONF_TYPE_FLOAT32_AUTO, 0, APPCONF_CHUK_THROTTLE_EXP),
+		APP_FIELD(52, app_chuk_conf.throttle_exp_brake, CONF_TYPE_FLOAT32_AUTO, 0, APPCONF_CHUK_THROTTLE_EXP_BRAKE),
+		APP_FIELD(53, app_chuk_conf.throttle_exp_mode, CONF_TYPE_ENUM, 0, APPCONF_CHUK_THROTTLE_EXP_MODE),
+		APP_FIELD(54, app_chuk_conf.multi_esc, CONF_TYPE_BOOL, 0, APPCONF_CHUK_MULTI_ESC),
+		APP_FIELD(55, app_chuk_conf.tc, CONF_TYPE_BOOL, 0, APPCONF_CHUK_TC),
+		APP_FIELD(56, app_chuk_conf.tc_max_diff, CONF_TYPE_FLOAT32_AUTO, 0, APPCONF_CHUK_TC_MAX_DIFF),
+
+		APP_FIELD(57, app_nrf_conf.speed, CONF_TYPE_ENUM, 0, APPCONF_NRF_SPEED),
+		APP_FIELD(58, app_nrf_conf.power, CONF_TYPE_ENUM, 0, APPCONF_NRF_POWER),
+		APP_FIELD(59, app_nrf_conf.crc_type, CONF_TYPE_ENUM, 0, APPCONF_NRF_CRC),
+		APP_FIELD(60, app_nrf_conf.retry_delay, CONF_TYPE_ENUM, 0, APPCONF_NRF_RETR_DELAY),
+		APP_FIELD(61, app_nrf_conf.retries, CONF_TYPE_UINT8, 0, APPCONF_NRF_RETRIES),
+		APP_FIELD(62, app_nrf_conf.channel, CONF_TYPE_UINT8, 0, APPCONF_NRF_CHANNEL),
+		APP_BYTES(63, app_nrf_conf.address, nrf_address_default),
+		APP_FIELD(64, app_nrf_conf.send_crc_ack, CONF_TYPE_BOOL, 0, APPCONF_NRF_SEND_CRC_ACK),
+
+};
+
+#define MCCONF_FIELDS		(sizeof(mcconf_fields) / sizeof(mcconf_fields[0]))
+#define APPCONF_FIELDS		(sizeof(appconf_fields) / sizeof(appconf_fields[0]))
+
+/**
+ * Get the number of fields in a configuration table.
+ *
+ * @param table
+ * The configuration table.
+ *
+ * @return
+ * The number of fields.
+ */
+int conf_table_field_count(conf_table_type table) {
+	switch (table) {
+	case CONF_TABLE_MCCONF: return MCCONF_FIELDS;
+	case CONF_TABLE_APPCONF: return APPCONF_FIELDS;
+	default: return 0;
+	}
+}
+
+/**
+ * Get a field by its position in a configuration table.
+ *
+ * @param table
+ * The configuration table.
+ *
+ * @param index
+ * The position in the table, which is also the serialization order.
+ *
+ * @return
+ * The field descriptor, or 0 if the index is out of range.
+ */
+const conf_field *conf_table_field_at(conf_table_type table, int index) {
+	if (index < 0 || index >= conf_table_field_count(table)) {
+		return 0;
+	}
+
+	return table == CONF_TABLE_MCCONF ? &mcconf_fields[index] : &appconf_fields[index];
+}
+
+/**
+ * Look up a configuration field by ID.
+ *
+ * @param table
+ * The configuration table.
+ *
+ * @param id
+ * The field ID.
+ *
+ * @return
+ * The field descriptor, or 0 if there is no field with that ID.
+ */
+const conf_field *conf_table_field(conf_table_type table, uint16_t id) {
+	// The tables are ordered by ID, so this is the common case
+	const conf_field *field = conf_table_field_at(table, id);
+	if (field && field->id == id) {
+		return field;
+	}
+
+	const int count = conf_table_field_count(table);
+	for (int i = 0;i < count;i++) {
+		field = conf_table_field_at(table, i);
+		if (field->id == id) {
+			return field;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Get the serialized size of a field.
+ *
+ * @param field
+ * The field descriptor.
+ *
+ * @return
+ * The size in bytes.
+ */
+int conf_table_field_size(const conf_field *field) {
+	switch (field->type) {
+	case CONF_TYPE_BOOL:
+	case CONF_TYPE_UINT8:
+	case CONF_TYPE_ENUM:
+		return 1;
+
+	case CONF_TYPE_UINT32_16:
+		return 2;
+
+	case CONF_TYPE_INT32:
+	case CONF_TYPE_UINT32:
+	case CONF_TYPE_FLOAT32_AUTO:
+	case CONF_TYPE_FLOAT32:
+		return 4;
+
+	case CONF_TYPE_BYTES:
+		return field->size;
+
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Enums are as wide as their values require with short enums, so enum
+ * members are accessed with the size of the member.
+ */
+static int enum_get(const conf_field *field, const uint8_t *p) {
+	switch (field->size) {
+	case 1: return *(const int8_t*)p;
+	case 2: return *(const int16_t*)p;
+	default: return *(const int32_t*)p;
+	}
+}
+
+static void enum_set(const conf_field *field, uint8_t *p, int value) {
+	switch (field->size) {
+	case 1: *(int8_t*)p = value; break;
+	case 2: *(int16_t*)p = value; break;
+	default: *(int32_t*)p = value; break;
+	}
+}
+
+/**
+ * Serialize a field from a configuration struct.
+ *
+ * @param field
+ * The field descriptor.
+ *
+ * @param conf
+ * The configuration struct the field is part of.
+ *
+ * @param buffer
+ * The buffer to append to.
+ *
+ * @param ind
+ * Index in the buffer, updated with the size of the field.
+ */
+void conf_table_field_append(const conf_field *field, const void *conf, uint8_t *buffer, int32_t *ind) {
+	const uint8_t *p = (const uint8_t*)conf + field->offset;
+
+	switch (field->type) {
+	case CONF_TYPE_BOOL: buffer[(*ind)++] = *(const bool*)p; break;
+	case CONF_TYPE_UINT8: buffer[(*ind)++] = *p; break;
+	case CONF_TYPE_ENUM: buffer[(*ind)++] = enum_get(field, p); break;
+	case CONF_TYPE_INT32: buffer_append_int32(buffer, *(const int32_t*)p, ind); break;
+	case CONF_TYPE_UINT32: buffer_append_uint32(buffer, *(const uint32_t*)p, ind); break;
+	case CONF_TYPE_FLOAT32_AUTO: buffer_append_float32_auto(buffer, *(const float*)p, ind); break;
+	case CONF_TYPE_FLOAT32: buffer_append_float32(buffer, *(const float*)p, field->scale, ind); break;
+	case CONF_TYPE_UINT32_16: buffer_append_uint16(buffer, *(const uint32_t*)p, ind); break;
+	case CONF_TYPE_BYTES:
+		memcpy(buffer + *ind, p, field->size);
+		*ind += field->size;
+		break;
+	default: break;
+	}
+}
+
+/**
+ * Deserialize a field into a configuration struct.
+ *
+ * @param field
+ * The field descriptor.
+ *
+ * @param conf
+ * The configuration struct the field is part of.
+ *
+ * @param buffer
+ * The buffer to read from.
+ *
+ * @param ind
+ * Index in the buffer, updated with the size of the field.
+ */
+void conf_table_field_get(const conf_field *field, void *conf, const uint8_t *buffer, int32_t *ind) {
+	uint8_t *p = (uint8_t*)conf + field->offset;
+
+	switch (field->type) {
+	case CONF_TYPE_BOOL: *(bool*)p = buffer[(*ind)++]; break;
+	case CONF_TYPE_UINT8: *p = buffer[(*ind)++]; break;
+	case CONF_TYPE_ENUM: enum_set(field, p, buffer[(*ind)++]); break;
+	case CONF_TYPE_INT32: *(int32_t*)p = buffer_get_int32(buffer, ind); break;
+	case CONF_TYPE_UINT32: *(uint32_t*)p = buffer_get_uint32(buffer, ind); break;
+	case CONF_TYPE_FLOAT32_AUTO: *(float*)p = buffer_get_float32_auto(buffer, ind); break;
+	case CONF_TYPE_FLOAT32: *(float*)p = buffer_get_float32(buffer, field->scale, ind); break;
+	case CONF_TYPE_UINT32_16: *(uint32_t*)p = buffer_get_uint16(buffer, ind); break;
+	case CONF_TYPE_BYTES:
+		memcpy(p, buffer + *ind, field->size);
+		*ind += field->size;
+		break;
+	default: break;
+	}
+}
+
+/**
+ * Set a field in a configuration struct to its compiled default value.
+ *
+ * @param field
+ * The field descriptor.
+ *
+ * @param conf
+ * The configuration struct the field is part of.
+ */
+void conf_table_field_set_default(const conf_field *field, void *conf) {
+	uint8_t *p = (uint8_t*)conf + field->offset;
+
+	switch (field->type) {
+	case CONF_TYPE_BOOL: *(bool*)p = field->def != 0.0; break;
+	case CONF_TYPE_UINT8: *p = (uint8_t)field->def; break;
+	case CONF_TYPE_ENUM: enum_set(field, p, (int)field->def); break;
+	case CONF_TYPE_INT32: *(int32_t*)p = (int32_t)field->def; break;
+	case CONF_TYPE_UINT32:
+	case CONF_TYPE_UINT32_16: *(uint32_t*)p = (uint32_t)field->def; break;
+	case CONF_TYPE_FLOAT32_AUTO:
+	case CONF_TYPE_FLOAT32: *(float*)p = field->def; break;
+	case CONF_TYPE_BYTES: memcpy(p, field->def_bytes, field->size); break;
+	default: break;
+	}
+}
+
+/**
+ * Get the size of a configuration when all fields of a table are serialized.
+ *
+ * @param table
+ * The configuration table.
+ *
+ * @return
+ * The size in bytes.
+ */
+int conf_table_serialized_size(conf_table_type table) {
+	const int count = conf_table_field_count(table);
+	int size = 0;
+
+	for (int i = 0;i < count;i++) {
+		size += conf_table_field_size(conf_table_field_at(table, i));
+	}
+
+	return size;
+}
+
+/**
+ * Serialize all fields of a configuration in table order.
+ *
+ * @param table
+ * The configuration table.
+ *
+ * @param conf
+ * The configuration struct, mc_configuration or app_configuration.
+ *
+ * @param buffer
+ * The buffer to append to.
+ *
+ * @param ind
+ * Index in the buffer, updated with the serialized size.
+ */
+void conf_table_serialize(conf_table_type table, const void *conf, uint8_t *buffer, int32_t *ind) {
+	const int count = conf_table_field_count(table);
+
+	for (int i = 0;i < count;i++) {
+		conf_table_field_append(conf_table_field_at(table, i), conf, buffer, ind);
+	}
+}
+
+/**
+ * Deserialize all fields of a configuration in table order.
+ *
+ * @param table
+ * The configuration table.
+ *
+ * @param conf
+ * The configuration struct, mc_configuration or app_configuration.
+ *
+ * @param buffer
+ * The buffer to read from.
+ *
+ * @param len
+ * The length of the buffer.
+ *
+ * @param ind
+ * Index in the buffer, updated with the serialized size.
+ *
+ * @return
+ * True on success, false if the buffer is too short. The configuration
+ * is left untouched in that case.
+ */
+bool conf_table_deserialize(conf_table_type table, void *conf, const uint8_t *buffer, int32_t len, int32_t *ind) {
+	if ((len - *ind) < conf_table_serialized_size(table)) {
+		return false;
+	}
+
+	const int count = conf_table_field_count(table);
+
+	for (int i = 0;i < count;i++) {
+		conf_table_field_get(conf_table_field_at(table, i), conf, buffer, ind);
+	}
+
+	return true;
+}
+
+/**
+ * Set all fields of a configuration to their compiled default values. Members
+ * of the struct that are not part of the table are not touched.
+ *
+ * @param table
+ * The configuration table.
+ *
+ * @param conf
+ * The configuration struct, mc_configuration or app_configuration.
+ */
+void conf_table_set_defaults(conf_table_type table, void *conf) {
+	const int count = conf_table_field_count(table);
+
+	for (int i = 0;i < count;i++) {
+		conf_table_field_set_default(conf_table_field_at(table, i), conf);
+	}
+}
+
+/**
+ * Calculate a hash of the serialized layout of a configuration table. The
+ * hash covers the ID, type, size and scale of every field in order, so the
+ * host can tell if a cached schema still is valid.
+ *
+ * @param table
+ * The configuration table.
+ *
+ * @return
+ * 32-bit FNV-1a hash of the layout.
+ */
+uint32_t conf_table_hash(conf_table_type table) {
+	const int count = conf_table_field_count(table);
+	uint32_t hash = 2166136261;
+	uint8_t desc[8];
+
+	for (int i = 0;i < count;i++) {
+		const conf_field *field = conf_table_field_at(table, i);
+		int32_t ind = 0;
+
+		buffer_append_uint16(desc, field->id, &ind);
+		desc[ind++] = field->type;
+		desc[ind++] = conf_table_field_size(field);
+		buffer_append_float32_auto(desc, field->scale, &ind);
+
+		for (int j = 0;j < ind;j++) {
+			hash ^= desc[j];
+			hash *= 16777619;
+		}
+	}
+
+	return hash;
+}
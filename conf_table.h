@@ -0,0 +1,69 @@
+/*
+	Copyright 2017 Benjamin Vedder	benjamin@vedder.se
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#ifndef CONF_TABLE_H_
+#define CONF_TABLE_H_
+
+#include "datatypes.h"
+
+// Configuration tables
+typedef enum {
+	CONF_TABLE_MCCONF = 0,
+	CONF_TABLE_APPCONF
+} conf_table_type;
+
+// Field types and how they are serialized. These values are sent to the
+// host in the schema, so they must not be changed.
+typedef enum {
+	CONF_TYPE_BOOL = 0,		// bool, one byte
+	CONF_TYPE_UINT8,		// uint8_t, one byte
+	CONF_TYPE_ENUM,			// enum or int, one byte
+	CONF_TYPE_INT32,		// int32_t, four bytes
+	CONF_TYPE_UINT32,		// uint32_t, four bytes
+	CONF_TYPE_FLOAT32_AUTO,	// float, buffer_append_float32_auto
+	CONF_TYPE_FLOAT32,		// float, int32 fixed point with scale
+	CONF_TYPE_BYTES,		// byte array, size bytes
+	CONF_TYPE_UINT32_16		// uint32_t, two bytes
+} conf_field_type;
+
+typedef struct {
+	uint16_t id;
+	uint16_t offset;
+	uint8_t type;
+	uint8_t size; // Size of the struct member, the array size for CONF_TYPE_BYTES
+	float scale;
+	float def;
+	const void *def_bytes; // Default for CONF_TYPE_BYTES
+} conf_field;
+
+// Functions
+int conf_table_field_count(conf_table_type table);
+const conf_field *conf_table_field_at(conf_table_type table, int index);
+const conf_field *conf_table_field(conf_table_type table, uint16_t id);
+int conf_table_field_size(const conf_field *field);
+void conf_table_field_append(const conf_field *field, const void *conf, uint8_t *buffer, int32_t *ind);
+void conf_table_field_get(const conf_field *field, void *conf, const uint8_t *buffer, int32_t *ind);
+void conf_table_field_set_default(const conf_field *field, void *conf);
+int conf_table_serialized_size(conf_table_type table);
+void conf_table_serialize(conf_table_type table, const void *conf, uint8_t *buffer, int32_t *ind);
+bool conf_table_deserialize(conf_table_type table, void *conf, const uint8_t *buffer, int32_t len, int32_t *ind);
+void conf_table_set_defaults(conf_table_type table, void *conf);
+uint32_t conf_table_hash(conf_table_type table);
+
+#endif /* CONF_TABLE_H_ */
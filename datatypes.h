@@ -52,9 +52,38 @@ typedef enum {
 typedef enum {
 	FOC_SENSOR_MODE_SENSORLESS = 0,
 	FOC_SENSOR_MODE_ENCODER,
-	FOC_SENSOR_MODE_HALL
+	FOC_SENSOR_MODE_HALL,
+	FOC_SENSOR_MODE_HFI
 } mc_foc_sensor_mode;
 
+typedef enum {
+	FOC_MODULATION_SVPWM = 0,
+	FOC_MODULATION_DPWM_MIN,
+	FOC_MODULATION_DPWM_MAX,
+	FOC_MODULATION_DPWM_BIPOLAR
+} mc_foc_modulation;
+
+typedef enum {
+	FOC_CC_DECOUPLING_DISABLED = 0,
+	FOC_CC_DECOUPLING_CROSS,
+	FOC_CC_DECOUPLING_BEMF,
+	FOC_CC_DECOUPLING_CROSS_BEMF
+} mc_foc_cc_decoupling_mode;
+
+typedef enum {
+	FOC_PARAM_EST_DISABLED = 0,
+	FOC_PARAM_EST_TRACK,
+	FOC_PARAM_EST_APPLY
+} mc_foc_param_est_mode;
+
+typedef enum {
+	PID_TUNE_RULE_ZN_PID = 0,
+	PID_TUNE_RULE_ZN_PI,
+	PID_TUNE_RULE_TYREUS_LUYBEN,
+	PID_TUNE_RULE_SOME_OVERSHOOT,
+	PID_TUNE_RULE_NO_OVERSHOOT
+} pid_tune_rule;
+
 typedef enum {
 	MOTOR_TYPE_BLDC = 0,
 	MOTOR_TYPE_DC,
@@ -95,7 +124,8 @@ typedef enum {
 typedef enum {
 	SENSOR_PORT_MODE_HALL = 0,
 	SENSOR_PORT_MODE_ABI,
-	SENSOR_PORT_MODE_AS5047_SPI
+	SENSOR_PORT_MODE_AS5047_SPI,
+	SENSOR_PORT_MODE_SINCOS
 } sensor_port_mode;
 
 typedef struct {
@@ -212,6 +242,38 @@ typedef struct {
 	float foc_sat_comp;
 	bool foc_temp_comp;
 	float foc_temp_comp_base_temp;
+	mc_foc_modulation foc_modulation;
+	bool foc_overmod;
+	float foc_fw_current_max;
+	float foc_fw_duty_start;
+	float foc_fw_ramp_time;
+	mc_foc_cc_decoupling_mode foc_cc_decoupling;
+	mc_foc_param_est_mode foc_param_est;
+	float foc_param_est_forget;
+	float foc_hfi_voltage;
+	bool foc_observer_sched;
+	float foc_observer_sched_erpm[4];
+	float foc_observer_sched_gain[3][4];
+	bool foc_pll_adaptive;
+	float foc_pll_bw_min;
+	float foc_pll_bw_max;
+	float foc_pll_bw_erpm;
+	bool foc_offset_track;
+	bool foc_sample_oversample;
+	bool foc_f_sw_sched;
+	float foc_f_sw_low;
+	float foc_f_sw_high;
+	float foc_f_sw_sched_erpm;
+	bool foc_encoder_latency_comp;
+	float foc_encoder_sensor_delay_us;
+	float foc_encoder_transport_delay_us;
+	bool foc_encoder_nl_comp;
+	float foc_encoder_nl_coef[4]; // Sine and cosine of the first and second mechanical harmonic
+	bool foc_cogging_comp;
+	float foc_cogging_scale;
+	int8_t foc_cogging_table[128]; // Cogging current over one electrical revolution, scaled to foc_cogging_scale
+	bool foc_hall_learn;
+	float foc_hall_edge[8]; // Angle where each hall state is entered in the positive direction, -1 when unknown
 	// Speed PID
 	float s_pid_kp;
 	float s_pid_ki;
@@ -234,6 +296,11 @@ typedef struct {
 	float m_current_backoff_gain;
 	uint32_t m_encoder_counts;
 	sensor_port_mode m_sensor_port_mode;
+	float m_encoder_sin_gain;
+	float m_encoder_sin_offset;
+	float m_encoder_cos_gain;
+	float m_encoder_cos_offset;
+	float m_encoder_sincos_phase;
 	bool m_invert_direction;
 	drv8301_oc_mode m_drv8301_oc_mode;
 	int m_drv8301_oc_adj;
@@ -481,7 +548,13 @@ typedef enum {
 	COMM_FORWARD_CAN,
 	COMM_SET_CHUCK_DATA,
 	COMM_CUSTOM_APP_DATA,
-	COMM_NRF_START_PAIRING
+	COMM_NRF_START_PAIRING,
+	COMM_GET_CAN_STATS,
+	COMM_CAN_FW_DISTRIBUTE,
+	COMM_SET_MCCONF_FIELDS,
+	COMM_GET_MCCONF_FIELDS,
+	COMM_GET_CONF_SCHEMA,
+	COMM_AUTOTUNE_PID
 } COMM_PACKET_ID;
 
 // CAN commands
@@ -497,9 +570,24 @@ typedef enum {
 	CAN_PACKET_PROCESS_SHORT_BUFFER,
 	CAN_PACKET_STATUS,
 	CAN_PACKET_SET_CURRENT_REL,
-	CAN_PACKET_SET_CURRENT_BRAKE_REL
+	CAN_PACKET_SET_CURRENT_BRAKE_REL,
+	CAN_PACKET_TIME_SYNC,
+	CAN_PACKET_TIME_SYNC_FOLLOW_UP,
+	CAN_PACKET_SAMPLE_SYNC,
+	CAN_PACKET_FW_BEGIN,
+	CAN_PACKET_FW_DATA,
+	CAN_PACKET_FW_GET_MISSING,
+	CAN_PACKET_FW_VERIFY,
+	CAN_PACKET_FW_REPLY
 } CAN_PACKET_ID;
 
+// State of a node during CAN firmware distribution
+typedef enum {
+	CAN_FW_NODE_FAILED = 0,
+	CAN_FW_NODE_ERASED,
+	CAN_FW_NODE_OK
+} can_fw_node_state;
+
 // Logged fault data
 typedef struct {
 	mc_fault_code fault;
@@ -543,6 +631,7 @@ typedef struct {
 typedef struct {
 	int id;
 	systime_t rx_time;
+	uint32_t rx_time_sync;
 	float rpm;
 	float current;
 	float duty;
@@ -23,10 +23,21 @@
 #include "stm32f4xx_conf.h"
 #include "hw.h"
 #include "utils.h"
+#include "mc_interface.h"
+#include <math.h>
 
 // Defines
 #define AS5047P_READ_ANGLECOM		(0x3FFF | 0x4000 | 0x8000) // This is just ones
+#define AS5047P_READ_ERRFL			(0x0001 | 0x4000) // Even parity
+#define AS5047P_EF					0x4000
 #define AS5047_SAMPLE_RATE_HZ		20000
+#define AS5047_SYNC_DELAY			84 // Delay from each PWM timer update to the read in timer ticks (1 us)
+#define SINCOS_MIN_AMPLITUDE		0.5 // Smallest normalized sin/cos vector length that is accepted
+#define SINCOS_MAX_AMPLITUDE		1.5 // Largest normalized sin/cos vector length that is accepted
+
+#if AS5047_USE_HW_SPI_DMA && (!AS5047_USE_HW_SPI_PINS || !defined(HW_SPI_DEV))
+#error "AS5047_USE_HW_SPI_DMA requires AS5047_USE_HW_SPI_PINS and HW_SPI_DEV"
+#endif
 
 #if AS5047_USE_HW_SPI_PINS
 #ifdef HW_SPI_DEV
@@ -62,20 +73,59 @@
 typedef enum {
 	ENCODER_MODE_NONE = 0,
 	ENCODER_MODE_ABI,
-	ENCODER_MODE_AS5047P_SPI
+	ENCODER_MODE_AS5047P_SPI,
+	ENCODER_MODE_SINCOS
 } encoder_mode;
 
+typedef enum {
+	SPI_ERRFL_NONE = 0,
+	SPI_ERRFL_SENT,
+	SPI_ERRFL_RECEIVE
+} spi_errfl_state;
+
 // Private variables
 static bool index_found = false;
 static uint32_t enc_counts = 10000;
 static encoder_mode mode = ENCODER_MODE_NONE;
 static float last_enc_angle = 0.0;
+static volatile uint32_t spi_error_cnt = 0;
+static volatile uint32_t sincos_error_cnt = 0;
+static float sincos_s_gain = 1.0;
+static float sincos_s_offset = 0.0;
+static float sincos_c_gain = 1.0;
+static float sincos_c_offset = 0.0;
+static float sincos_phase_sin = 0.0;
+static float sincos_phase_cos = 1.0;
+static float sincos_angle_last = 0.0;
+static bool sincos_first = true;
+static int sincos_period = 0;
+
+#if AS5047_USE_HW_SPI_DMA
+static uint16_t spi_dma_tx;
+static uint16_t spi_dma_rx;
+static spi_errfl_state spi_errfl;
+#endif
 
 // Private functions
 static void spi_transfer(uint16_t *in_buf, const uint16_t *out_buf, int length);
 static void spi_begin(void);
 static void spi_end(void);
 static void spi_delay(void);
+static bool spi_check_parity(uint16_t x);
+
+#if AS5047_USE_HW_SPI_DMA
+static void spi_dma_end_cb(SPIDriver *spip);
+
+/*
+ * SPI mode 1 with 16-bit frames at 5.25 MHz. The AS5047P allows up to 10 MHz.
+ */
+static const SPIConfig spi_dma_cfg = {
+		spi_dma_end_cb,
+		SPI_SW_CS_GPIO,
+		SPI_SW_CS_PIN,
+		SPI_CR1_DFF | SPI_CR1_CPHA | SPI_CR1_BR_1 | SPI_CR1_BR_0
+};
+#endif
 
 void encoder_deinit(void) {
 	nvicDisableVector(HW_ENC_EXTI_CH);
@@ -83,6 +133,12 @@ void encoder_deinit(void) {
 
 	TIM_DeInit(HW_ENC_TIM);
 
+#if AS5047_USE_HW_SPI_DMA
+	if (mode == ENCODER_MODE_AS5047P_SPI) {
+		spiStop(&HW_SPI_DEV);
+	}
+#endif
+
 	palSetPadMode(SPI_SW_MISO_GPIO, SPI_SW_MISO_PIN, PAL_MODE_INPUT_PULLUP);
 	palSetPadMode(SPI_SW_SCK_GPIO, SPI_SW_SCK_PIN, PAL_MODE_INPUT_PULLUP);
 	palSetPadMode(SPI_SW_CS_GPIO, SPI_SW_CS_PIN, PAL_MODE_INPUT_PULLUP);
@@ -144,6 +200,43 @@ void encoder_init_abi(uint32_t counts) {
 void encoder_init_as5047p_spi(void) {
 	TIM_TimeBaseInitTypeDef  TIM_TimeBaseStructure;
 
+	spi_error_cnt = 0;
+
+#if AS5047_USE_HW_SPI_DMA
+	palSetPadMode(SPI_SW_MISO_GPIO, SPI_SW_MISO_PIN, PAL_MODE_ALTERNATE(HW_SPI_GPIO_AF));
+	palSetPadMode(SPI_SW_SCK_GPIO, SPI_SW_SCK_PIN, PAL_MODE_ALTERNATE(HW_SPI_GPIO_AF) |
+			PAL_STM32_OSPEED_HIGHEST);
+	palSetPadMode(SPI_SW_MOSI_GPIO, SPI_SW_MOSI_PIN, PAL_MODE_ALTERNATE(HW_SPI_GPIO_AF) |
+			PAL_STM32_OSPEED_HIGHEST);
+	palSetPadMode(SPI_SW_CS_GPIO, SPI_SW_CS_PIN, PAL_MODE_OUTPUT_PUSHPULL | PAL_STM32_OSPEED_HIGHEST);
+	palSetPad(SPI_SW_CS_GPIO, SPI_SW_CS_PIN);
+
+	spi_dma_tx = AS5047P_READ_ANGLECOM;
+	spi_errfl = SPI_ERRFL_NONE;
+	spiStart(&HW_SPI_DEV, &spi_dma_cfg);
+
+	// Enable timer clock
+	HW_ENC_TIM_CLK_EN();
+
+	// One pulse mode started by every update of the PWM timer. TIM1 is center
+	// aligned with a repetition counter of 0, so it updates at both the top
+	// and the bottom of the count. That gives two reads per PWM period, one in
+	// each zero vector, shortly after the point where the currents are sampled.
+	TIM_TimeBaseStructure.TIM_Prescaler = 0;
+	TIM_TimeBaseStructure.TIM_CounterMode = TIM_CounterMode_Up;
+	TIM_TimeBaseStructure.TIM_Period = AS5047_SYNC_DELAY;
+	TIM_TimeBaseStructure.TIM_ClockDivision = 0;
+	TIM_TimeBaseStructure.TIM_RepetitionCounter = 0;
+	TIM_TimeBaseInit(HW_ENC_TIM, &TIM_TimeBaseStructure);
+
+	TIM_SelectOnePulseMode(HW_ENC_TIM, TIM_OPMode_Single);
+	TIM_SelectInputTrigger(HW_ENC_TIM, TIM_TS_ITR0);
+	TIM_SelectSlaveMode(HW_ENC_TIM, TIM_SlaveMode_Trigger);
+
+	// Enable overflow interrupt
+	TIM_ClearITPendingBit(HW_ENC_TIM, TIM_IT_Update);
+	TIM_ITConfig(HW_ENC_TIM, TIM_IT_Update, ENABLE);
+#else
 	palSetPadMode(SPI_SW_MISO_GPIO, SPI_SW_MISO_PIN, PAL_MODE_INPUT);
 	palSetPadMode(SPI_SW_SCK_GPIO, SPI_SW_SCK_PIN, PAL_MODE_OUTPUT_PUSHPULL | PAL_STM32_OSPEED_HIGHEST);
 	palSetPadMode(SPI_SW_CS_GPIO, SPI_SW_CS_PIN, PAL_MODE_OUTPUT_PUSHPULL | PAL_STM32_OSPEED_HIGHEST);
@@ -170,6 +263,7 @@ void encoder_init_as5047p_spi(void) {
 
 	// Enable timer
 	TIM_Cmd(HW_ENC_TIM, ENABLE);
+#endif
 
 	nvicEnableVector(HW_ENC_TIM_ISR_CH, 6);
 
@@ -177,6 +271,64 @@ void encoder_init_as5047p_spi(void) {
 	index_found = true;
 }
 
+/**
+ * Use an analog sin/cos encoder on the EXT and EXT2 ADC inputs. The signals
+ * are sampled with the other regular ADC channels once per PWM period, and
+ * encoder_sincos_isr should be called from the control interrupt.
+ *
+ * @param periods
+ * The number of sin/cos periods per revolution. The periods are counted, so
+ * the angle is absolute within one revolution relative to the period the
+ * encoder started in.
+ */
+void encoder_init_sincos(uint32_t periods) {
+#ifdef ADC_IND_EXT2
+	enc_counts = periods > 0 ? periods : 1;
+	sincos_period = 0;
+	sincos_angle_last = 0.0;
+	sincos_first = true;
+	sincos_error_cnt = 0;
+	last_enc_angle = 0.0;
+
+	mode = ENCODER_MODE_SINCOS;
+	index_found = true;
+#else
+	// This hardware does not sample a second external input
+	(void)periods;
+#endif
+}
+
+/**
+ * Set the sin/cos encoder calibration. The signals are normalized as
+ * (v - offset) * gain, and the sine is corrected for a phase error relative
+ * to the cosine.
+ *
+ * @param s_gain
+ * Inverse of the sine amplitude in 1/V.
+ *
+ * @param s_offset
+ * Sine offset in V.
+ *
+ * @param c_gain
+ * Inverse of the cosine amplitude in 1/V.
+ *
+ * @param c_offset
+ * Cosine offset in V.
+ *
+ * @param phase
+ * The phase error of the sine in degrees. Positive when the sine leads.
+ */
+void encoder_sincos_conf(float s_gain, float s_offset, float c_gain, float c_offset, float phase) {
+	sincos_s_gain = s_gain;
+	sincos_s_offset = s_offset;
+	sincos_c_gain = c_gain;
+	sincos_c_offset = c_offset;
+
+	utils_truncate_number_abs(&phase, 45.0);
+	sincos_phase_sin = sinf(phase * (M_PI / 180.0));
+	sincos_phase_cos = cosf(phase * (M_PI / 180.0));
+}
+
 bool encoder_is_configured(void) {
 	return mode != ENCODER_MODE_NONE;
 }
@@ -190,6 +342,7 @@ float encoder_read_deg(void) {
 		break;
 
 	case ENCODER_MODE_AS5047P_SPI:
+	case ENCODER_MODE_SINCOS:
 		angle = last_enc_angle;
 		break;
 
@@ -239,14 +392,124 @@ void encoder_reset(void) {
  * Timer interrupt
  */
 void encoder_tim_isr(void) {
+#if AS5047_USE_HW_SPI_DMA
+	// Start the transfer. The angle is updated in spi_dma_end_cb.
+	chSysLockFromISR();
+	if (HW_SPI_DEV.state == SPI_READY) {
+		spiSelectI(&HW_SPI_DEV);
+		spiStartExchangeI(&HW_SPI_DEV, 1, &spi_dma_tx, &spi_dma_rx);
+	}
+	chSysUnlockFromISR();
+#else
 	uint16_t pos;
 
 	spi_begin();
 	spi_transfer(&pos, 0, 1);
 	spi_end();
 
+	// Without MOSI the error flag cannot be cleared by reading ERRFL, so
+	// it is only counted and the angle is used as long as the parity is
+	// correct.
+	if (!spi_check_parity(pos)) {
+		spi_error_cnt++;
+		return;
+	}
+
+	if (pos & AS5047P_EF) {
+		spi_error_cnt++;
+	}
+
 	pos &= 0x3FFF;
 	last_enc_angle = ((float)pos * 360.0) / 16384.0;
+#endif
+}
+
+/**
+ * Sample the sin/cos encoder. Should be called from the control interrupt
+ * once per ADC sample.
+ */
+void encoder_sincos_isr(void) {
+#ifdef ADC_IND_EXT2
+	if (mode != ENCODER_MODE_SINCOS) {
+		return;
+	}
+
+	const float s_raw = (ADC_VOLTS(ADC_IND_EXT) - sincos_s_offset) * sincos_s_gain;
+	const float c = (ADC_VOLTS(ADC_IND_EXT2) - sincos_c_offset) * sincos_c_gain;
+
+	// s_raw = sin(x + phase) = sin(x) * cos(phase) + cos(x) * sin(phase)
+	const float s = (s_raw - c * sincos_phase_sin) / sincos_phase_cos;
+
+	// A short or long vector means a disconnected or saturated sensor. Keep
+	// the last angle then.
+	const float mag_sq = s * s + c * c;
+	if (mag_sq < (SINCOS_MIN_AMPLITUDE * SINCOS_MIN_AMPLITUDE) ||
+			mag_sq > (SINCOS_MAX_AMPLITUDE * SINCOS_MAX_AMPLITUDE)) {
+		sincos_error_cnt++;
+		return;
+	}
+
+	float angle = utils_fast_atan2(s, c) * (180.0 / M_PI);
+	utils_norm_angle(&angle);
+
+	// Start counting from the first valid sample, as a wrap against the
+	// initial angle would count a period that did not happen.
+	if (sincos_first) {
+		sincos_angle_last = angle;
+		sincos_first = false;
+	}
+
+	// Count periods. More than half a period between samples cannot be told
+	// apart from a step in the other direction.
+	const float diff = angle - sincos_angle_last;
+	if (diff < -180.0) {
+		sincos_period++;
+	} else if (diff > 180.0) {
+		sincos_period--;
+	}
+
+	const int periods = (int)enc_counts;
+	if (sincos_period >= periods) {
+		sincos_period -= periods;
+	} else if (sincos_period < 0) {
+		sincos_period += periods;
+	}
+
+	sincos_angle_last = angle;
+	last_enc_angle = ((float)sincos_period * 360.0 + angle) / (float)periods;
+#endif
+}
+
+/**
+ * Get the number of sin/cos encoder samples that were discarded because the
+ * signal amplitude was out of range.
+ *
+ * @return
+ * The number of errors.
+ */
+uint32_t encoder_sincos_get_error_cnt(void) {
+	return sincos_error_cnt;
+}
+
+/**
+ * Get the sin/cos period the encoder is in.
+ *
+ * @return
+ * The period, 0 to the number of periods per revolution - 1.
+ */
+int encoder_sincos_get_period(void) {
+	return sincos_period;
+}
+
+/**
+ * Get the number of AS5047 frames with a parity error or the error flag
+ * set since the encoder was initialized.
+ *
+ * @return
+ * The number of errors.
+ */
+uint32_t encoder_spi_get_error_cnt(void) {
+	return spi_error_cnt;
 }
 
 /**
@@ -257,6 +520,11 @@ void encoder_tim_isr(void) {
  */
 void encoder_set_counts(uint32_t counts) {
 	if (counts != enc_counts) {
+		if (mode == ENCODER_MODE_SINCOS) {
+			encoder_init_sincos(counts);
+			return;
+		}
+
 		enc_counts = counts;
 		TIM_SetAutoreload(HW_ENC_TIM, enc_counts - 1);
 		index_found = false;
@@ -323,3 +591,52 @@ static void spi_delay(void) {
 	__NOP();
 	__NOP();
 }
+
+static bool spi_check_parity(uint16_t x) {
+	// The AS5047 uses even parity over all 16 bits
+	x ^= x >> 8;
+	x ^= x >> 4;
+	x ^= x >> 2;
+	x ^= x >> 1;
+	return (x & 1) == 0;
+}
+
+#if AS5047_USE_HW_SPI_DMA
+/*
+ * Called from the SPI DMA interrupt when a frame has been received. The
+ * response to a command arrives in the next frame, so when the error flag
+ * is set ERRFL is read to clear it, and the two frames that follow do not
+ * contain the angle.
+ */
+static void spi_dma_end_cb(SPIDriver *spip) {
+	chSysLockFromISR();
+	spiUnselectI(spip);
+	chSysUnlockFromISR();
+
+	const uint16_t pos = spi_dma_rx;
+	const bool parity_ok = spi_check_parity(pos);
+
+	switch (spi_errfl) {
+	case SPI_ERRFL_SENT:
+		spi_dma_tx = AS5047P_READ_ANGLECOM;
+		spi_errfl = SPI_ERRFL_RECEIVE;
+		break;
+
+	case SPI_ERRFL_RECEIVE:
+		spi_errfl = SPI_ERRFL_NONE;
+		break;
+
+	default:
+		if (!parity_ok) {
+			spi_error_cnt++;
+		} else if (pos & AS5047P_EF) {
+			spi_error_cnt++;
+			spi_dma_tx = AS5047P_READ_ERRFL;
+			spi_errfl = SPI_ERRFL_SENT;
+		} else {
+			last_enc_angle = ((float)(pos & 0x3FFF) * 360.0) / 16384.0;
+		}
+		break;
+	}
+}
+#endif
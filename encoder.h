@@ -26,11 +26,17 @@
 void encoder_deinit(void);
 void encoder_init_abi(uint32_t counts);
 void encoder_init_as5047p_spi(void);
+void encoder_init_sincos(uint32_t periods);
+void encoder_sincos_conf(float s_gain, float s_offset, float c_gain, float c_offset, float phase);
 bool encoder_is_configured(void);
 float encoder_read_deg(void);
 void encoder_reset(void);
 void encoder_tim_isr(void);
+void encoder_sincos_isr(void);
 void encoder_set_counts(uint32_t counts);
 bool encoder_index_found(void);
+uint32_t encoder_spi_get_error_cnt(void);
+uint32_t encoder_sincos_get_error_cnt(void);
+int encoder_sincos_get_period(void);
 
 #endif /* ENCODER_H_ */
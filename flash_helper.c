@@ -189,3 +189,13 @@ uint8_t* flash_helper_get_sector_address(uint32_t fsector) {
 
 	return res;
 }
+
+/**
+ * Get the address of the area where new application data is written.
+ *
+ * @return
+ * Pointer to the first byte of the new application area.
+ */
+uint8_t* flash_helper_get_new_app_address(void) {
+	return (uint8_t *)flash_addr[NEW_APP_BASE];
+}
@@ -27,5 +27,6 @@ uint16_t flash_helper_erase_new_app(uint32_t new_app_size);
 uint16_t flash_helper_write_new_app_data(uint32_t offset, uint8_t *data, uint32_t len);
 void flash_helper_jump_to_bootloader(void);
 uint8_t* flash_helper_get_sector_address(uint32_t fsector);
+uint8_t* flash_helper_get_new_app_address(void);
 
 #endif /* FLASH_HELPER_H_ */
@@ -0,0 +1,263 @@
+/*
+	Copyright 2017 Benjamin Vedder	benjamin@vedder.se
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+/*
+ * Hardware independent parts of the FOC estimators. They take all motor
+ * parameters and state as arguments, so that the host simulations in tests/
+ * run the same code as the firmware.
+ */
+
+#include "foc_math.h"
+#include "mcpwm_foc.h"
+#include "utils.h"
+#include <math.h>
+
+/**
+ * Run the flux observer for one control period. Enough iterations are used to
+ * keep the rotation and the correction in each iteration small, which means
+ * that fewer iterations are needed at low speed.
+ *
+ * See http://cas.ensmp.fr/~praly/Telechargement/Journaux/2010-IEEE_TPEL-Lee-Hong-Nam-Ortega-Praly-Astolfi.pdf
+ *
+ * @param v_alpha
+ * The alpha voltage.
+ *
+ * @param v_beta
+ * The beta voltage.
+ *
+ * @param i_alpha
+ * The alpha current.
+ *
+ * @param i_beta
+ * The beta current.
+ *
+ * @param dt
+ * The time step in seconds.
+ *
+ * @param R
+ * The motor resistance, scaled by 3/2.
+ *
+ * @param L
+ * The motor inductance, scaled by 3/2.
+ *
+ * @param lambda
+ * The flux linkage.
+ *
+ * @param gamma
+ * The observer gain.
+ *
+ * @param speed
+ * The electrical speed in rad/s, used for the number of iterations.
+ *
+ * @param x1
+ * The first observer state, updated in place.
+ *
+ * @param x2
+ * The second observer state, updated in place.
+ *
+ * @param phase
+ * A pointer to store the estimated rotor angle.
+ *
+ * @return
+ * The number of iterations that were used.
+ */
+int foc_observer_update(float v_alpha, float v_beta, float i_alpha, float i_beta,
+		float dt, float R, float L, float lambda, float gamma, float speed,
+		volatile float *x1, volatile float *x2, volatile float *phase) {
+	const float L_ia = L * i_alpha;
+	const float L_ib = L * i_beta;
+	const float R_ia = R * i_alpha;
+	const float R_ib = R * i_beta;
+	const float lambda_2 = SQ(lambda);
+	const float gamma_half = gamma * 0.5;
+
+	// Original
+//	float err = lambda_2 - (SQ(*x1 - L_ia) + SQ(*x2 - L_ib));
+//	float x1_dot = -R_ia + v_alpha + gamma_half * (*x1 - L_ia) * err;
+//	float x2_dot = -R_ib + v_beta + gamma_half * (*x2 - L_ib) * err;
+//	*x1 += x1_dot * dt;
+//	*x2 += x2_dot * dt;
+
+	// Iterative with some trial and error
+	int iterations = (int)ceilf(fmaxf(fabsf(speed) * dt / MCPWM_FOC_OBSERVER_ANGLE_STEP,
+			gamma * lambda_2 * dt / MCPWM_FOC_OBSERVER_GAIN_STEP));
+	if (iterations < 1) {
+		iterations = 1;
+	} else if (iterations > MCPWM_FOC_OBSERVER_ITERATIONS_MAX) {
+		iterations = MCPWM_FOC_OBSERVER_ITERATIONS_MAX;
+	}
+
+	const float dt_iteration = dt / (float)iterations;
+	for (int i = 0;i < iterations;i++) {
+		float err = lambda_2 - (SQ(*x1 - L_ia) + SQ(*x2 - L_ib));
+		float gamma_tmp = gamma_half;
+		if (utils_truncate_number_abs(&err, lambda_2 * 0.2)) {
+			gamma_tmp *= 10.0;
+		}
+		float x1_dot = -R_ia + v_alpha + gamma_tmp * (*x1 - L_ia) * err;
+		float x2_dot = -R_ib + v_beta + gamma_tmp * (*x2 - L_ib) * err;
+
+		*x1 += x1_dot * dt_iteration;
+		*x2 += x2_dot * dt_iteration;
+	}
+
+	UTILS_NAN_ZERO(*x1);
+	UTILS_NAN_ZERO(*x2);
+
+	*phase = utils_fast_atan2(*x2 - L_ib, *x1 - L_ia);
+
+	return iterations;
+}
+
+/**
+ * Speed from the rotation of the observer flux state over one control period.
+ * Unlike the observer angle it does not subtract L * i, so it does not carry
+ * the current measurement noise. It has noise of its own though.
+ *
+ * @param x1_last
+ * The first observer state before the last update.
+ *
+ * @param x2_last
+ * The second observer state before the last update.
+ *
+ * @param x1
+ * The first observer state.
+ *
+ * @param x2
+ * The second observer state.
+ *
+ * @param x_min
+ * Smallest flux state magnitude for which the speed is calculated.
+ *
+ * @param dt
+ * The time step in seconds.
+ *
+ * @return
+ * The speed in rad/s, or 0 when the flux state is too small.
+ */
+float foc_observer_speed(float x1_last, float x2_last, float x1, float x2,
+		float x_min, float dt) {
+	const float x_sq = SQ(x1) + SQ(x2);
+
+	if (x_sq > SQ(x_min)) {
+		return (x1_last * x2 - x2_last * x1) / (x_sq * dt);
+	} else {
+		return 0.0;
+	}
+}
+
+/**
+ * PLL with fixed gains.
+ *
+ * @param phase
+ * The measured phase.
+ *
+ * @param dt
+ * The time step in seconds.
+ *
+ * @param kp
+ * The proportional gain.
+ *
+ * @param ki
+ * The integral gain.
+ *
+ * @param phase_var
+ * The PLL phase, updated in place.
+ *
+ * @param speed_var
+ * The PLL speed in rad/s, updated in place.
+ */
+void foc_pll_run(float phase, float dt, float kp, float ki,
+		volatile float *phase_var, volatile float *speed_var) {
+	UTILS_NAN_ZERO(*phase_var);
+	float delta_theta = phase - *phase_var;
+	utils_norm_angle_rad(&delta_theta);
+	UTILS_NAN_ZERO(*speed_var);
+	*phase_var += (*speed_var + kp * delta_theta) * dt;
+	utils_norm_angle_rad((float*)phase_var);
+	*speed_var += ki * delta_theta * dt;
+}
+
+/**
+ * Critically damped PLL with a bandwidth that increases linearly with the
+ * speed from bw_min to bw_max, reached at bw_erpm. The speed feedforward
+ * drives the phase directly, so that the loop only has to correct the
+ * feedforward error and does not lag during acceleration. The feedforward is
+ * filtered at twice the loop bandwidth for the speed output. The tradeoff is
+ * more noise at constant speed than the fixed gains have, which is why this
+ * is not the default.
+ *
+ * @param phase
+ * The measured phase.
+ *
+ * @param speed_ff
+ * The speed feedforward in rad/s, or 0 when there is none.
+ *
+ * @param dt
+ * The time step in seconds.
+ *
+ * @param bw_min
+ * The bandwidth at zero speed in Hz.
+ *
+ * @param bw_max
+ * The bandwidth at bw_erpm and above in Hz.
+ *
+ * @param bw_erpm
+ * The speed where the bandwidth reaches bw_max.
+ *
+ * @param phase_var
+ * The PLL phase, updated in place.
+ *
+ * @param speed_corr
+ * The loop correction of the speed, updated in place.
+ *
+ * @param speed_ff_filter
+ * The filtered feedforward, updated in place.
+ *
+ * @param speed_var
+ * The PLL speed output in rad/s, also used for the bandwidth.
+ */
+void foc_pll_run_adaptive(float phase, float speed_ff, float dt,
+		float bw_min, float bw_max, float bw_erpm, volatile float *phase_var,
+		volatile float *speed_corr, volatile float *speed_ff_filter,
+		volatile float *speed_var) {
+	UTILS_NAN_ZERO(*phase_var);
+	UTILS_NAN_ZERO(*speed_corr);
+	UTILS_NAN_ZERO(*speed_ff_filter);
+
+	float bw = bw_max;
+	const float erpm_abs = fabsf(*speed_var / ((2.0 * M_PI) / 60.0));
+	if (erpm_abs < bw_erpm) {
+		bw = utils_map(erpm_abs, 0.0, bw_erpm, bw_min, bw_max);
+	}
+
+	const float wn = 2.0 * M_PI * bw;
+
+	float delta_theta = phase - *phase_var;
+	utils_norm_angle_rad(&delta_theta);
+	*phase_var += (speed_ff + *speed_corr + 2.0 * wn * delta_theta) * dt;
+	utils_norm_angle_rad((float*)phase_var);
+	*speed_corr += wn * wn * delta_theta * dt;
+
+	float filter_const = 2.0 * wn * dt;
+	utils_truncate_number(&filter_const, 0.0, 1.0);
+	UTILS_LP_FAST(*speed_ff_filter, speed_ff, filter_const);
+
+	*speed_var = *speed_ff_filter + *speed_corr;
+}
@@ -0,0 +1,39 @@
+/*
+	Copyright 2017 Benjamin Vedder	benjamin@vedder.se
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#ifndef FOC_MATH_H_
+#define FOC_MATH_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Functions
+int foc_observer_update(float v_alpha, float v_beta, float i_alpha, float i_beta,
+		float dt, float R, float L, float lambda, float gamma, float speed,
+		volatile float *x1, volatile float *x2, volatile float *phase);
+float foc_observer_speed(float x1_last, float x2_last, float x1, float x2,
+		float x_min, float dt);
+void foc_pll_run(float phase, float dt, float kp, float ki,
+		volatile float *phase_var, volatile float *speed_var);
+void foc_pll_run_adaptive(float phase, float speed_ff, float dt,
+		float bw_min, float bw_max, float bw_erpm, volatile float *phase_var,
+		volatile float *speed_corr, volatile float *speed_ff_filter,
+		volatile float *speed_var);
+
+#endif /* FOC_MATH_H_ */
@@ -31,6 +31,7 @@
 #include "encoder.h"
 #include "drv8301.h"
 #include "buffer.h"
+#include "comm_can.h"
 #include <math.h>
 
 // Macros
@@ -75,12 +76,16 @@ __attribute__((section(".ram4"))) static volatile uint8_t m_status_samples[ADC_S
 __attribute__((section(".ram4"))) static volatile int16_t m_curr_fir_samples[ADC_SAMPLE_MAX_LEN];
 __attribute__((section(".ram4"))) static volatile int16_t m_f_sw_samples[ADC_SAMPLE_MAX_LEN];
 __attribute__((section(".ram4"))) static volatile int8_t m_phase_samples[ADC_SAMPLE_MAX_LEN];
+__attribute__((section(".ram4"))) static volatile uint32_t m_time_samples[ADC_SAMPLE_MAX_LEN];
 static volatile int m_sample_len;
 static volatile int m_sample_int;
 static volatile debug_sampling_mode m_sample_mode;
 static volatile debug_sampling_mode m_sample_mode_last;
 static volatile int m_sample_now;
 static volatile int m_sample_trigger;
+static volatile bool m_sample_wait_start;
+static volatile uint32_t m_sample_start_time;
+static volatile debug_sampling_mode m_sample_mode_pending;
 static volatile float m_last_adc_duration_sample;
 
 // Private functions
@@ -126,6 +131,9 @@ void mc_interface_init(mc_configuration *configuration) {
 	m_sample_trigger = 0;
 	m_sample_mode = DEBUG_SAMPLING_OFF;
 	m_sample_mode_last = DEBUG_SAMPLING_OFF;
+	m_sample_wait_start = false;
+	m_sample_start_time = 0;
+	m_sample_mode_pending = DEBUG_SAMPLING_OFF;
 
 	// Start threads
 	chThdCreateStatic(timer_thread_wa, sizeof(timer_thread_wa), NORMALPRIO, timer_thread, NULL);
@@ -147,6 +155,13 @@ void mc_interface_init(mc_configuration *configuration) {
 		encoder_init_as5047p_spi();
 		break;
 
+	case SENSOR_PORT_MODE_SINCOS:
+		encoder_init_sincos(m_conf.m_encoder_counts);
+		encoder_sincos_conf(m_conf.m_encoder_sin_gain, m_conf.m_encoder_sin_offset,
+				m_conf.m_encoder_cos_gain, m_conf.m_encoder_cos_offset,
+				m_conf.m_encoder_sincos_phase);
+		break;
+
 	default:
 		break;
 	}
@@ -185,14 +200,25 @@ void mc_interface_set_configuration(mc_configuration *configuration) {
 			encoder_init_as5047p_spi();
 			break;
 
+		case SENSOR_PORT_MODE_SINCOS:
+			encoder_init_sincos(configuration->m_encoder_counts);
+			break;
+
 		default:
 			break;
 		}
 	}
 
-	if (configuration->m_sensor_port_mode == SENSOR_PORT_MODE_ABI) {
+	if (configuration->m_sensor_port_mode == SENSOR_PORT_MODE_ABI ||
+			configuration->m_sensor_port_mode == SENSOR_PORT_MODE_SINCOS) {
 		encoder_set_counts(configuration->m_encoder_counts);
 	}
+
+	if (configuration->m_sensor_port_mode == SENSOR_PORT_MODE_SINCOS) {
+		encoder_sincos_conf(configuration->m_encoder_sin_gain, configuration->m_encoder_sin_offset,
+				configuration->m_encoder_cos_gain, configuration->m_encoder_cos_offset,
+				configuration->m_encoder_sincos_phase);
+	}
 #endif
 
 #ifdef HW_HAS_DRV8301
@@ -916,6 +942,7 @@ void mc_interface_sample_print_data(debug_sampling_mode mode, uint16_t len, uint
 	if (mode == DEBUG_SAMPLING_SEND_LAST_SAMPLES) {
 		chEvtSignal(sample_send_tp, (eventmask_t) 1);
 	} else {
+		m_sample_wait_start = false;
 		m_sample_trigger = -1;
 		m_sample_now = 0;
 		m_sample_len = len;
@@ -924,6 +951,44 @@ void mc_interface_sample_print_data(debug_sampling_mode mode, uint16_t len, uint
 	}
 }
 
+/**
+ * Start sampling at a given synchronized CAN bus time. This way captures on
+ * several controllers can be started at the same instant.
+ *
+ * @param mode
+ * The sampling mode.
+ *
+ * @param len
+ * The number of samples.
+ *
+ * @param decimation
+ * The sample decimation.
+ *
+ * @param start_time
+ * The synchronized time in microseconds at which sampling starts. See
+ * comm_can_sync_time_us.
+ */
+void mc_interface_sample_print_data_at(debug_sampling_mode mode, uint16_t len, uint8_t decimation, uint32_t start_time) {
+	if (mode == DEBUG_SAMPLING_SEND_LAST_SAMPLES) {
+		mc_interface_sample_print_data(mode, len, decimation);
+		return;
+	}
+
+	if (len > ADC_SAMPLE_MAX_LEN) {
+		len = ADC_SAMPLE_MAX_LEN;
+	}
+
+	m_sample_wait_start = false;
+	m_sample_mode = DEBUG_SAMPLING_OFF;
+	m_sample_trigger = -1;
+	m_sample_now = 0;
+	m_sample_len = len;
+	m_sample_int = decimation;
+	m_sample_mode_pending = mode;
+	m_sample_start_time = start_time;
+	m_sample_wait_start = true;
+}
+
 /**
  * Get filtered MOSFET temperature. The temperature is pre-calculated, so this
  * functions is fast.
@@ -1141,6 +1206,12 @@ void mc_interface_mc_timer_isr(void) {
 
 	bool sample = false;
 
+	if (m_sample_wait_start &&
+			(int32_t)(comm_can_sync_time_us() - m_sample_start_time) >= 0) {
+		m_sample_wait_start = false;
+		m_sample_mode = m_sample_mode_pending;
+	}
+
 	switch (m_sample_mode) {
 	case DEBUG_SAMPLING_NOW:
 		if (m_sample_now == m_sample_len) {
@@ -1275,6 +1346,7 @@ void mc_interface_mc_timer_isr(void) {
 			m_curr_fir_samples[m_sample_now] = (int16_t)(mc_interface_get_tot_current() * (8.0 / FAC_CURRENT));
 			m_f_sw_samples[m_sample_now] = (int16_t)(f_samp / 10.0);
 			m_status_samples[m_sample_now] = mcpwm_get_comm_step() | (mcpwm_read_hall_phase() << 3);
+			m_time_samples[m_sample_now] = comm_can_sync_time_us();
 
 			m_sample_now++;
 
@@ -1554,6 +1626,7 @@ static THD_FUNCTION(sample_send_thread, arg) {
 			buffer_append_float32_auto(buffer, (float)m_f_sw_samples[ind_samp] * 10.0, &index);
 			buffer[index++] = m_status_samples[ind_samp];
 			buffer[index++] = m_phase_samples[ind_samp];
+			buffer_append_uint32(buffer, m_time_samples[ind_samp], &index);
 
 			commands_send_packet(buffer, index);
 		}
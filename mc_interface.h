@@ -70,6 +70,7 @@ float mc_interface_get_pid_pos_set(void);
 float mc_interface_get_pid_pos_now(void);
 float mc_interface_get_last_sample_adc_isr_duration(void);
 void mc_interface_sample_print_data(debug_sampling_mode mode, uint16_t len, uint8_t decimation);
+void mc_interface_sample_print_data_at(debug_sampling_mode mode, uint16_t len, uint8_t decimation, uint32_t start_time);
 float mc_interface_temp_fet_filtered(void);
 float mc_interface_temp_motor_filtered(void);
 
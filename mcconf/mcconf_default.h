@@ -314,6 +314,108 @@
 #ifndef MCCONF_FOC_TEMP_COMP_BASE_TEMP
 #define MCCONF_FOC_TEMP_COMP_BASE_TEMP	25.0	// Motor temperature compensation base temperature
 #endif
+#ifndef MCCONF_FOC_MODULATION
+#define MCCONF_FOC_MODULATION			FOC_MODULATION_SVPWM // Continuous or discontinuous modulation
+#endif
+#ifndef MCCONF_FOC_OVERMOD
+#define MCCONF_FOC_OVERMOD				false	// Use overmodulation up to six-step
+#endif
+#ifndef MCCONF_FOC_FW_CURRENT_MAX
+#define MCCONF_FOC_FW_CURRENT_MAX		0.0		// Maximum field weakening current. 0 disables field weakening
+#endif
+#ifndef MCCONF_FOC_FW_DUTY_START
+#define MCCONF_FOC_FW_DUTY_START		0.9		// Start field weakening at this fraction of the maximum duty cycle
+#endif
+#ifndef MCCONF_FOC_FW_RAMP_TIME
+#define MCCONF_FOC_FW_RAMP_TIME			0.2		// Time to ramp from zero to maximum field weakening current
+#endif
+#ifndef MCCONF_FOC_CC_DECOUPLING
+#define MCCONF_FOC_CC_DECOUPLING		FOC_CC_DECOUPLING_DISABLED // Current controller decoupling feedforward
+#endif
+#ifndef MCCONF_FOC_PARAM_EST
+#define MCCONF_FOC_PARAM_EST			FOC_PARAM_EST_DISABLED // Online estimation of R, L and flux linkage
+#endif
+#ifndef MCCONF_FOC_PARAM_EST_FORGET
+#define MCCONF_FOC_PARAM_EST_FORGET		0.999	// Forgetting factor of the parameter estimator
+#endif
+#ifndef MCCONF_FOC_HFI_VOLTAGE
+#define MCCONF_FOC_HFI_VOLTAGE			2.0		// Injection voltage amplitude in HFI sensor mode
+#endif
+#ifndef MCCONF_FOC_OBSERVER_SCHED
+#define MCCONF_FOC_OBSERVER_SCHED		false	// Use the observer gain schedule instead of the duty cycle map
+#endif
+#ifndef MCCONF_FOC_OBSERVER_SCHED_ERPM_0
+#define MCCONF_FOC_OBSERVER_SCHED_ERPM_0	0.0		// Speed breakpoints of the observer gain schedule
+#endif
+#ifndef MCCONF_FOC_OBSERVER_SCHED_ERPM_1
+#define MCCONF_FOC_OBSERVER_SCHED_ERPM_1	5000.0
+#endif
+#ifndef MCCONF_FOC_OBSERVER_SCHED_ERPM_2
+#define MCCONF_FOC_OBSERVER_SCHED_ERPM_2	20000.0
+#endif
+#ifndef MCCONF_FOC_OBSERVER_SCHED_ERPM_3
+#define MCCONF_FOC_OBSERVER_SCHED_ERPM_3	50000.0
+#endif
+#ifndef MCCONF_FOC_OBSERVER_SCHED_GAIN
+#define MCCONF_FOC_OBSERVER_SCHED_GAIN	1.0		// Observer gain scale in all points of the gain schedule
+#endif
+#ifndef MCCONF_FOC_PLL_ADAPTIVE
+#define MCCONF_FOC_PLL_ADAPTIVE			false	// Speed scheduled PLL bandwidth with observer feedforward. Less lag, more noise at constant speed
+#endif
+#ifndef MCCONF_FOC_PLL_BW_MIN
+#define MCCONF_FOC_PLL_BW_MIN			10.0	// Adaptive PLL bandwidth at zero speed in Hz
+#endif
+#ifndef MCCONF_FOC_PLL_BW_MAX
+#define MCCONF_FOC_PLL_BW_MAX			100.0	// Adaptive PLL bandwidth at and above MCCONF_FOC_PLL_BW_ERPM in Hz
+#endif
+#ifndef MCCONF_FOC_PLL_BW_ERPM
+#define MCCONF_FOC_PLL_BW_ERPM			10000.0	// Speed where the adaptive PLL reaches its maximum bandwidth
+#endif
+#ifndef MCCONF_FOC_OFFSET_TRACK
+#define MCCONF_FOC_OFFSET_TRACK			false	// Track the current sensor offsets while the current is known to be zero
+#endif
+#ifndef MCCONF_FOC_SAMPLE_OVERSAMPLE
+#define MCCONF_FOC_SAMPLE_OVERSAMPLE	false	// Average several current samples around the center of the zero vector
+#endif
+#ifndef MCCONF_FOC_F_SW_SCHED
+#define MCCONF_FOC_F_SW_SCHED			false	// Schedule the switching frequency based on speed and current
+#endif
+#ifndef MCCONF_FOC_F_SW_LOW
+#define MCCONF_FOC_F_SW_LOW				10000.0	// Switching frequency at full current and zero speed
+#endif
+#ifndef MCCONF_FOC_F_SW_HIGH
+#define MCCONF_FOC_F_SW_HIGH			30000.0	// Switching frequency at and above MCCONF_FOC_F_SW_SCHED_ERPM
+#endif
+#ifndef MCCONF_FOC_F_SW_SCHED_ERPM
+#define MCCONF_FOC_F_SW_SCHED_ERPM		20000.0	// Speed where the switching frequency reaches MCCONF_FOC_F_SW_HIGH
+#endif
+#ifndef MCCONF_FOC_ENCODER_LATENCY_COMP
+#define MCCONF_FOC_ENCODER_LATENCY_COMP	false	// Compensate the encoder delays and advance the output angle by the PWM delay
+#endif
+#ifndef MCCONF_FOC_ENCODER_SENSOR_DELAY_US
+#define MCCONF_FOC_ENCODER_SENSOR_DELAY_US	0.0	// Delay between the rotor position and the encoder output
+#endif
+#ifndef MCCONF_FOC_ENCODER_TRANSPORT_DELAY_US
+#define MCCONF_FOC_ENCODER_TRANSPORT_DELAY_US	25.0	// Average age of the encoder reading when it is used
+#endif
+#ifndef MCCONF_FOC_ENCODER_NL_COMP
+#define MCCONF_FOC_ENCODER_NL_COMP		false	// Correct the encoder nonlinearity
+#endif
+#ifndef MCCONF_FOC_ENCODER_NL_COEF
+#define MCCONF_FOC_ENCODER_NL_COEF		0.0		// Encoder nonlinearity harmonics in degrees
+#endif
+#ifndef MCCONF_FOC_COGGING_COMP
+#define MCCONF_FOC_COGGING_COMP			false	// Feed forward the cogging current in speed and position control
+#endif
+#ifndef MCCONF_FOC_COGGING_SCALE
+#define MCCONF_FOC_COGGING_SCALE		0.0		// Cogging current in A for a table entry of 127
+#endif
+#ifndef MCCONF_FOC_HALL_LEARN
+#define MCCONF_FOC_HALL_LEARN			false	// Learn the hall sector edges at speed and use them at low speed
+#endif
+#ifndef MCCONF_FOC_HALL_EDGE
+#define MCCONF_FOC_HALL_EDGE			-1.0	// Learned hall sector edges in degrees, -1 when unknown
+#endif
 
 // Misc
 #ifndef MCCONF_M_FAULT_STOP_TIME
@@ -331,6 +433,21 @@
 #ifndef MCCONF_M_SENSOR_PORT_MODE
 #define MCCONF_M_SENSOR_PORT_MODE		SENSOR_PORT_MODE_HALL // The mode of the hall_encoder port
 #endif
+#ifndef MCCONF_M_ENCODER_SIN_GAIN
+#define MCCONF_M_ENCODER_SIN_GAIN		1.0		// Inverse of the sin/cos encoder sine amplitude in 1/V
+#endif
+#ifndef MCCONF_M_ENCODER_SIN_OFFSET
+#define MCCONF_M_ENCODER_SIN_OFFSET		1.65	// Sin/cos encoder sine offset in V
+#endif
+#ifndef MCCONF_M_ENCODER_COS_GAIN
+#define MCCONF_M_ENCODER_COS_GAIN		1.0		// Inverse of the sin/cos encoder cosine amplitude in 1/V
+#endif
+#ifndef MCCONF_M_ENCODER_COS_OFFSET
+#define MCCONF_M_ENCODER_COS_OFFSET		1.65	// Sin/cos encoder cosine offset in V
+#endif
+#ifndef MCCONF_M_ENCODER_SINCOS_PHASE
+#define MCCONF_M_ENCODER_SINCOS_PHASE	0.0		// Sin/cos encoder sine phase error in degrees
+#endif
 #ifndef MCCONF_M_INVERT_DIRECTION
 #define MCCONF_M_INVERT_DIRECTION		false // Invert the motor direction
 #endif
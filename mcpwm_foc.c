@@ -33,6 +33,7 @@
 #include "encoder.h"
 #include "commands.h"
 #include "timeout.h"
+#include "foc_math.h"
 #include <math.h>
 #include <string.h>
 #include <stdlib.h>
@@ -63,6 +64,8 @@ typedef struct {
 	float vd_int;
 	float vq_int;
 	uint32_t svm_sector;
+	int16_t i_alpha_fixed;
+	int16_t i_beta_fixed;
 } motor_state_t;
 
 typedef struct {
@@ -73,6 +76,79 @@ typedef struct {
 	float measure_inductance_duty;
 } mc_sample_t;
 
+typedef struct {
+	float theta[3]; // R, L and flux linkage relative to the configured values
+	float p[3][3];
+	float vd_last;
+	float vq_last;
+	float id_start;
+	float iq_start;
+	float vd_sum;
+	float vq_sum;
+	float id_sum;
+	float iq_sum;
+	float w_id_sum;
+	float w_iq_sum;
+	float w_sum;
+	int samples;
+} param_est_t;
+
+typedef enum {
+	HFI_STATE_LOCK = 0,
+	HFI_STATE_POL_POS,
+	HFI_STATE_POL_NEG,
+	HFI_STATE_RUN
+} hfi_state_t;
+
+typedef struct {
+	bool active;
+	hfi_state_t state;
+	float time;
+	float phase;
+	float speed;
+	float v_inj;
+	float i_alpha_last;
+	float i_beta_last;
+	float did;
+	float diq;
+	float ripple_pos;
+	float ripple_neg;
+	int samples;
+} hfi_t;
+
+typedef struct {
+	float offset[3];
+	int cal[3];
+	int rejected;
+	int hist[MCPWM_FOC_OFFSET_HIST_LEN][3];
+	int hist_ind;
+	int hist_num;
+	float hist_time;
+} offset_track_t;
+
+typedef struct {
+	volatile bool active;
+	float phase;
+	float speed;
+	float wn;
+	float time;
+	float travel;
+	float sum[4];
+	int samples;
+} encoder_nl_cal_t;
+
+typedef struct {
+	volatile bool active;
+	float sum[MCPWM_FOC_COGGING_LEN];
+	int num[MCPWM_FOC_COGGING_LEN];
+} cogging_cal_t;
+
+typedef struct {
+	float edge[8];
+	int num[8];
+	int hall_prev;
+} hall_learn_t;
+
 // Private variables
 static volatile mc_configuration *m_conf;
 static volatile mc_state m_state;
@@ -102,6 +178,8 @@ static volatile float m_observer_x1;
 static volatile float m_observer_x2;
 static volatile float m_pll_phase;
 static volatile float m_pll_speed;
+static volatile float m_pll_speed_corr;
+static volatile float m_pll_speed_ff_filter;
 static volatile mc_sample_t m_samples;
 static volatile int m_tachometer;
 static volatile int m_tachometer_abs;
@@ -109,6 +187,34 @@ static volatile float last_inj_adc_isr_duration;
 static volatile float m_pos_pid_now;
 static volatile bool m_init_done;
 static volatile float m_gamma_now;
+static volatile float m_fw_current_now;
+static volatile bool m_cc_step_now;
+static volatile int m_cc_step_ind;
+static volatile float m_cc_step_current;
+static float m_step_samples[MCPWM_FOC_STEP_SAMPLES];
+static volatile bool m_relay_now;
+static volatile bool m_relay_pos;
+static volatile bool m_relay_high;
+static volatile float m_relay_bias;
+static volatile float m_relay_current;
+static volatile float m_relay_hyst;
+static volatile float m_relay_time;
+static volatile float m_relay_err_min;
+static volatile float m_relay_err_max;
+static volatile int m_relay_cycles;
+static volatile float m_relay_period_sum;
+static volatile float m_relay_ampl_sum;
+static param_est_t m_param_est;
+static hfi_t m_hfi;
+static offset_track_t m_offset_track;
+static encoder_nl_cal_t m_encoder_nl_cal;
+static cogging_cal_t m_cogging_cal;
+static hall_learn_t m_hall_learn;
+static volatile float m_f_sw_now;
+static volatile float m_f_sw_sched;
+static volatile uint32_t m_f_sw_top;
+static uint32_t m_oversample_lead;
+static uint32_t m_oversample_len;
 
 #ifdef HW_HAS_3_SHUNTS
 static volatile int m_curr2_sum;
@@ -119,18 +225,46 @@ static volatile int m_curr2_offset;
 static void do_dc_cal(void);
 void observer_update(float v_alpha, float v_beta, float i_alpha, float i_beta,
 		float dt, volatile float *x1, volatile float *x2, volatile float *phase);
-static void pll_run(float phase, float dt, volatile float *phase_var,
-		volatile float *speed_var);
 static void control_current(volatile motor_state_t *state_m, float dt);
 static void svm(float alpha, float beta, uint32_t PWMHalfPeriod,
 		uint32_t* tAout, uint32_t* tBout, uint32_t* tCout, uint32_t *svm_sector);
+static void overmodulation(float *mod_alpha, float *mod_beta, float mod_max);
 static void run_pid_control_pos(float angle_now, float angle_set, float dt);
 static void run_pid_control_speed(float dt);
+static void run_relay(float error, float dt);
+static void param_est_reset(void);
+static void param_est_update(volatile motor_state_t *state_m, float speed, float dt);
+static void param_est_rls(float y, const float *phi);
+static void set_pid_setpoint(bool pos, float setpoint);
+static bool step_response(const float *samples, int samples_num, float dt,
+		float min_step, float *rise_time, float *settling_time, float *overshoot);
 static void stop_pwm_hw(void);
 static void start_pwm_hw(void);
 static int read_hall(void);
 static float correct_encoder(float obs_angle, float enc_angle, float speed);
+static float encoder_nl_correct(float angle);
+static void encoder_nl_cal_update(float angle, float dt);
+static float cogging_current(float phase);
+static void cogging_cal_update(float phase, float iq);
 static float correct_hall(float angle, float speed, float dt);
+static void hall_learn_update(int hall, float angle, float speed);
+static bool hall_learned(void);
+static int hall_learned_next(int hall, float *width);
+static float hall_learned_angle(int hall, bool reset, float angle, float dt);
+static float correct_hfi(float obs_angle, float speed);
+static float observer_gain_sched(float erpm, float current_rel);
+static void hfi_update(volatile motor_state_t *state_m, float dt);
+static void offset_track_reset(void);
+static void offset_track_update(int curr0, int curr1, int curr2);
+static void offset_track_v7(void);
+static void offset_track_hist(float dt);
+static void oversample_init(void);
+static void oversample_update(void);
+static int oversample_read(ADC_TypeDef *adc);
+static float f_sw_limit(float f_sw);
+static uint32_t f_sw_top(float f_sw);
+static void set_f_sw(float f_sw);
+static void f_sw_sched_update(float dt);
 
 // Threads
 static THD_WORKING_AREA(timer_thread_wa, 2048);
@@ -138,6 +272,8 @@ static THD_FUNCTION(timer_thread, arg);
 static volatile bool timer_thd_stop;
 
 // Macros
+#define ADC_FOR_IND(ind)	((ind) % 3 == 0 ? ADC1 : ((ind) % 3 == 1 ? ADC2 : ADC3))
+
 #ifdef HW_HAS_3_SHUNTS
 #define TIMER_UPDATE_DUTY(duty1, duty2, duty3) \
 		TIM1->CR1 |= TIM_CR1_UDIS; \
@@ -224,11 +360,20 @@ void mcpwm_foc_init(volatile mc_configuration *configuration) {
 	m_observer_x2 = 0.0;
 	m_pll_phase = 0.0;
 	m_pll_speed = 0.0;
+	m_pll_speed_corr = 0.0;
+	m_pll_speed_ff_filter = 0.0;
+	memset(&m_hall_learn, 0, sizeof(m_hall_learn));
+	m_hall_learn.hall_prev = -1;
+	m_f_sw_sched = f_sw_limit(m_conf->foc_f_sw);
+	m_f_sw_top = f_sw_top(m_f_sw_sched);
+	m_f_sw_now = (float)SYSTEM_CORE_CLOCK / (float)m_f_sw_top;
 	m_tachometer = 0;
 	m_tachometer_abs = 0;
 	last_inj_adc_isr_duration = 0;
 	m_pos_pid_now = 0.0;
 	m_gamma_now = 0.0;
+	param_est_reset();
+	memset(&m_hfi, 0, sizeof(m_hfi));
 	memset((void*)&m_motor_state, 0, sizeof(motor_state_t));
 	memset((void*)&m_samples, 0, sizeof(mc_sample_t));
 
@@ -247,7 +392,7 @@ void mcpwm_foc_init(volatile mc_configuration *configuration) {
 	// Time Base configuration
 	TIM_TimeBaseStructure.TIM_Prescaler = 0;
 	TIM_TimeBaseStructure.TIM_CounterMode = TIM_CounterMode_CenterAligned1;
-	TIM_TimeBaseStructure.TIM_Period = SYSTEM_CORE_CLOCK / (int)m_conf->foc_f_sw;
+	TIM_TimeBaseStructure.TIM_Period = m_f_sw_top;
 	TIM_TimeBaseStructure.TIM_ClockDivision = 0;
 	TIM_TimeBaseStructure.TIM_RepetitionCounter = 0;
 
@@ -329,7 +474,7 @@ void mcpwm_foc_init(volatile mc_configuration *configuration) {
 	// ADC Common Init
 	// Note that the ADC is running at 42MHz, which is higher than the
 	// specified 36MHz in the data sheet, but it works.
-	ADC_CommonInitStructure.ADC_Mode = ADC_TripleMode_RegSimult;
+	ADC_CommonInitStructure.ADC_Mode = ADC_TripleMode_RegSimult_InjecSimult;
 	ADC_CommonInitStructure.ADC_Prescaler = ADC_Prescaler_Div2;
 	ADC_CommonInitStructure.ADC_DMAAccessMode = ADC_DMAAccessMode_1;
 	ADC_CommonInitStructure.ADC_TwoSamplingDelay = ADC_TwoSamplingDelay_5Cycles;
@@ -357,6 +502,7 @@ void mcpwm_foc_init(volatile mc_configuration *configuration) {
 	ADC_MultiModeDMARequestAfterLastTransferCmd(ENABLE);
 
 	hw_setup_adc_channels();
+	oversample_init();
 
 	// Enable ADC1
 	ADC_Cmd(ADC1, ENABLE);
@@ -418,6 +564,10 @@ void mcpwm_foc_init(volatile mc_configuration *configuration) {
 	// and current samples in the center of V0
 	TIMER_UPDATE_SAMP(MCPWM_FOC_CURRENT_SAMP_OFFSET);
 
+	// The injected conversions for oversampling are only triggered when
+	// the zero vector is long enough, see oversample_update.
+	TIM8->CCR2 = 0xFFFF;
+
 	// Enable CC1 interrupt, which will be fired in V0 and V7
 	TIM_ITConfig(TIM8, TIM_IT_CC1, ENABLE);
 	nvicEnableVector(TIM8_CC_IRQn, 6);
@@ -484,8 +634,9 @@ void mcpwm_foc_set_configuration(volatile mc_configuration *configuration) {
 	m_control_mode = CONTROL_MODE_NONE;
 	m_state = MC_STATE_OFF;
 	stop_pwm_hw();
-	uint32_t top = SYSTEM_CORE_CLOCK / (int)m_conf->foc_f_sw;
-	TIMER_UPDATE_SAMP_TOP(MCPWM_FOC_CURRENT_SAMP_OFFSET, top);
+	param_est_reset();
+	memset(&m_hfi, 0, sizeof(m_hfi));
+	set_f_sw(m_conf->foc_f_sw);
 }
 
 mc_state mcpwm_foc_get_state(void) {
@@ -687,7 +838,7 @@ float mcpwm_foc_get_pid_pos_now(void) {
  * The switching frequency in Hz.
  */
 float mcpwm_foc_get_switching_frequency_now(void) {
-	return m_conf->foc_f_sw;
+	return m_f_sw_now;
 }
 
 /**
@@ -699,12 +850,12 @@ float mcpwm_foc_get_switching_frequency_now(void) {
 float mcpwm_foc_get_sampling_frequency_now(void) {
 #ifdef HW_HAS_PHASE_SHUNTS
 	if (m_conf->foc_sample_v0_v7) {
-		return m_conf->foc_f_sw;
+		return m_f_sw_now;
 	} else {
-		return m_conf->foc_f_sw / 2.0;
+		return m_f_sw_now / 2.0;
 	}
 #else
-	return m_conf->foc_f_sw / 2.0;
+	return m_f_sw_now / 2.0;
 #endif
 }
 
@@ -925,6 +1076,49 @@ float mcpwm_foc_get_vq(void) {
 	return m_motor_state.vq;
 }
 
+/**
+ * Get the parameters from the online estimator. They are equal to the
+ * configured values until the estimator has run with enough excitation.
+ *
+ * @param res
+ * The estimated motor resistance.
+ *
+ * @param ind
+ * The estimated motor inductance.
+ *
+ * @param flux_linkage
+ * The estimated motor flux linkage.
+ */
+void mcpwm_foc_get_param_est(float *res, float *ind, float *flux_linkage) {
+	*res = m_param_est.theta[0] * m_conf->foc_motor_r;
+	*ind = m_param_est.theta[1] * m_conf->foc_motor_l;
+	*flux_linkage = m_param_est.theta[2] * m_conf->foc_motor_flux_linkage;
+}
+
+/**
+ * Get the current sensor offsets that are in use. They are equal to the
+ * startup calibration unless offset tracking is enabled.
+ *
+ * @param curr0_offset
+ * The offset of the first current sensor in ADC counts.
+ *
+ * @param curr1_offset
+ * The offset of the second current sensor in ADC counts.
+ *
+ * @param curr2_offset
+ * The offset of the third current sensor in ADC counts, or 0 on hardware
+ * with two current sensors.
+ */
+void mcpwm_foc_get_current_offsets(int *curr0_offset, int *curr1_offset, int *curr2_offset) {
+	*curr0_offset = m_curr0_offset;
+	*curr1_offset = m_curr1_offset;
+#ifdef HW_HAS_3_SHUNTS
+	*curr2_offset = m_curr2_offset;
+#else
+	*curr2_offset = 0;
+#endif
+}
+
 /**
  * Measure encoder offset and direction.
  *
@@ -1142,6 +1336,268 @@ void mcpwm_foc_encoder_detect(float current, bool print, float *offset, float *r
 	mc_interface_unlock();
 }
 
+/**
+ * Calibrate the encoder nonlinearity. The motor is spun in open loop at a
+ * constant speed, a slow PLL tracks the raw mechanical encoder angle and the
+ * PLL error is fitted to the first and second harmonic of the PLL angle over
+ * a few revolutions. Eccentricity of the magnet shows up at these harmonics.
+ *
+ * @param current
+ * The open loop current to spin the motor with.
+ *
+ * @param erpm
+ * The open loop speed in ERPM.
+ *
+ * @param coef
+ * The sine and cosine coefficients of the first and second harmonic of the
+ * encoder error in degrees.
+ *
+ * @return
+ * True for success, false otherwise.
+ */
+bool mcpwm_foc_encoder_nl_cal(float current, float erpm, float *coef) {
+	if (!encoder_is_configured()) {
+		return false;
+	}
+
+	mc_interface_lock();
+
+	// Disable timeout
+	systime_t tout = timeout_get_timeout_msec();
+	float tout_c = timeout_get_brake_current();
+	timeout_reset();
+	timeout_configure(600000, 0.0);
+
+	// Calibrate the raw angle
+	bool comp_old = m_conf->foc_encoder_nl_comp;
+	m_conf->foc_encoder_nl_comp = false;
+
+	mcpwm_foc_set_openloop(current, erpm);
+	chThdSleepMilliseconds(MCPWM_FOC_ENCODER_NL_SPINUP_TIME);
+
+	// Measure the mechanical speed to start the PLL with
+	float angle_last = encoder_read_deg();
+	float travel = 0.0;
+	for (int i = 0;i < 500;i++) {
+		chThdSleepMilliseconds(1);
+		float angle = encoder_read_deg();
+		travel += utils_angle_difference(angle, angle_last);
+		angle_last = angle;
+	}
+
+	const float speed = (travel / 0.5) * (M_PI / 180.0);
+	bool ok = fabsf(travel) > 10.0;
+
+	if (ok) {
+		m_encoder_nl_cal.phase = encoder_read_deg() * (M_PI / 180.0);
+		m_encoder_nl_cal.speed = speed;
+		m_encoder_nl_cal.wn = fabsf(speed) * MCPWM_FOC_ENCODER_NL_PLL_BW;
+		m_encoder_nl_cal.time = MCPWM_FOC_ENCODER_NL_SETTLE / m_encoder_nl_cal.wn;
+		m_encoder_nl_cal.travel = 0.0;
+		for (int i = 0;i < 4;i++) {
+			m_encoder_nl_cal.sum[i] = 0.0;
+		}
+		m_encoder_nl_cal.samples = 0;
+		m_encoder_nl_cal.active = true;
+
+		const float time = m_encoder_nl_cal.time +
+				((float)MCPWM_FOC_ENCODER_NL_REVS * 2.0 * M_PI) / fabsf(speed);
+		const int timeout = (int)(time * 2000.0) + 1000;
+
+		int cnt = 0;
+		while (m_encoder_nl_cal.active) {
+			chThdSleepMilliseconds(1);
+			cnt++;
+			if (cnt > timeout) {
+				m_encoder_nl_cal.active = false;
+				ok = false;
+				break;
+			}
+		}
+	}
+
+	m_iq_set = 0.0;
+	m_control_mode = CONTROL_MODE_NONE;
+	m_state = MC_STATE_OFF;
+	stop_pwm_hw();
+
+	m_conf->foc_encoder_nl_comp = comp_old;
+
+	// Enable timeout
+	timeout_configure(tout, tout_c);
+
+	mc_interface_unlock();
+
+	if (!ok || m_encoder_nl_cal.samples == 0) {
+		return false;
+	}
+
+	// The PLL follows part of the error, so divide the fitted harmonics by
+	// the PLL error transfer function s^2 / (s^2 + 2 * wn * s + wn^2).
+	const float wn = m_encoder_nl_cal.wn;
+	for (int k = 1;k <= 2;k++) {
+		const float a = 2.0 * m_encoder_nl_cal.sum[2 * k - 2] / (float)m_encoder_nl_cal.samples;
+		const float b = 2.0 * m_encoder_nl_cal.sum[2 * k - 1] / (float)m_encoder_nl_cal.samples;
+		const float w = (float)k * speed;
+		const float re = (w * w - wn * wn) / (w * w);
+		const float im = -2.0 * wn / w;
+
+		coef[2 * k - 2] = (a * re - b * im) * (180.0 / M_PI);
+		coef[2 * k - 1] = (b * re + a * im) * (180.0 / M_PI);
+	}
+
+	for (int i = 0;i < 4;i++) {
+		if (UTILS_IS_NAN(coef[i]) || fabsf(coef[i]) > MCPWM_FOC_ENCODER_NL_MAX) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/**
+ * Record the cogging current. The motor is turned slowly one mechanical
+ * revolution forward and one back in position control, and the current
+ * that the position controller needs is averaged over the electrical angle.
+ * Cogging repeats with the slot pitch, which is a whole fraction of an
+ * electrical revolution, so the table covers one electrical revolution
+ * and all pole pairs are averaged into it. Friction has opposite signs in
+ * the two directions and cancels out.
+ *
+ * @param time
+ * The time for one mechanical revolution in each direction in seconds.
+ *
+ * @param table
+ * The cogging current table, MCPWM_FOC_COGGING_LEN entries scaled so that
+ * 127 corresponds to scale.
+ *
+ * @param scale
+ * The largest cogging current in the table in A.
+ *
+ * @return
+ * True for success, false otherwise.
+ */
+bool mcpwm_foc_cogging_cal(float time, int8_t *table, float *scale) {
+	if (!encoder_is_configured() || time < 1.0) {
+		return false;
+	}
+
+	mc_interface_lock();
+
+	// Disable timeout
+	systime_t tout = timeout_get_timeout_msec();
+	float tout_c = timeout_get_brake_current();
+	timeout_reset();
+	timeout_configure(600000, 0.0);
+
+	// Record without the old table
+	bool comp_old = m_conf->foc_cogging_comp;
+	m_conf->foc_cogging_comp = false;
+
+	// Lock the rotor where it is and wait for the encoder index
+	const float start = m_pos_pid_now;
+	mcpwm_foc_set_pid_pos(start);
+
+	int cnt = 0;
+	while (!encoder_index_found() && cnt < 30000) {
+		chThdSleepMilliseconds(1);
+		cnt++;
+	}
+
+	mcpwm_foc_set_pid_pos(start);
+	chThdSleepMilliseconds(500);
+
+	for (int i = 0;i < MCPWM_FOC_COGGING_LEN;i++) {
+		m_cogging_cal.sum[i] = 0.0;
+		m_cogging_cal.num[i] = 0;
+	}
+	m_cogging_cal.active = encoder_index_found();
+
+	// One mechanical revolution forward and back
+	const int steps = (int)(time * 1000.0);
+	const float rev = 360.0 / m_conf->p_pid_ang_div;
+	for (int i = 0;i <= 2 * steps && m_cogging_cal.active;i++) {
+		const int step = i <= steps ? i : 2 * steps - i;
+		float pos = start + (rev * (float)step) / (float)steps;
+		utils_norm_angle(&pos);
+		mcpwm_foc_set_pid_pos(pos);
+		chThdSleepMilliseconds(1);
+	}
+
+	bool ok = m_cogging_cal.active;
+	m_cogging_cal.active = false;
+
+	m_iq_set = 0.0;
+	m_control_mode = CONTROL_MODE_NONE;
+	m_state = MC_STATE_OFF;
+	stop_pwm_hw();
+
+	m_conf->foc_cogging_comp = comp_old;
+
+	// Enable timeout
+	timeout_configure(tout, tout_c);
+
+	mc_interface_unlock();
+
+	if (!ok) {
+		return false;
+	}
+
+	// Average the bins and remove the mean, which is load torque
+	float avg[MCPWM_FOC_COGGING_LEN];
+	float mean = 0.0;
+	for (int i = 0;i < MCPWM_FOC_COGGING_LEN;i++) {
+		if (m_cogging_cal.num[i] == 0) {
+			return false;
+		}
+
+		avg[i] = m_cogging_cal.sum[i] / (float)m_cogging_cal.num[i];
+		mean += avg[i] / (float)MCPWM_FOC_COGGING_LEN;
+	}
+
+	float max = 0.0;
+	for (int i = 0;i < MCPWM_FOC_COGGING_LEN;i++) {
+		avg[i] -= mean;
+		if (fabsf(avg[i]) > max) {
+			max = fabsf(avg[i]);
+		}
+	}
+
+	if (max < 1e-6) {
+		return false;
+	}
+
+	for (int i = 0;i < MCPWM_FOC_COGGING_LEN;i++) {
+		table[i] = (int8_t)roundf((avg[i] / max) * 127.0);
+	}
+	*scale = max;
+
+	return true;
+}
+
+/**
+ * Print the learned hall sensor sector edges and widths.
+ */
+void mcpwm_foc_print_hall_edges(void) {
+	for (int i = 0;i < 8;i++) {
+		if (m_conf->foc_hall_table[i] > 200) {
+			continue;
+		}
+
+		if (m_conf->foc_hall_edge[i] < 0.0) {
+			commands_printf("Hall %d: Transitions: %d", i, m_hall_learn.num[i]);
+		} else {
+			float width;
+			hall_learned_next(i, &width);
+			commands_printf("Hall %d: Edge: %.1f Width: %.1f Transitions: %d", i,
+					(double)m_conf->foc_hall_edge[i], (double)(width * (180.0 / M_PI)),
+					m_hall_learn.num[i]);
+		}
+	}
+
+	commands_printf("Learned edges used: %s", hall_learned() ? "Yes" : "No");
+}
+
 /**
  * Lock the motor with a current and sample the voiltage and current to
  * calculate the motor resistance.
@@ -1285,15 +1741,16 @@ float mcpwm_foc_measure_inductance(float duty, int samples, float *curr) {
  */
 bool mcpwm_foc_measure_res_ind(float *res, float *ind) {
 	const float f_sw_old = m_conf->foc_f_sw;
+	const bool f_sw_sched_old = m_conf->foc_f_sw_sched;
 	const float kp_old = m_conf->foc_current_kp;
 	const float ki_old = m_conf->foc_current_ki;
 
 	m_conf->foc_f_sw = 10000.0;
+	m_conf->foc_f_sw_sched = false;
 	m_conf->foc_current_kp = 0.01;
 	m_conf->foc_current_ki = 10.0;
 
-	uint32_t top = SYSTEM_CORE_CLOCK / (int)m_conf->foc_f_sw;
-	TIMER_UPDATE_SAMP_TOP(MCPWM_FOC_CURRENT_SAMP_OFFSET, top);
+	set_f_sw(m_conf->foc_f_sw);
 
 	float res_tmp = 0.0;
 	float i_last = 0.0;
@@ -1313,8 +1770,7 @@ bool mcpwm_foc_measure_res_ind(float *res, float *ind) {
 	*res = mcpwm_foc_measure_resistance(i_last, 200);
 
 	m_conf->foc_f_sw = 3000.0;
-	top = SYSTEM_CORE_CLOCK / (int)m_conf->foc_f_sw;
-	TIMER_UPDATE_SAMP_TOP(MCPWM_FOC_CURRENT_SAMP_OFFSET, top);
+	set_f_sw(m_conf->foc_f_sw);
 
 	float duty_last = 0.0;
 	for (float i = 0.02;i < 0.5;i *= 1.5) {
@@ -1330,34 +1786,43 @@ bool mcpwm_foc_measure_res_ind(float *res, float *ind) {
 	*ind = mcpwm_foc_measure_inductance(duty_last, 200, 0);
 
 	m_conf->foc_f_sw = f_sw_old;
+	m_conf->foc_f_sw_sched = f_sw_sched_old;
 	m_conf->foc_current_kp = kp_old;
 	m_conf->foc_current_ki = ki_old;
 
-	top = SYSTEM_CORE_CLOCK / (int)m_conf->foc_f_sw;
-	TIMER_UPDATE_SAMP_TOP(MCPWM_FOC_CURRENT_SAMP_OFFSET, top);
+	set_f_sw(m_conf->foc_f_sw);
 
 	return true;
 }
 
 /**
- * Run the motor in open loop and figure out at which angles the hall sensors are.
+ * Lock the motor and apply a current step to verify the current controller
+ * gains. The step goes from 20 % to 100 % of the current, so that the rotor is
+ * locked already when the step is applied.
  *
  * @param current
- * Current to use.
+ * The current to step to.
  *
- * @param hall_table
- * Table to store the result to.
+ * @param rise_time
+ * The 10 % to 90 % rise time in seconds.
+ *
+ * @param settling_time
+ * The time until the current stays within 5 % of the final value, in seconds.
+ *
+ * @param overshoot
+ * The overshoot in percent of the step size.
  *
  * @return
- * true: Success
- * false: Something went wrong
+ * True if the current settled during the test, false otherwise.
  */
-bool mcpwm_foc_hall_detect(float current, uint8_t *hall_table) {
+bool mcpwm_foc_measure_current_step(float current, float *rise_time,
+		float *settling_time, float *overshoot) {
 	mc_interface_lock();
 
 	m_phase_override = true;
-	m_id_set = current;
-	m_iq_set = 0.0;
+	m_phase_now_override = 0.0;
+	m_id_set = 0.0;
+	m_iq_set = current * 0.2;
 	m_control_mode = CONTROL_MODE_CURRENT;
 	m_state = MC_STATE_RUNNING;
 
@@ -1367,47 +1832,28 @@ bool mcpwm_foc_hall_detect(float current, uint8_t *hall_table) {
 	timeout_reset();
 	timeout_configure(60000, 0.0);
 
-	// Lock the motor
-	m_phase_now_override = 0;
-	chThdSleepMilliseconds(1000);
-
-	float sin_hall[8];
-	float cos_hall[8];
-	int hall_iterations[8];
-	memset(sin_hall, 0, sizeof(sin_hall));
-	memset(cos_hall, 0, sizeof(cos_hall));
-	memset(hall_iterations, 0, sizeof(hall_iterations));
+	// Wait for the current to rise and the motor to lock.
+	chThdSleepMilliseconds(500);
 
-	// Forwards
-	for (int i = 0;i < 3;i++) {
-		for (int i = 0;i < 360;i++) {
-			m_phase_now_override = (float)i * M_PI / 180.0;
-			chThdSleepMilliseconds(5);
+	// The step is applied by the control loop when the sampling starts
+	m_cc_step_current = current;
+	m_cc_step_ind = 0;
+	m_cc_step_now = true;
 
-			int hall = read_hall();
-			float s, c;
-			sincosf(m_phase_now_override, &s, &c);
-			sin_hall[hall] += s;
-			cos_hall[hall] += c;
-			hall_iterations[hall]++;
+	int cnt = 0;
+	while (m_cc_step_now) {
+		chThdSleepMilliseconds(1);
+		cnt++;
+		// Timeout
+		if (cnt > 1000) {
+			m_cc_step_now = false;
+			break;
 		}
 	}
 
-	// Reverse
-	for (int i = 0;i < 3;i++) {
-		for (int i = 360;i >= 0;i--) {
-			m_phase_now_override = (float)i * M_PI / 180.0;
-			chThdSleepMilliseconds(5);
-
-			int hall = read_hall();
-			float s, c;
-			sincosf(m_phase_now_override, &s, &c);
-			sin_hall[hall] += s;
-			cos_hall[hall] += c;
-			hall_iterations[hall]++;
-		}
-	}
+	const int samples = m_cc_step_ind;
 
+	// Stop
 	m_id_set = 0.0;
 	m_iq_set = 0.0;
 	m_phase_override = false;
@@ -1418,54 +1864,366 @@ bool mcpwm_foc_hall_detect(float current, uint8_t *hall_table) {
 	// Enable timeout
 	timeout_configure(tout, tout_c);
 
-	int fails = 0;
-	for(int i = 0;i < 8;i++) {
-		if (hall_iterations[i] > 30) {
-			float ang = atan2f(sin_hall[i], cos_hall[i]) * 180.0 / M_PI;
-			utils_norm_angle(&ang);
-			hall_table[i] = (uint8_t)(ang * 200.0 / 360.0);
-		} else {
-			hall_table[i] = 255;
-			fails++;
-		}
-	}
-
 	mc_interface_unlock();
 
-	return fails == 2;
-}
-
-void mcpwm_foc_print_state(void) {
-	commands_printf("Mod d:        %.2f", (double)m_motor_state.mod_d);
-	commands_printf("Mod q:        %.2f", (double)m_motor_state.mod_q);
-	commands_printf("Duty:         %.2f", (double)m_motor_state.duty_now);
-	commands_printf("Vd:           %.2f", (double)m_motor_state.vd);
-	commands_printf("Vq:           %.2f", (double)m_motor_state.vq);
-	commands_printf("Phase:        %.2f", (double)m_motor_state.phase);
-	commands_printf("V_alpha:      %.2f", (double)m_motor_state.v_alpha);
-	commands_printf("V_beta:       %.2f", (double)m_motor_state.v_beta);
-	commands_printf("id:           %.2f", (double)m_motor_state.id);
-	commands_printf("iq:           %.2f", (double)m_motor_state.iq);
-	commands_printf("id_filter:    %.2f", (double)m_motor_state.id_filter);
-	commands_printf("iq_filter:    %.2f", (double)m_motor_state.iq_filter);
-	commands_printf("id_target:    %.2f", (double)m_motor_state.id_target);
-	commands_printf("iq_target:    %.2f", (double)m_motor_state.iq_target);
-	commands_printf("i_abs:        %.2f", (double)m_motor_state.i_abs);
-	commands_printf("i_abs_filter: %.2f", (double)m_motor_state.i_abs_filter);
-	commands_printf("Obs_x1:       %.2f", (double)m_observer_x1);
-	commands_printf("Obs_x2:       %.2f", (double)m_observer_x2);
-}
+	if (samples < MCPWM_FOC_STEP_SAMPLES) {
+		return false;
+	}
 
-float mcpwm_foc_get_last_inj_adc_isr_duration(void) {
-	return last_inj_adc_isr_duration;
+	return step_response(m_step_samples, samples,
+			1.0 / mcpwm_foc_get_sampling_frequency_now(), 0.4 * current,
+			rise_time, settling_time, overshoot);
 }
 
-void mcpwm_foc_tim_sample_int_handler(void) {
-	if (m_init_done) {
-		// Generate COM event here for synchronization
-		TIM_GenerateEvent(TIM1, TIM_EventSource_COM);
-	}
-}
+/**
+ * Run a relay feedback experiment on the speed or position loop and measure
+ * the ultimate gain and period. The setpoint is first held with the present
+ * PID gains to find the bias current, after which the q-axis current is
+ * switched between bias + current and bias - current with hysteresis.
+ *
+ * @param pos
+ * Run the experiment on the position loop instead of the speed loop.
+ *
+ * @param setpoint
+ * The speed in ERPM or the position in degrees to oscillate around.
+ *
+ * @param current
+ * The relay amplitude in A.
+ *
+ * @param hyst
+ * The relay hysteresis in ERPM or degrees.
+ *
+ * @param ku
+ * The ultimate gain, in the same units as s_pid_kp or p_pid_kp.
+ *
+ * @param tu
+ * The ultimate period in seconds.
+ *
+ * @return
+ * True if a sustained oscillation was measured, false otherwise.
+ */
+bool mcpwm_foc_measure_relay(bool pos, float setpoint, float current, float hyst,
+		float *ku, float *tu) {
+	if (pos && encoder_is_configured() && !encoder_index_found()) {
+		return false;
+	}
+
+	mc_interface_lock();
+
+	// Disable timeout
+	systime_t tout = timeout_get_timeout_msec();
+	float tout_c = timeout_get_brake_current();
+	timeout_reset();
+	timeout_configure(60000, 0.0);
+
+	// Hold the setpoint and measure the current needed for that
+	set_pid_setpoint(pos, setpoint);
+	chThdSleepMilliseconds(1000);
+
+	float bias = 0.0;
+	for (int i = 0;i < 500;i++) {
+		bias += m_iq_set;
+		chThdSleepMilliseconds(1);
+	}
+	bias /= 500.0;
+
+	m_relay_bias = bias;
+	m_relay_current = current;
+	m_relay_hyst = hyst;
+	m_relay_pos = pos;
+	m_relay_high = false;
+	m_relay_time = 0.0;
+	m_relay_err_min = 0.0;
+	m_relay_err_max = 0.0;
+	m_relay_cycles = 0;
+	m_relay_period_sum = 0.0;
+	m_relay_ampl_sum = 0.0;
+	m_relay_now = true;
+
+	int cnt = 0;
+	while (m_relay_now) {
+		chThdSleepMilliseconds(1);
+		cnt++;
+		// Timeout
+		if (cnt > 10000) {
+			m_relay_now = false;
+			break;
+		}
+	}
+
+	const int cycles = m_relay_cycles;
+
+	// Stop
+	m_id_set = 0.0;
+	m_iq_set = 0.0;
+	m_control_mode = CONTROL_MODE_NONE;
+	m_state = MC_STATE_OFF;
+	stop_pwm_hw();
+
+	// Enable timeout
+	timeout_configure(tout, tout_c);
+
+	mc_interface_unlock();
+
+	if (cycles <= (MCPWM_FOC_RELAY_SKIP_CYCLES + MCPWM_FOC_RELAY_CYCLES)) {
+		return false;
+	}
+
+	const float ampl = m_relay_ampl_sum / (float)MCPWM_FOC_RELAY_CYCLES;
+	if (ampl <= hyst) {
+		return false;
+	}
+
+	// Describing function of a relay with hysteresis, with the relay amplitude
+	// in PID output units.
+	*ku = (4.0 * current / m_conf->lo_current_max) /
+			(M_PI * sqrtf(SQ(ampl) - SQ(hyst)));
+	*tu = m_relay_period_sum / (float)MCPWM_FOC_RELAY_CYCLES;
+
+	// The speed controller scales its gains by 1 / 20
+	if (!pos) {
+		*ku *= 20.0;
+	}
+
+	return true;
+}
+
+/**
+ * Hold a speed or position setpoint with the present PID gains, step it and
+ * record the step response.
+ *
+ * @param pos
+ * Step the position loop instead of the speed loop.
+ *
+ * @param setpoint
+ * The speed in ERPM or the position in degrees to start from.
+ *
+ * @param step
+ * The step size in ERPM or degrees.
+ *
+ * @param time
+ * The length of the recording in seconds.
+ *
+ * @param rise_time
+ * The 10 % to 90 % rise time in seconds.
+ *
+ * @param settling_time
+ * The time until the response stays within 5 % of the final value, in seconds.
+ *
+ * @param overshoot
+ * The overshoot in percent of the step size.
+ *
+ * @return
+ * True if the response settled during the test, false otherwise.
+ */
+bool mcpwm_foc_measure_pid_step(bool pos, float setpoint, float step, float time,
+		float *rise_time, float *settling_time, float *overshoot) {
+	if (pos && encoder_is_configured() && !encoder_index_found()) {
+		return false;
+	}
+
+	mc_interface_lock();
+
+	// Disable timeout
+	systime_t tout = timeout_get_timeout_msec();
+	float tout_c = timeout_get_brake_current();
+	timeout_reset();
+	timeout_configure(60000, 0.0);
+
+	set_pid_setpoint(pos, setpoint);
+	chThdSleepMilliseconds(1000);
+
+	int decimation = (int)ceilf((time * 1000.0) / (float)MCPWM_FOC_STEP_SAMPLES);
+	if (decimation < 1) {
+		decimation = 1;
+	}
+
+	// Record the response in the direction of the step
+	const float sign = step < 0.0 ? -1.0 : 1.0;
+	float setpoint_new = setpoint + step;
+	if (pos) {
+		utils_norm_angle(&setpoint_new);
+	}
+	set_pid_setpoint(pos, setpoint_new);
+
+	for (int i = 0;i < MCPWM_FOC_STEP_SAMPLES;i++) {
+		if (pos) {
+			m_step_samples[i] = sign * utils_angle_difference(m_pos_pid_now, setpoint);
+		} else {
+			m_step_samples[i] = sign * (mcpwm_foc_get_rpm() - setpoint);
+		}
+
+		chThdSleepMilliseconds(decimation);
+	}
+
+	// Stop
+	m_id_set = 0.0;
+	m_iq_set = 0.0;
+	m_control_mode = CONTROL_MODE_NONE;
+	m_state = MC_STATE_OFF;
+	stop_pwm_hw();
+
+	// Enable timeout
+	timeout_configure(tout, tout_c);
+
+	mc_interface_unlock();
+
+	return step_response(m_step_samples, MCPWM_FOC_STEP_SAMPLES,
+			(float)decimation * 1e-3, 0.4 * fabsf(step),
+			rise_time, settling_time, overshoot);
+}
+
+/**
+ * Run the motor in open loop and figure out at which angles the hall sensors are.
+ *
+ * @param current
+ * Current to use.
+ *
+ * @param hall_table
+ * Table to store the result to.
+ *
+ * @return
+ * true: Success
+ * false: Something went wrong
+ */
+bool mcpwm_foc_hall_detect(float current, uint8_t *hall_table) {
+	mc_interface_lock();
+
+	m_phase_override = true;
+	m_id_set = current;
+	m_iq_set = 0.0;
+	m_control_mode = CONTROL_MODE_CURRENT;
+	m_state = MC_STATE_RUNNING;
+
+	// Disable timeout
+	systime_t tout = timeout_get_timeout_msec();
+	float tout_c = timeout_get_brake_current();
+	timeout_reset();
+	timeout_configure(60000, 0.0);
+
+	// Lock the motor
+	m_phase_now_override = 0;
+	chThdSleepMilliseconds(1000);
+
+	float sin_hall[8];
+	float cos_hall[8];
+	int hall_iterations[8];
+	memset(sin_hall, 0, sizeof(sin_hall));
+	memset(cos_hall, 0, sizeof(cos_hall));
+	memset(hall_iterations, 0, sizeof(hall_iterations));
+
+	// Forwards
+	for (int i = 0;i < 3;i++) {
+		for (int i = 0;i < 360;i++) {
+			m_phase_now_override = (float)i * M_PI / 180.0;
+			chThdSleepMilliseconds(5);
+
+			int hall = read_hall();
+			float s, c;
+			sincosf(m_phase_now_override, &s, &c);
+			sin_hall[hall] += s;
+			cos_hall[hall] += c;
+			hall_iterations[hall]++;
+		}
+	}
+
+	// Reverse
+	for (int i = 0;i < 3;i++) {
+		for (int i = 360;i >= 0;i--) {
+			m_phase_now_override = (float)i * M_PI / 180.0;
+			chThdSleepMilliseconds(5);
+
+			int hall = read_hall();
+			float s, c;
+			sincosf(m_phase_now_override, &s, &c);
+			sin_hall[hall] += s;
+			cos_hall[hall] += c;
+			hall_iterations[hall]++;
+		}
+	}
+
+	m_id_set = 0.0;
+	m_iq_set = 0.0;
+	m_phase_override = false;
+	m_control_mode = CONTROL_MODE_NONE;
+	m_state = MC_STATE_OFF;
+	stop_pwm_hw();
+
+	// Enable timeout
+	timeout_configure(tout, tout_c);
+
+	int fails = 0;
+	for(int i = 0;i < 8;i++) {
+		if (hall_iterations[i] > 30) {
+			float ang = atan2f(sin_hall[i], cos_hall[i]) * 180.0 / M_PI;
+			utils_norm_angle(&ang);
+			hall_table[i] = (uint8_t)(ang * 200.0 / 360.0);
+		} else {
+			hall_table[i] = 255;
+			fails++;
+		}
+	}
+
+	mc_interface_unlock();
+
+	return fails == 2;
+}
+
+void mcpwm_foc_print_state(void) {
+	commands_printf("Mod d:        %.2f", (double)m_motor_state.mod_d);
+	commands_printf("Mod q:        %.2f", (double)m_motor_state.mod_q);
+	commands_printf("Duty:         %.2f", (double)m_motor_state.duty_now);
+	commands_printf("Vd:           %.2f", (double)m_motor_state.vd);
+	commands_printf("Vq:           %.2f", (double)m_motor_state.vq);
+	commands_printf("Phase:        %.2f", (double)m_motor_state.phase);
+	commands_printf("V_alpha:      %.2f", (double)m_motor_state.v_alpha);
+	commands_printf("V_beta:       %.2f", (double)m_motor_state.v_beta);
+	commands_printf("id:           %.2f", (double)m_motor_state.id);
+	commands_printf("iq:           %.2f", (double)m_motor_state.iq);
+	commands_printf("id_filter:    %.2f", (double)m_motor_state.id_filter);
+	commands_printf("iq_filter:    %.2f", (double)m_motor_state.iq_filter);
+	commands_printf("id_target:    %.2f", (double)m_motor_state.id_target);
+	commands_printf("iq_target:    %.2f", (double)m_motor_state.iq_target);
+	commands_printf("FW current:   %.2f", (double)m_fw_current_now);
+	commands_printf("R est:        %.2f %%", (double)(m_param_est.theta[0] * 100.0));
+	commands_printf("L est:        %.2f %%", (double)(m_param_est.theta[1] * 100.0));
+	commands_printf("Lambda est:   %.2f %%", (double)(m_param_est.theta[2] * 100.0));
+	commands_printf("i_abs:        %.2f", (double)m_motor_state.i_abs);
+	commands_printf("i_abs_filter: %.2f", (double)m_motor_state.i_abs_filter);
+	commands_printf("Obs_x1:       %.2f", (double)m_observer_x1);
+	commands_printf("Obs_x2:       %.2f", (double)m_observer_x2);
+}
+
+void mcpwm_foc_print_offsets(void) {
+	commands_printf("Calibration:  %d %d %d", m_offset_track.cal[0],
+			m_offset_track.cal[1], m_offset_track.cal[2]);
+	commands_printf("Tracked:      %.2f %.2f %.2f", (double)m_offset_track.offset[0],
+			(double)m_offset_track.offset[1], (double)m_offset_track.offset[2]);
+	commands_printf("Rejected:     %d", m_offset_track.rejected);
+
+	// Oldest entry first
+	for (int i = 0;i < m_offset_track.hist_num;i++) {
+		int ind = m_offset_track.hist_ind - m_offset_track.hist_num + i;
+		if (ind < 0) {
+			ind += MCPWM_FOC_OFFSET_HIST_LEN;
+		}
+
+		commands_printf("%3.0f s:        %d %d %d",
+				(double)((float)(i - m_offset_track.hist_num) * MCPWM_FOC_OFFSET_HIST_TIME),
+				m_offset_track.hist[ind][0], m_offset_track.hist[ind][1], m_offset_track.hist[ind][2]);
+	}
+}
+
+float mcpwm_foc_get_last_inj_adc_isr_duration(void) {
+	return last_inj_adc_isr_duration;
+}
+
+void mcpwm_foc_tim_sample_int_handler(void) {
+	if (m_init_done) {
+		// Generate COM event here for synchronization
+		TIM_GenerateEvent(TIM1, TIM_EventSource_COM);
+	}
+}
 
 void mcpwm_foc_adc_int_handler(void *p, uint32_t flags) {
 	(void)p;
@@ -1475,6 +2233,11 @@ void mcpwm_foc_adc_int_handler(void *p, uint32_t flags) {
 
 	bool is_v7 = !(TIM1->CR1 & TIM_CR1_DIR);
 
+	// The injected group only converts when oversample_update scheduled it
+	// for this zero vector.
+	const bool oversampled = ADC1->SR & ADC_SR_JEOC;
+	ADC1->SR = ~(ADC_SR_JEOC | ADC_SR_JSTRT);
+
 	if (!m_samples.measure_inductance_now) {
 #ifdef HW_HAS_PHASE_SHUNTS
 		if (!m_conf->foc_sample_v0_v7 && is_v7) {
@@ -1482,6 +2245,11 @@ void mcpwm_foc_adc_int_handler(void *p, uint32_t flags) {
 		}
 #else
 		if (is_v7) {
+			// All low side switches are off in V7, so the low side shunts carry
+			// no current.
+			if (m_conf->foc_offset_track && m_dccal_done && m_state == MC_STATE_RUNNING) {
+				offset_track_v7();
+			}
 			return;
 		}
 #endif
@@ -1497,12 +2265,33 @@ void mcpwm_foc_adc_int_handler(void *p, uint32_t flags) {
 	int curr2 = ADC_Value[ADC_IND_CURR3];
 #endif
 
+	if (oversampled && !m_samples.measure_inductance_now) {
+		curr0 = oversample_read(ADC_FOR_IND(ADC_IND_CURR1));
+		curr1 = oversample_read(ADC_FOR_IND(ADC_IND_CURR2));
+#ifdef HW_HAS_3_SHUNTS
+		curr2 = oversample_read(ADC_FOR_IND(ADC_IND_CURR3));
+#endif
+	}
+
 	m_curr0_sum += curr0;
 	m_curr1_sum += curr1;
 #ifdef HW_HAS_3_SHUNTS
 	m_curr2_sum += curr2;
 #endif
 
+	// With the outputs off no current flows as long as the back emf is
+	// well below the bus voltage.
+	if (m_conf->foc_offset_track && m_dccal_done && !m_output_on &&
+			m_state != MC_STATE_RUNNING &&
+			(SQ(m_motor_state.mod_d) + SQ(m_motor_state.mod_q)) <
+			SQ(MCPWM_FOC_OFFSET_MAX_MOD)) {
+#ifdef HW_HAS_3_SHUNTS
+		offset_track_update(curr0, curr1, curr2);
+#else
+		offset_track_update(curr0, curr1, 0);
+#endif
+	}
+
 	curr0 -= m_curr0_offset;
 	curr1 -= m_curr1_offset;
 #ifdef HW_HAS_3_SHUNTS
@@ -1538,19 +2327,31 @@ void mcpwm_foc_adc_int_handler(void *p, uint32_t flags) {
 	} else {
 #ifdef HW_HAS_PHASE_SHUNTS
 		if (m_conf->foc_sample_v0_v7 && is_v7) {
-			if (TIM1->CCR1 < TIM1->CCR2 && TIM1->CCR1 < TIM1->CCR3) {
+			// A leg that is clamped to a rail by discontinuous modulation does not
+			// switch, so it has no edge close to this sample. Legs clamped high have
+			// a compare value above ARR already.
+			const uint32_t ccr1 = TIM1->CCR1 ? TIM1->CCR1 : TIM1->ARR + 1;
+			const uint32_t ccr2 = TIM1->CCR2 ? TIM1->CCR2 : TIM1->ARR + 1;
+			const uint32_t ccr3 = TIM1->CCR3 ? TIM1->CCR3 : TIM1->ARR + 1;
+
+			if (ccr1 < ccr2 && ccr1 < ccr3) {
 				ADC_curr_norm_value[0] = -(ADC_curr_norm_value[1] + ADC_curr_norm_value[2]);
-			} else if (TIM1->CCR2 < TIM1->CCR1 && TIM1->CCR2 < TIM1->CCR3) {
+			} else if (ccr2 < ccr1 && ccr2 < ccr3) {
 				ADC_curr_norm_value[1] = -(ADC_curr_norm_value[0] + ADC_curr_norm_value[2]);
-			} else if (TIM1->CCR3 < TIM1->CCR1 && TIM1->CCR3 < TIM1->CCR2) {
+			} else if (ccr3 < ccr1 && ccr3 < ccr2) {
 				ADC_curr_norm_value[2] = -(ADC_curr_norm_value[0] + ADC_curr_norm_value[1]);
 			}
 		} else {
-			if (TIM1->CCR1 > TIM1->CCR2 && TIM1->CCR1 > TIM1->CCR3) {
+			// A leg that is clamped to the high rail does not switch either.
+			const uint32_t ccr1 = TIM1->CCR1 > TIM1->ARR ? 0 : TIM1->CCR1;
+			const uint32_t ccr2 = TIM1->CCR2 > TIM1->ARR ? 0 : TIM1->CCR2;
+			const uint32_t ccr3 = TIM1->CCR3 > TIM1->ARR ? 0 : TIM1->CCR3;
+
+			if (ccr1 > ccr2 && ccr1 > ccr3) {
 				ADC_curr_norm_value[0] = -(ADC_curr_norm_value[1] + ADC_curr_norm_value[2]);
-			} else if (TIM1->CCR2 > TIM1->CCR1 && TIM1->CCR2 > TIM1->CCR3) {
+			} else if (ccr2 > ccr1 && ccr2 > ccr3) {
 				ADC_curr_norm_value[1] = -(ADC_curr_norm_value[0] + ADC_curr_norm_value[2]);
-			} else if (TIM1->CCR3 > TIM1->CCR1 && TIM1->CCR3 > TIM1->CCR2) {
+			} else if (ccr3 > ccr1 && ccr3 > ccr2) {
 				ADC_curr_norm_value[2] = -(ADC_curr_norm_value[0] + ADC_curr_norm_value[1]);
 			}
 		}
@@ -1566,11 +2367,16 @@ void mcpwm_foc_adc_int_handler(void *p, uint32_t flags) {
 	}
 #endif
 
+#if !FOC_FIXED_POINT_CURRENTS
 	float ia = ADC_curr_norm_value[0] * FAC_CURRENT;
 	float ib = ADC_curr_norm_value[1] * FAC_CURRENT;
 //	float ic = -(ia + ib);
+#endif
 
 	if (m_samples.measure_inductance_now) {
+		// Disables the oversampling during the measurement
+		oversample_update();
+
 		if (!is_v7) {
 			return;
 		}
@@ -1622,24 +2428,42 @@ void mcpwm_foc_adc_int_handler(void *p, uint32_t flags) {
 		return;
 	}
 
+	// Apply the scheduled switching frequency. The new timer top and the
+	// duty cycles calculated below are loaded at the same update event.
+	if (TIM1->ARR != m_f_sw_top) {
+		const uint32_t top = m_f_sw_top;
+		TIMER_UPDATE_SAMP_TOP(MCPWM_FOC_CURRENT_SAMP_OFFSET, top);
+		m_f_sw_now = (float)SYSTEM_CORE_CLOCK / (float)top;
+	}
+
 #ifdef HW_HAS_PHASE_SHUNTS
 	float dt;
 	if (m_conf->foc_sample_v0_v7) {
-		dt = 1.0 / m_conf->foc_f_sw;
+		dt = 1.0 / m_f_sw_now;
 	} else {
-		dt = 1.0 / (m_conf->foc_f_sw / 2.0);
+		dt = 1.0 / (m_f_sw_now / 2.0);
 	}
 #else
-	const float dt = 1.0 / (m_conf->foc_f_sw / 2.0);
+	const float dt = 1.0 / (m_f_sw_now / 2.0);
 #endif
 
 	UTILS_LP_FAST(m_motor_state.v_bus, GET_INPUT_VOLTAGE(), 0.1);
 
 	float enc_ang = 0;
 	if (encoder_is_configured()) {
+		encoder_sincos_isr();
 		enc_ang = encoder_read_deg();
-		float phase_tmp = enc_ang;
-		if (m_conf->foc_encoder_inverted) {
+
+		if (m_encoder_nl_cal.active) {
+			encoder_nl_cal_update(enc_ang, dt);
+		}
+
+		if (m_conf->foc_encoder_nl_comp) {
+			enc_ang = encoder_nl_correct(enc_ang);
+		}
+
+		float phase_tmp = enc_ang;
+		if (m_conf->foc_encoder_inverted) {
 			phase_tmp = 360.0 - phase_tmp;
 		}
 		phase_tmp *= m_conf->foc_encoder_ratio;
@@ -1651,16 +2475,46 @@ void mcpwm_foc_adc_int_handler(void *p, uint32_t flags) {
 	static float phase_before = 0.0;
 	const float phase_diff = utils_angle_difference_rad(m_motor_state.phase, phase_before);
 	phase_before = m_motor_state.phase;
+	const float x1_before = m_observer_x1;
+	const float x2_before = m_observer_x2;
 
 	if (m_state == MC_STATE_RUNNING) {
+#if FOC_FIXED_POINT_CURRENTS
+		int16_t i_alpha_fixed, i_beta_fixed;
+		utils_fixed_clarke(ADC_curr_norm_value[0], ADC_curr_norm_value[1],
+				&i_alpha_fixed, &i_beta_fixed);
+		m_motor_state.i_alpha_fixed = i_alpha_fixed;
+		m_motor_state.i_beta_fixed = i_beta_fixed;
+		m_motor_state.i_alpha = (float)i_alpha_fixed *
+				(FAC_CURRENT / (float)(1 << UTILS_FIXED_CLARKE_FRAC));
+		m_motor_state.i_beta = (float)i_beta_fixed *
+				(FAC_CURRENT / (float)(1 << UTILS_FIXED_CLARKE_FRAC));
+#else
 		// Clarke transform assuming balanced currents
 		m_motor_state.i_alpha = ia;
 		m_motor_state.i_beta = ONE_BY_SQRT3 * ia + TWO_BY_SQRT3 * ib;
+#endif
 
 		// Full Clarke transform in case there are current offsets
 //		m_motor_state.i_alpha = (2.0 / 3.0) * ia - (1.0 / 3.0) * ib - (1.0 / 3.0) * ic;
 //		m_motor_state.i_beta = ONE_BY_SQRT3 * ib - ONE_BY_SQRT3 * ic;
 
+		// HFI position estimation. This also removes the injected ripple from the currents.
+		if (m_conf->foc_sensor_mode == FOC_SENSOR_MODE_HFI) {
+			hfi_update(&m_motor_state, dt);
+#if FOC_FIXED_POINT_CURRENTS
+			m_motor_state.i_alpha_fixed = (int16_t)(m_motor_state.i_alpha *
+					((float)(1 << UTILS_FIXED_CLARKE_FRAC) / FAC_CURRENT));
+			m_motor_state.i_beta_fixed = (int16_t)(m_motor_state.i_beta *
+					((float)(1 << UTILS_FIXED_CLARKE_FRAC) / FAC_CURRENT));
+#endif
+		}
+
+		// Current step test
+		if (m_cc_step_now && m_cc_step_ind == 0) {
+			m_iq_set = m_cc_step_current;
+		}
+
 		const float duty_abs = fabsf(m_motor_state.duty_now);
 		float id_set_tmp = m_id_set;
 		float iq_set_tmp = m_iq_set;
@@ -1784,6 +2638,24 @@ void mcpwm_foc_adc_int_handler(void *p, uint32_t flags) {
 				}
 			}
 			break;
+		case FOC_SENSOR_MODE_HFI:
+			m_motor_state.phase = correct_hfi(m_phase_now_observer, m_pll_speed);
+
+			if (!m_phase_override) {
+				id_set_tmp = 0.0;
+
+				// Hold the torque while the angle converges and the polarity is detected.
+				if (m_hfi.active && m_hfi.state != HFI_STATE_RUN) {
+					iq_set_tmp = 0.0;
+
+					if (m_hfi.state == HFI_STATE_POL_POS) {
+						id_set_tmp = MCPWM_FOC_HFI_POL_CURRENT * m_conf->l_current_max;
+					} else if (m_hfi.state == HFI_STATE_POL_NEG) {
+						id_set_tmp = -MCPWM_FOC_HFI_POL_CURRENT * m_conf->l_current_max;
+					}
+				}
+			}
+			break;
 		}
 
 		// Force the phase to 0 in handbrake mode so that the current simply locks the rotor.
@@ -1800,6 +2672,26 @@ void mcpwm_foc_adc_int_handler(void *p, uint32_t flags) {
 			m_motor_state.phase = m_phase_now_override;
 		}
 
+		// Field weakening. Drive negative D axis current when the voltage vector gets
+		// close to saturation, so that the current controller keeps control above
+		// base speed.
+		if (m_conf->foc_fw_current_max > 0.0 && !m_phase_override &&
+				m_control_mode != CONTROL_MODE_HANDBRAKE &&
+				m_control_mode != CONTROL_MODE_OPENLOOP) {
+			const float duty_start = m_conf->foc_fw_duty_start * m_conf->l_max_duty;
+			float fw_err = (duty_abs - duty_start) / fmaxf(m_conf->l_max_duty - duty_start, 0.01);
+			utils_truncate_number(&fw_err, -1.0, 1.0);
+
+			float fw_current = m_fw_current_now;
+			fw_current += fw_err * dt * m_conf->foc_fw_current_max / fmaxf(m_conf->foc_fw_ramp_time, 0.001);
+			utils_truncate_number(&fw_current, 0.0, m_conf->foc_fw_current_max);
+			m_fw_current_now = fw_current;
+
+			id_set_tmp -= fw_current;
+		} else {
+			m_fw_current_now = 0.0;
+		}
+
 		// Apply current limits
 		// TODO: Consider D axis current for the input current as well.
 		const float mod_q = m_motor_state.mod_q;
@@ -1822,7 +2714,20 @@ void mcpwm_foc_adc_int_handler(void *p, uint32_t flags) {
 		m_motor_state.iq_target = iq_set_tmp;
 
 		control_current(&m_motor_state, dt);
+
+		if (m_conf->foc_param_est != FOC_PARAM_EST_DISABLED) {
+			param_est_update(&m_motor_state, m_pll_speed, dt);
+		}
+
+		if (m_cc_step_now) {
+			m_step_samples[m_cc_step_ind++] = m_motor_state.iq;
+			if (m_cc_step_ind >= MCPWM_FOC_STEP_SAMPLES) {
+				m_cc_step_now = false;
+			}
+		}
 	} else {
+		m_fw_current_now = 0.0;
+
 		// Track back emf
 #ifdef HW_HAS_3_SHUNTS
 		float Va = ADC_VOLTS(ADC_IND_SENS1) * ((VIN_R1 + VIN_R2) / VIN_R2);
@@ -1885,16 +2790,46 @@ void mcpwm_foc_adc_int_handler(void *p, uint32_t flags) {
 		case FOC_SENSOR_MODE_SENSORLESS:
 			m_motor_state.phase = m_phase_now_observer;
 			break;
+		case FOC_SENSOR_MODE_HFI:
+			// Detect the angle and polarity again on the next start
+			m_motor_state.phase = m_phase_now_observer;
+			m_hfi.active = false;
+			m_hfi.state = HFI_STATE_LOCK;
+			m_hfi.v_inj = 0.0;
+			break;
 		}
 	}
 
+	// Schedule the oversampling after control_current, so that it is based
+	// on the duty cycles that will be active during the next zero vector.
+	oversample_update();
+
 	// Calculate duty cycle
 	m_motor_state.duty_now = SIGN(m_motor_state.vq) *
 			sqrtf(m_motor_state.mod_d * m_motor_state.mod_d +
-					m_motor_state.mod_q * m_motor_state.mod_q) / SQRT3_BY_2;
+					m_motor_state.mod_q * m_motor_state.mod_q) /
+			(m_conf->foc_overmod ? MCPWM_FOC_SIX_STEP_MOD : SQRT3_BY_2);
 
 	// Run PLL for speed estimation
-	pll_run(m_motor_state.phase, dt, &m_pll_phase, &m_pll_speed);
+	if (m_conf->foc_pll_adaptive) {
+		// The rotation of the observer flux state is fed forward so that the
+		// PLL does not lag during acceleration. It carries its own noise, so at
+		// constant speed the estimate is noisier than with the fixed gains. Only
+		// the sensorless mode follows the observer at all speeds, so the other
+		// modes run without feedforward.
+		float speed_ff = 0.0;
+		if (m_conf->foc_sensor_mode == FOC_SENSOR_MODE_SENSORLESS) {
+			speed_ff = foc_observer_speed(x1_before, x2_before, m_observer_x1, m_observer_x2,
+					0.1 * m_conf->foc_motor_flux_linkage, dt);
+		}
+
+		foc_pll_run_adaptive(m_motor_state.phase, speed_ff, dt, m_conf->foc_pll_bw_min,
+				m_conf->foc_pll_bw_max, m_conf->foc_pll_bw_erpm, &m_pll_phase,
+				&m_pll_speed_corr, &m_pll_speed_ff_filter, &m_pll_speed);
+	} else {
+		foc_pll_run(m_motor_state.phase, dt, m_conf->foc_pll_kp, m_conf->foc_pll_ki,
+				&m_pll_phase, &m_pll_speed);
+	}
 
 	// Update tachometer (resolution = 60 deg as for BLDC)
 	float ph_tmp = m_motor_state.phase;
@@ -1936,6 +2871,10 @@ void mcpwm_foc_adc_int_handler(void *p, uint32_t flags) {
 	// Run position control
 	if (m_state == MC_STATE_RUNNING) {
 		run_pid_control_pos(m_pos_pid_now, m_pos_pid_set, dt);
+
+		if (m_cogging_cal.active) {
+			cogging_cal_update(m_motor_state.phase, m_iq_set);
+		}
 	}
 
 	// MCIF handler
@@ -2033,10 +2972,18 @@ static THD_FUNCTION(timer_thread, arg) {
 		}
 
 		// Update and the observer gain.
-		m_gamma_now = utils_map(fabsf(m_motor_state.duty_now), 0.0, 1.0,
-				m_conf->foc_observer_gain * m_conf->foc_observer_gain_slow, m_conf->foc_observer_gain);
+		if (m_conf->foc_observer_sched) {
+			m_gamma_now = m_conf->foc_observer_gain * observer_gain_sched(
+					fabsf(mcpwm_foc_get_rpm()),
+					m_motor_state.i_abs_filter / m_conf->l_current_max);
+		} else {
+			m_gamma_now = utils_map(fabsf(m_motor_state.duty_now), 0.0, 1.0,
+					m_conf->foc_observer_gain * m_conf->foc_observer_gain_slow, m_conf->foc_observer_gain);
+		}
 
 		run_pid_control_speed(dt);
+		offset_track_hist(dt);
+		f_sw_sched_update(dt);
 		chThdSleepMilliseconds(1);
 	}
 
@@ -2069,83 +3016,36 @@ static void do_dc_cal(void) {
 	m_curr2_offset = m_curr2_sum / m_curr_samples;
 #endif
 	DCCAL_OFF();
+	offset_track_reset();
 	m_dccal_done = true;
 }
 
-// See http://cas.ensmp.fr/~praly/Telechargement/Journaux/2010-IEEE_TPEL-Lee-Hong-Nam-Ortega-Praly-Astolfi.pdf
 void observer_update(float v_alpha, float v_beta, float i_alpha, float i_beta,
 		float dt, volatile float *x1, volatile float *x2, volatile float *phase) {
 
-	const float L = (3.0 / 2.0) * m_conf->foc_motor_l;
-	const float lambda = m_conf->foc_motor_flux_linkage;
+	float L = (3.0 / 2.0) * m_conf->foc_motor_l;
+	float lambda = m_conf->foc_motor_flux_linkage;
 	float R = (3.0 / 2.0) * m_conf->foc_motor_r;
 
-	// Saturation compensation
-	const float sign = (m_motor_state.iq * m_motor_state.vq) >= 0.0 ? 1.0 : -1.0;
-	R -= R * sign * m_conf->foc_sat_comp * (m_motor_state.i_abs_filter / m_conf->l_current_max);
-
-	// Temperature compensation
-	const float t = mc_interface_temp_motor_filtered();
-	if (m_conf->foc_temp_comp && t > -5.0) {
-		R += R * 0.00386 * (t - m_conf->foc_temp_comp_base_temp);
-	}
-
-	const float L_ia = L * i_alpha;
-	const float L_ib = L * i_beta;
-	const float R_ia = R * i_alpha;
-	const float R_ib = R * i_beta;
-	const float lambda_2 = SQ(lambda);
-	const float gamma_half = m_gamma_now * 0.5;
-
-	// Original
-//	float err = lambda_2 - (SQ(*x1 - L_ia) + SQ(*x2 - L_ib));
-//	float x1_dot = -R_ia + v_alpha + gamma_half * (*x1 - L_ia) * err;
-//	float x2_dot = -R_ib + v_beta + gamma_half * (*x2 - L_ib) * err;
-//	*x1 += x1_dot * dt;
-//	*x2 += x2_dot * dt;
-
-	// Iterative with some trial and error
-	const int iterations = 6;
-	const float dt_iteration = dt / (float)iterations;
-	for (int i = 0;i < iterations;i++) {
-		float err = lambda_2 - (SQ(*x1 - L_ia) + SQ(*x2 - L_ib));
-		float gamma_tmp = gamma_half;
-		if (utils_truncate_number_abs(&err, lambda_2 * 0.2)) {
-			gamma_tmp *= 10.0;
-		}
-		float x1_dot = -R_ia + v_alpha + gamma_tmp * (*x1 - L_ia) * err;
-		float x2_dot = -R_ib + v_beta + gamma_tmp * (*x2 - L_ib) * err;
-
-		*x1 += x1_dot * dt_iteration;
-		*x2 += x2_dot * dt_iteration;
-	}
-
-	// Same as above, but without iterations.
-//	float err = lambda_2 - (SQ(*x1 - L_ia) + SQ(*x2 - L_ib));
-//	float gamma_tmp = gamma_half;
-//	if (utils_truncate_number_abs(&err, lambda_2 * 0.2)) {
-//		gamma_tmp *= 10.0;
-//	}
-//	float x1_dot = -R_ia + v_alpha + gamma_tmp * (*x1 - L_ia) * err;
-//	float x2_dot = -R_ib + v_beta + gamma_tmp * (*x2 - L_ib) * err;
-//	*x1 += x1_dot * dt;
-//	*x2 += x2_dot * dt;
-
-	UTILS_NAN_ZERO(*x1);
-	UTILS_NAN_ZERO(*x2);
-
-	*phase = utils_fast_atan2(*x2 - L_ib, *x1 - L_ia);
-}
-
-static void pll_run(float phase, float dt, volatile float *phase_var,
-		volatile float *speed_var) {
-	UTILS_NAN_ZERO(*phase_var);
-	float delta_theta = phase - *phase_var;
-	utils_norm_angle_rad(&delta_theta);
-	UTILS_NAN_ZERO(*speed_var);
-	*phase_var += (*speed_var + m_conf->foc_pll_kp * delta_theta) * dt;
-	utils_norm_angle_rad((float*)phase_var);
-	*speed_var += m_conf->foc_pll_ki * delta_theta * dt;
+	if (m_conf->foc_param_est == FOC_PARAM_EST_APPLY) {
+		// The estimates already include the temperature and saturation effects
+		R *= m_param_est.theta[0];
+		L *= m_param_est.theta[1];
+		lambda *= m_param_est.theta[2];
+	} else {
+		// Saturation compensation
+		const float sign = (m_motor_state.iq * m_motor_state.vq) >= 0.0 ? 1.0 : -1.0;
+		R -= R * sign * m_conf->foc_sat_comp * (m_motor_state.i_abs_filter / m_conf->l_current_max);
+
+		// Temperature compensation
+		const float t = mc_interface_temp_motor_filtered();
+		if (m_conf->foc_temp_comp && t > -5.0) {
+			R += R * 0.00386 * (t - m_conf->foc_temp_comp_base_temp);
+		}
+	}
+
+	foc_observer_update(v_alpha, v_beta, i_alpha, i_beta, dt, R, L, lambda,
+			m_gamma_now, m_pll_speed, x1, x2, phase);
 }
 
 /**
@@ -2191,22 +3091,85 @@ static void control_current(volatile motor_state_t *state_m, float dt) {
 	float max_duty = fabsf(state_m->max_duty);
 	utils_truncate_number(&max_duty, 0.0, m_conf->l_max_duty);
 
+	// Largest modulation vector magnitude at duty cycle 1.0
+	const float mod_lim = m_conf->foc_overmod ? MCPWM_FOC_SIX_STEP_MOD : SQRT3_BY_2;
+
+#if FOC_FIXED_POINT_CURRENTS
+	// The d and q currents and the current errors stay in fixed point, and the
+	// scale to amperes is folded into the PI gains. |id| and |iq| are at most 2^30
+	// for 12 bit ADC values, so with the targets truncated to 2^29, which is 4096
+	// counts and thus beyond the measurable current, the errors cannot overflow.
+	const float i_scale = FAC_CURRENT / (float)(1 << UTILS_FIXED_PARK_FRAC);
+	int32_t id_fixed, iq_fixed;
+	utils_fixed_park(state_m->i_alpha_fixed, state_m->i_beta_fixed,
+			utils_float_to_q15(s), utils_float_to_q15(c), &id_fixed, &iq_fixed);
+
+	float id_target_fixed = state_m->id_target * (1.0 / i_scale);
+	float iq_target_fixed = state_m->iq_target * (1.0 / i_scale);
+	utils_truncate_number_abs(&id_target_fixed, (float)(1 << 29));
+	utils_truncate_number_abs(&iq_target_fixed, (float)(1 << 29));
+
+	const float Ierr_d = (float)((int32_t)id_target_fixed - id_fixed);
+	const float Ierr_q = (float)((int32_t)iq_target_fixed - iq_fixed);
+	const float kp = m_conf->foc_current_kp * i_scale;
+	const float ki = m_conf->foc_current_ki * dt * i_scale;
+
+	state_m->id = (float)id_fixed * i_scale;
+	state_m->iq = (float)iq_fixed * i_scale;
+#else
 	state_m->id = c * state_m->i_alpha + s * state_m->i_beta;
 	state_m->iq = c * state_m->i_beta  - s * state_m->i_alpha;
+
+	const float Ierr_d = state_m->id_target - state_m->id;
+	const float Ierr_q = state_m->iq_target - state_m->iq;
+	const float kp = m_conf->foc_current_kp;
+	const float ki = m_conf->foc_current_ki * dt;
+#endif
 	UTILS_LP_FAST(state_m->id_filter, state_m->id, MCPWM_FOC_I_FILTER_CONST);
 	UTILS_LP_FAST(state_m->iq_filter, state_m->iq, MCPWM_FOC_I_FILTER_CONST);
 
-	float Ierr_d = state_m->id_target - state_m->id;
-	float Ierr_q = state_m->iq_target - state_m->iq;
+	state_m->vd = state_m->vd_int + Ierr_d * kp;
+	state_m->vq = state_m->vq_int + Ierr_q * kp;
+	state_m->vd_int += Ierr_d * ki;
+	state_m->vq_int += Ierr_q * ki;
+
+	// Feedforward of the speed dependent cross coupling and back emf terms, so that
+	// the PI controllers only have to handle R and L. The cross coupling uses the
+	// current targets, as the measured currents lag too much at high speed. The same
+	// scaling of L as in the observer is used.
+	const bool decoupling = m_conf->foc_cc_decoupling != FOC_CC_DECOUPLING_DISABLED &&
+			m_control_mode != CONTROL_MODE_HANDBRAKE &&
+			m_control_mode != CONTROL_MODE_OPENLOOP;
+
+	if (decoupling) {
+		const float speed = m_pll_speed;
+		float motor_l = m_conf->foc_motor_l;
+		float lambda = m_conf->foc_motor_flux_linkage;
+
+		if (m_conf->foc_param_est == FOC_PARAM_EST_APPLY) {
+			motor_l *= m_param_est.theta[1];
+			lambda *= m_param_est.theta[2];
+		}
+
+		if (m_conf->foc_cc_decoupling == FOC_CC_DECOUPLING_CROSS ||
+				m_conf->foc_cc_decoupling == FOC_CC_DECOUPLING_CROSS_BEMF) {
+			const float wl = speed * (3.0 / 2.0) * motor_l;
+			state_m->vd -= wl * state_m->iq_target;
+			state_m->vq += wl * state_m->id_target;
+		}
+
+		if (m_conf->foc_cc_decoupling == FOC_CC_DECOUPLING_BEMF ||
+				m_conf->foc_cc_decoupling == FOC_CC_DECOUPLING_CROSS_BEMF) {
+			state_m->vq += speed * lambda;
+		}
+	}
 
-	state_m->vd = state_m->vd_int + Ierr_d * m_conf->foc_current_kp;
-	state_m->vq = state_m->vq_int + Ierr_q * m_conf->foc_current_kp;
-	state_m->vd_int += Ierr_d * (m_conf->foc_current_ki * dt);
-	state_m->vq_int += Ierr_q * (m_conf->foc_current_ki * dt);
+	// High frequency injection for the HFI sensor mode, outside of the PI controllers
+	state_m->vd += m_hfi.v_inj;
 
 	// Saturation
 	utils_saturate_vector_2d((float*)&state_m->vd, (float*)&state_m->vq,
-			(2.0 / 3.0) * max_duty * SQRT3_BY_2 * state_m->v_bus);
+			(2.0 / 3.0) * max_duty * mod_lim * state_m->v_bus);
 
 	state_m->mod_d = state_m->vd / ((2.0 / 3.0) * state_m->v_bus);
 	state_m->mod_q = state_m->vq / ((2.0 / 3.0) * state_m->v_bus);
@@ -2214,16 +3177,37 @@ static void control_current(volatile motor_state_t *state_m, float dt) {
 	// Windup protection
 //	utils_saturate_vector_2d((float*)&state_m->vd_int, (float*)&state_m->vq_int,
 //			(2.0 / 3.0) * max_duty * SQRT3_BY_2 * state_m->v_bus);
-	utils_truncate_number_abs((float*)&state_m->vd_int, (2.0 / 3.0) * max_duty * SQRT3_BY_2 * state_m->v_bus);
-	utils_truncate_number_abs((float*)&state_m->vq_int, (2.0 / 3.0) * max_duty * SQRT3_BY_2 * state_m->v_bus);
+	utils_truncate_number_abs((float*)&state_m->vd_int, (2.0 / 3.0) * max_duty * mod_lim * state_m->v_bus);
+	utils_truncate_number_abs((float*)&state_m->vq_int, (2.0 / 3.0) * max_duty * mod_lim * state_m->v_bus);
 
 	// TODO: Have a look at this?
 	state_m->i_bus = state_m->mod_d * state_m->id + state_m->mod_q * state_m->iq;
 	state_m->i_abs = sqrtf(SQ(state_m->id) + SQ(state_m->iq));
 	state_m->i_abs_filter = sqrtf(SQ(state_m->id_filter) + SQ(state_m->iq_filter));
 
-	float mod_alpha = c * state_m->mod_d - s * state_m->mod_q;
-	float mod_beta  = c * state_m->mod_q + s * state_m->mod_d;
+	// The output is applied with a delay of about one control period, or one and a half
+	// when sampling in both V0 and V7. With decoupling the rotation during that time
+	// is compensated, otherwise the feedforward terms end up at the wrong angle. The
+	// encoder latency compensation relies on this as well, as it only extrapolates
+	// the encoder angle to the time the currents were sampled.
+	float c_out = c;
+	float s_out = s;
+	if (decoupling || (m_conf->foc_encoder_latency_comp &&
+			m_conf->foc_sensor_mode == FOC_SENSOR_MODE_ENCODER)) {
+#ifdef HW_HAS_PHASE_SHUNTS
+		const float delay = m_conf->foc_sample_v0_v7 ? 1.5 * dt : dt;
+#else
+		const float delay = dt;
+#endif
+		utils_fast_sincos_better(state_m->phase + m_pll_speed * delay, &s_out, &c_out);
+	}
+
+	float mod_alpha = c_out * state_m->mod_d - s_out * state_m->mod_q;
+	float mod_beta  = c_out * state_m->mod_q + s_out * state_m->mod_d;
+
+	if (m_conf->foc_overmod) {
+		overmodulation(&mod_alpha, &mod_beta, max_duty);
+	}
 
 	// Deadtime compensation
 	const float i_alpha_filter = c * state_m->id_target - s * state_m->iq_target;
@@ -2233,7 +3217,7 @@ static void control_current(volatile motor_state_t *state_m, float dt) {
 	const float ic_filter = -0.5 * i_alpha_filter - SQRT3_BY_2 * i_beta_filter;
 	const float mod_alpha_filter_sgn = (2.0 / 3.0) * SIGN(ia_filter) - (1.0 / 3.0) * SIGN(ib_filter) - (1.0 / 3.0) * SIGN(ic_filter);
 	const float mod_beta_filter_sgn = ONE_BY_SQRT3 * SIGN(ib_filter) - ONE_BY_SQRT3 * SIGN(ic_filter);
-	const float mod_comp_fact = m_conf->foc_dt_us * 1e-6 * m_conf->foc_f_sw;
+	const float mod_comp_fact = m_conf->foc_dt_us * 1e-6 * m_f_sw_now;
 	const float mod_alpha_comp = mod_alpha_filter_sgn * mod_comp_fact;
 	const float mod_beta_comp = mod_beta_filter_sgn * mod_comp_fact;
 
@@ -2252,7 +3236,83 @@ static void control_current(volatile motor_state_t *state_m, float dt) {
 	}
 }
 
+/**
+ * Map a modulation vector beyond the linear range onto the SVM hexagon so that
+ * the fundamental of the output follows the magnitude of the input. In region I
+ * the vector follows a circle that is clipped by the hexagon, and in region II
+ * it is held at the hexagon corners for a growing angle until the output
+ * becomes six-step at a magnitude of 3/pi.
+ *
+ * @param mod_alpha
+ * Alpha component of the modulation vector, updated in place.
+ *
+ * @param mod_beta
+ * Beta component of the modulation vector, updated in place.
+ *
+ * @param mod_max
+ * Scale of the hexagon, which is the maximum duty cycle. The zero vectors get
+ * at least (1 - mod_max) of the period so that the currents can be sampled.
+ */
+static void overmodulation(float *mod_alpha, float *mod_beta, float mod_max) {
+	// Parameter for evenly spaced magnitudes from sqrt(3)/2 to 3/pi. 0 to 1 is the
+	// circle radius in region I, 1 to 2 is the corner hold angle in region II.
+	static const float om_table[17] = {
+			0.0000, 0.0492, 0.1080, 0.1767, 0.2576, 0.3554, 0.4805, 0.6647,
+			1.1187, 1.2474, 1.3412, 1.4248, 1.5050, 1.5865, 1.6742, 1.7785, 2.0000
+	};
+
+	if (mod_max < 0.001) {
+		return;
+	}
+
+	const float alpha = *mod_alpha / mod_max;
+	const float beta = *mod_beta / mod_max;
+	const float mag = sqrtf(SQ(alpha) + SQ(beta));
+
+	if (mag <= SQRT3_BY_2) {
+		return;
+	}
+
+	float p = 2.0;
+	if (mag < MCPWM_FOC_SIX_STEP_MOD) {
+		float pos = (mag - SQRT3_BY_2) / (MCPWM_FOC_SIX_STEP_MOD - SQRT3_BY_2) * 16.0;
+		int ind = (int)pos;
+		p = om_table[ind] + (om_table[ind + 1] - om_table[ind]) * (pos - (float)ind);
+	}
+
+	// Distance to the hexagon edge. The hexagon is 1.0 at the corners.
+	const float hex = fmaxf(fabsf(alpha) + ONE_BY_SQRT3 * fabsf(beta), TWO_BY_SQRT3 * fabsf(beta));
+	float scale = 1.0 / hex;
+
+	if (p <= 1.0) {
+		const float radius = SQRT3_BY_2 + p * (1.0 - SQRT3_BY_2);
+		scale = fminf(scale, radius / mag);
+	} else {
+		const float hold_angle = (p - 1.0) * (M_PI / 6.0);
+		const float angle = utils_fast_atan2(beta, alpha);
+		int corner = (int)floorf(angle / (M_PI / 3.0) + 0.5);
+
+		if (fabsf(angle - (float)corner * (M_PI / 3.0)) < hold_angle) {
+			static const float corner_cos[6] = {1.0, 0.5, -0.5, -1.0, -0.5, 0.5};
+			static const float corner_sin[6] = {0.0, SQRT3_BY_2, SQRT3_BY_2, 0.0, -SQRT3_BY_2, -SQRT3_BY_2};
+
+			if (corner < 0) {
+				corner += 6;
+			}
+			corner %= 6;
+
+			*mod_alpha = corner_cos[corner] * mod_max;
+			*mod_beta = corner_sin[corner] * mod_max;
+			return;
+		}
+	}
+
+	*mod_alpha *= scale;
+	*mod_beta *= scale;
+}
+
 // Magnitude must not be larger than sqrt(3)/2, or 0.866
+// The modulation mode is taken from the configuration.
 static void svm(float alpha, float beta, uint32_t PWMHalfPeriod,
 		uint32_t* tAout, uint32_t* tBout, uint32_t* tCout, uint32_t *svm_sector) {
 	uint32_t sector;
@@ -2381,6 +3441,50 @@ static void svm(float alpha, float beta, uint32_t PWMHalfPeriod,
 	}
 	}
 
+	// Discontinuous modulation. The zero vector time is split evenly between V0
+	// and V7 above. Moving all of it to one of them clamps one leg to a rail for
+	// the whole period, so that leg does not switch at all.
+	mc_foc_modulation modulation = m_conf->foc_modulation;
+#ifndef HW_HAS_PHASE_SHUNTS
+	// Low side shunts can only be sampled while the low side is on, so only
+	// clamping to the low rail keeps all required samples valid.
+	if (modulation != FOC_MODULATION_SVPWM) {
+		modulation = FOC_MODULATION_DPWM_MIN;
+	}
+#endif
+
+	if (modulation != FOC_MODULATION_SVPWM) {
+		// Legs with the lowest and highest duty cycle in each sector
+		static const uint8_t leg_min[6] = {0, 1, 1, 2, 2, 0};
+		static const uint8_t leg_max[6] = {2, 2, 0, 0, 1, 1};
+		uint32_t *legs[3] = {&tA, &tB, &tC};
+		const uint32_t t_min = *legs[leg_min[sector - 1]];
+		const uint32_t t_max = *legs[leg_max[sector - 1]];
+		bool clamp_high = modulation == FOC_MODULATION_DPWM_MAX;
+
+		if (modulation == FOC_MODULATION_DPWM_BIPOLAR) {
+			// Clamp the leg with the highest voltage, which also carries the
+			// highest current when the power factor is high.
+			const uint32_t t_mid = tA + tB + tC - t_min - t_max;
+			clamp_high = (t_min + t_max) > (2 * t_mid);
+		}
+
+		if (clamp_high) {
+			const uint32_t shift = PWMHalfPeriod - t_max;
+			tA += shift;
+			tB += shift;
+			tC += shift;
+
+			// The counter reaches ARR in center-aligned mode, so a compare value
+			// of ARR would still give a one tick low pulse every period.
+			*legs[leg_max[sector - 1]] = PWMHalfPeriod + 1;
+		} else {
+			tA -= t_min;
+			tB -= t_min;
+			tC -= t_min;
+		}
+	}
+
 	*tAout = tA;
 	*tBout = tB;
 	*tCout = tC;
@@ -2409,6 +3513,14 @@ static void run_pid_control_pos(float angle_now, float angle_set, float dt) {
 		}
 	}
 
+	// Relay feedback experiment
+	if (m_relay_now && m_relay_pos) {
+		i_term = 0.0;
+		prev_error = error;
+		run_relay(error, dt);
+		return;
+	}
+
 	p_term = error * m_conf->p_pid_kp;
 	i_term += error * (m_conf->p_pid_ki * dt);
 
@@ -2446,6 +3558,8 @@ static void run_pid_control_pos(float angle_now, float angle_set, float dt) {
 	} else {
 		m_iq_set = output * m_conf->lo_current_max;
 	}
+
+	m_iq_set += cogging_current(m_motor_state.phase);
 }
 
 static void run_pid_control_speed(float dt) {
@@ -2464,6 +3578,14 @@ static void run_pid_control_speed(float dt) {
 	const float rpm = mcpwm_foc_get_rpm();
 	float error = m_speed_pid_set_rpm - rpm;
 
+	// Relay feedback experiment
+	if (m_relay_now && !m_relay_pos) {
+		i_term = 0.0;
+		prev_error = error;
+		run_relay(error, dt);
+		return;
+	}
+
 	// Too low RPM set. Reset state and return.
 	if (fabsf(m_speed_pid_set_rpm) < m_conf->s_pid_min_erpm) {
 		i_term = 0.0;
@@ -2497,7 +3619,257 @@ static void run_pid_control_speed(float dt) {
 		}
 	}
 
-	m_iq_set = output * m_conf->lo_current_max;
+	m_iq_set = output * m_conf->lo_current_max + cogging_current(m_motor_state.phase);
+}
+
+static void run_relay(float error, float dt) {
+	m_relay_time += dt;
+
+	if (error > m_relay_err_max) {
+		m_relay_err_max = error;
+	}
+
+	if (error < m_relay_err_min) {
+		m_relay_err_min = error;
+	}
+
+	if (!m_relay_high && error > m_relay_hyst) {
+		// A full oscillation period ends on every switch to the high output
+		if (m_relay_cycles > MCPWM_FOC_RELAY_SKIP_CYCLES) {
+			m_relay_period_sum += m_relay_time;
+			m_relay_ampl_sum += (m_relay_err_max - m_relay_err_min) / 2.0;
+		}
+
+		m_relay_cycles++;
+		m_relay_time = 0.0;
+		m_relay_err_min = error;
+		m_relay_err_max = error;
+		m_relay_high = true;
+
+		if (m_relay_cycles > (MCPWM_FOC_RELAY_SKIP_CYCLES + MCPWM_FOC_RELAY_CYCLES)) {
+			m_relay_now = false;
+		}
+	} else if (m_relay_high && error < -m_relay_hyst) {
+		m_relay_high = false;
+	}
+
+	m_iq_set = m_relay_bias + (m_relay_high ? m_relay_current : -m_relay_current);
+}
+
+static void set_pid_setpoint(bool pos, float setpoint) {
+	if (pos) {
+		m_pos_pid_set = setpoint;
+		m_control_mode = CONTROL_MODE_POS;
+	} else {
+		m_speed_pid_set_rpm = setpoint;
+		m_control_mode = CONTROL_MODE_SPEED;
+	}
+
+	m_state = MC_STATE_RUNNING;
+}
+
+static bool step_response(const float *samples, int samples_num, float dt,
+		float min_step, float *rise_time, float *settling_time, float *overshoot) {
+	const float start = samples[0];
+
+	float final = 0.0;
+	for (int i = (3 * samples_num) / 4;i < samples_num;i++) {
+		final += samples[i];
+	}
+	final /= (float)(samples_num - (3 * samples_num) / 4);
+
+	const float step = final - start;
+	if (step < min_step) {
+		return false;
+	}
+
+	float max = start;
+	int ind_10 = -1;
+	int ind_90 = -1;
+	int ind_settle = 0;
+	for (int i = 0;i < samples_num;i++) {
+		const float s = samples[i];
+
+		if (s > max) {
+			max = s;
+		}
+
+		if (ind_10 < 0 && s >= (start + 0.1 * step)) {
+			ind_10 = i;
+		}
+
+		if (ind_90 < 0 && s >= (start + 0.9 * step)) {
+			ind_90 = i;
+		}
+
+		if (fabsf(s - final) > (0.05 * step)) {
+			ind_settle = i + 1;
+		}
+	}
+
+	*rise_time = (float)(ind_90 - ind_10) * dt;
+	*settling_time = (float)ind_settle * dt;
+	*overshoot = (max - final) / step * 100.0;
+
+	return ind_settle < ((3 * samples_num) / 4);
+}
+
+static void param_est_reset(void) {
+	memset(&m_param_est, 0, sizeof(m_param_est));
+
+	for (int i = 0;i < 3;i++) {
+		m_param_est.theta[i] = 1.0;
+		m_param_est.p[i][i] = 1.0;
+	}
+}
+
+/**
+ * Estimate R, L and the flux linkage with recursive least squares on the
+ * d and q axis voltage equations
+ *
+ * vd = R * id + L * (did/dt - w * iq)
+ * vq = R * iq + L * (diq/dt + w * id) + w * lambda
+ *
+ * integrated over MCPWM_FOC_PARAM_EST_DECIMATION control periods. The voltages
+ * are the ones commanded in the previous period, as that is when they are
+ * applied. The parameters are normalized by the configured values so that the
+ * covariance stays well conditioned, and the same 3/2 scaling as in the
+ * observer is used.
+ *
+ * @param state_m
+ * The motor state after running the current controller.
+ *
+ * @param speed
+ * The electrical speed in rad/s.
+ *
+ * @param dt
+ * The control period in seconds.
+ */
+static void param_est_update(volatile motor_state_t *state_m, float speed, float dt) {
+	const float vd_last = m_param_est.vd_last;
+	const float vq_last = m_param_est.vq_last;
+	m_param_est.vd_last = state_m->vd;
+	m_param_est.vq_last = state_m->vq;
+
+	// Only estimate in closed loop and with enough current for the dead time
+	// voltage errors to be small compared to the resistive voltage drop.
+	if (m_phase_override ||
+			m_control_mode == CONTROL_MODE_HANDBRAKE ||
+			m_control_mode == CONTROL_MODE_OPENLOOP ||
+			m_conf->foc_motor_r <= 0.0 || m_conf->foc_motor_l <= 0.0 ||
+			m_conf->foc_motor_flux_linkage <= 0.0 ||
+			state_m->i_abs_filter < (MCPWM_FOC_PARAM_EST_MIN_CURRENT * m_conf->l_current_max)) {
+		m_param_est.id_start = state_m->id;
+		m_param_est.iq_start = state_m->iq;
+		m_param_est.vd_sum = 0.0;
+		m_param_est.vq_sum = 0.0;
+		m_param_est.id_sum = 0.0;
+		m_param_est.iq_sum = 0.0;
+		m_param_est.w_id_sum = 0.0;
+		m_param_est.w_iq_sum = 0.0;
+		m_param_est.w_sum = 0.0;
+		m_param_est.samples = 0;
+		return;
+	}
+
+	m_param_est.vd_sum += vd_last;
+	m_param_est.vq_sum += vq_last;
+	m_param_est.id_sum += state_m->id;
+	m_param_est.iq_sum += state_m->iq;
+	m_param_est.w_id_sum += speed * state_m->id;
+	m_param_est.w_iq_sum += speed * state_m->iq;
+	m_param_est.w_sum += speed;
+	m_param_est.samples++;
+
+	if (m_param_est.samples < MCPWM_FOC_PARAM_EST_DECIMATION) {
+		return;
+	}
+
+	const float n_inv = 1.0 / (float)m_param_est.samples;
+	const float time_inv = n_inv / dt;
+	const float did_dt = (state_m->id - m_param_est.id_start) * time_inv;
+	const float diq_dt = (state_m->iq - m_param_est.iq_start) * time_inv;
+
+	const float r_nom = (3.0 / 2.0) * m_conf->foc_motor_r;
+	const float l_nom = (3.0 / 2.0) * m_conf->foc_motor_l;
+	const float lambda_nom = m_conf->foc_motor_flux_linkage;
+
+	float phi[3];
+	phi[0] = m_param_est.id_sum * n_inv * r_nom;
+	phi[1] = (did_dt - m_param_est.w_iq_sum * n_inv) * l_nom;
+	phi[2] = 0.0;
+	param_est_rls(m_param_est.vd_sum * n_inv, phi);
+
+	phi[0] = m_param_est.iq_sum * n_inv * r_nom;
+	phi[1] = (diq_dt + m_param_est.w_id_sum * n_inv) * l_nom;
+	phi[2] = m_param_est.w_sum * n_inv * lambda_nom;
+	param_est_rls(m_param_est.vq_sum * n_inv, phi);
+
+	for (int i = 0;i < 3;i++) {
+		UTILS_NAN_ZERO(m_param_est.theta[i]);
+		utils_truncate_number(&m_param_est.theta[i],
+				MCPWM_FOC_PARAM_EST_MIN, MCPWM_FOC_PARAM_EST_MAX);
+	}
+
+	m_param_est.id_start = state_m->id;
+	m_param_est.iq_start = state_m->iq;
+	m_param_est.vd_sum = 0.0;
+	m_param_est.vq_sum = 0.0;
+	m_param_est.id_sum = 0.0;
+	m_param_est.iq_sum = 0.0;
+	m_param_est.w_id_sum = 0.0;
+	m_param_est.w_iq_sum = 0.0;
+	m_param_est.w_sum = 0.0;
+	m_param_est.samples = 0;
+}
+
+/**
+ * One recursive least squares step with directional forgetting. Only the
+ * directions of the covariance that the regressor excites are forgotten, so
+ * the covariance does not wind up when the operating point stays constant,
+ * e.g. at a constant speed and current where R and the flux linkage cannot be
+ * told apart.
+ *
+ * @param y
+ * The measured output.
+ *
+ * @param phi
+ * The regressor.
+ */
+static void param_est_rls(float y, const float *phi) {
+	float p_phi[3];
+	float r = 0.0;
+	float err = y;
+
+	for (int i = 0;i < 3;i++) {
+		p_phi[i] = 0.0;
+		for (int j = 0;j < 3;j++) {
+			p_phi[i] += m_param_est.p[i][j] * phi[j];
+		}
+		r += phi[i] * p_phi[i];
+		err -= phi[i] * m_param_est.theta[i];
+	}
+
+	// Too little excitation
+	if (r < 1e-6) {
+		return;
+	}
+
+	const float gain = 1.0 / (1.0 + r);
+	for (int i = 0;i < 3;i++) {
+		m_param_est.theta[i] += p_phi[i] * gain * err;
+	}
+
+	const float forget = m_conf->foc_param_est_forget;
+	const float beta = forget - (1.0 - forget) / r;
+	if (beta > 0.0) {
+		const float scale = 1.0 / (1.0 / beta + r);
+		for (int i = 0;i < 3;i++) {
+			for (int j = 0;j < 3;j++) {
+				m_param_est.p[i][j] -= p_phi[i] * p_phi[j] * scale;
+			}
+		}
+	}
 }
 
 static void stop_pwm_hw(void) {
@@ -2577,9 +3949,108 @@ static float correct_encoder(float obs_angle, float enc_angle, float speed) {
 		}
 	}
 
+	if (using_encoder && m_conf->foc_encoder_latency_comp) {
+		// The encoder angle is late by the sensor and transport delays. It is
+		// only extrapolated to the time the currents were sampled, so that the
+		// Park transform uses the right angle. The delay until the duty cycle
+		// is applied is compensated in the inverse Park transform in
+		// control_current.
+		const float delay = (m_conf->foc_encoder_sensor_delay_us +
+				m_conf->foc_encoder_transport_delay_us) * 1e-6;
+
+		float comp = speed * delay;
+		utils_truncate_number_abs(&comp, MCPWM_FOC_ENCODER_COMP_MAX);
+		enc_angle += comp;
+		utils_norm_angle_rad(&enc_angle);
+	}
+
 	return using_encoder ? enc_angle : obs_angle;
 }
 
+/**
+ * Remove the calibrated first and second harmonic error from a raw encoder
+ * angle in degrees.
+ */
+static float encoder_nl_correct(float angle) {
+	float s, c;
+	utils_fast_sincos_better(angle * (M_PI / 180.0), &s, &c);
+
+	angle -= m_conf->foc_encoder_nl_coef[0] * s +
+			m_conf->foc_encoder_nl_coef[1] * c +
+			m_conf->foc_encoder_nl_coef[2] * 2.0 * s * c +
+			m_conf->foc_encoder_nl_coef[3] * (c * c - s * s);
+	utils_norm_angle(&angle);
+
+	return angle;
+}
+
+/**
+ * Track the raw encoder angle in degrees with the calibration PLL and
+ * correlate the tracking error with the harmonics of the PLL angle.
+ */
+static void encoder_nl_cal_update(float angle, float dt) {
+	encoder_nl_cal_t *cal = &m_encoder_nl_cal;
+
+	const float err = utils_angle_difference_rad(angle * (M_PI / 180.0), cal->phase);
+	cal->phase += (cal->speed + 2.0 * cal->wn * err) * dt;
+	utils_norm_angle_rad(&cal->phase);
+	cal->speed += cal->wn * cal->wn * err * dt;
+
+	if (cal->time > 0.0) {
+		cal->time -= dt;
+		return;
+	}
+
+	float s, c;
+	utils_fast_sincos_better(cal->phase, &s, &c);
+	cal->sum[0] += err * s;
+	cal->sum[1] += err * c;
+	cal->sum[2] += err * 2.0 * s * c;
+	cal->sum[3] += err * (c * c - s * s);
+	cal->samples++;
+
+	cal->travel += fabsf(cal->speed) * dt;
+	if (cal->travel >= (float)MCPWM_FOC_ENCODER_NL_REVS * 2.0 * M_PI) {
+		cal->active = false;
+	}
+}
+
+/**
+ * Interpolate the cogging current at an electrical angle in radians from
+ * the table. Returns 0 when the compensation is disabled.
+ */
+static float cogging_current(float phase) {
+	if (!m_conf->foc_cogging_comp) {
+		return 0.0;
+	}
+
+	float pos = phase * ((float)MCPWM_FOC_COGGING_LEN / (2.0 * M_PI));
+	if (pos < 0.0) {
+		pos += (float)MCPWM_FOC_COGGING_LEN;
+	}
+
+	int ind = (int)pos;
+	const float frac = pos - (float)ind;
+	ind %= MCPWM_FOC_COGGING_LEN;
+	const int ind_next = (ind + 1) % MCPWM_FOC_COGGING_LEN;
+
+	const float a = (float)m_conf->foc_cogging_table[ind];
+	const float b = (float)m_conf->foc_cogging_table[ind_next];
+
+	return (a + (b - a) * frac) * (m_conf->foc_cogging_scale / 127.0);
+}
+
+static void cogging_cal_update(float phase, float iq) {
+	float pos = phase * ((float)MCPWM_FOC_COGGING_LEN / (2.0 * M_PI)) + 0.5;
+	if (pos < 0.0) {
+		pos += (float)MCPWM_FOC_COGGING_LEN;
+	}
+
+	const int ind = (int)pos % MCPWM_FOC_COGGING_LEN;
+	m_cogging_cal.sum[ind] += iq;
+	m_cogging_cal.num[ind]++;
+}
+
 static float correct_hall(float angle, float speed, float dt) {
 	static int ang_hall_int_prev = -1;
 	float rpm_abs = fabsf(speed / ((2.0 * M_PI) / 60.0));
@@ -2598,12 +4069,14 @@ static float correct_hall(float angle, float speed, float dt) {
 	}
 
 	if (using_hall) {
-		int ang_hall_int = m_conf->foc_hall_table[read_hall()];
+		const int hall = read_hall();
+		int ang_hall_int = m_conf->foc_hall_table[hall];
 
 		// Only override the observer if the hall sensor value is valid.
 		if (ang_hall_int < 201) {
 			static float ang_hall = 0.0;
 			float ang_hall_now = (((float)ang_hall_int / 200.0) * 360.0) * M_PI / 180.0;
+			const bool hall_reset = ang_hall_int_prev < 0;
 
 			if (ang_hall_int_prev < 0) {
 				// Previous angle not valid
@@ -2647,6 +4120,10 @@ static float correct_hall(float angle, float speed, float dt) {
 
 			utils_norm_angle_rad(&ang_hall);
 			angle = ang_hall;
+
+			if (hall_learned()) {
+				angle = hall_learned_angle(hall, hall_reset, ang_hall, dt);
+			}
 		} else {
 			// Invalid hall reading. Don't update angle.
 			ang_hall_int_prev = -1;
@@ -2661,7 +4138,661 @@ static float correct_hall(float angle, float speed, float dt) {
 	} else {
 		// We are running sensorless.
 		ang_hall_int_prev = -2;
+
+		if (m_conf->foc_hall_learn) {
+			hall_learn_update(read_hall(), angle, speed);
+		}
 	}
 
 	return angle;
 }
+
+/**
+ * Learn where the hall sensor transitions happen from the observer angle
+ * while running sensorless. The edge of each state is where it is entered
+ * in the positive direction, so a transition from prev to hall is on the
+ * edge of hall when rotating forward and on the edge of prev backwards.
+ * Once all edges are learned they are written to the configuration, from
+ * where they can be stored.
+ */
+static void hall_learn_update(int hall, float angle, float speed) {
+	const int hall_prev = m_hall_learn.hall_prev;
+	m_hall_learn.hall_prev = hall;
+
+	if (hall_prev < 0 || hall == hall_prev ||
+			m_conf->foc_hall_table[hall] > 200 || m_conf->foc_hall_table[hall_prev] > 200) {
+		return;
+	}
+
+	// Only learn transitions between neighboring states in the direction of rotation
+	const float dir = utils_angle_difference((float)m_conf->foc_hall_table[hall] * 1.8,
+			(float)m_conf->foc_hall_table[hall_prev] * 1.8);
+	if (fabsf(dir) > 90.0 || (dir > 0.0) != (speed > 0.0)) {
+		return;
+	}
+
+	const int ind = speed > 0.0 ? hall : hall_prev;
+	if (m_hall_learn.num[ind] == 0) {
+		m_hall_learn.edge[ind] = angle;
+	} else {
+		m_hall_learn.edge[ind] += utils_angle_difference_rad(angle, m_hall_learn.edge[ind]) *
+				MCPWM_FOC_HALL_LEARN_FILTER;
+		utils_norm_angle_rad(&m_hall_learn.edge[ind]);
+	}
+
+	if (m_hall_learn.num[ind] < MCPWM_FOC_HALL_LEARN_MIN_EDGES) {
+		m_hall_learn.num[ind]++;
+	}
+
+	for (int i = 0;i < 8;i++) {
+		if (m_conf->foc_hall_table[i] <= 200 && m_hall_learn.num[i] < MCPWM_FOC_HALL_LEARN_MIN_EDGES) {
+			return;
+		}
+	}
+
+	for (int i = 0;i < 8;i++) {
+		if (m_conf->foc_hall_table[i] <= 200) {
+			float edge = m_hall_learn.edge[i] * (180.0 / M_PI);
+			utils_norm_angle(&edge);
+			m_conf->foc_hall_edge[i] = edge;
+		}
+	}
+}
+
+static bool hall_learned(void) {
+	if (!m_conf->foc_hall_learn) {
+		return false;
+	}
+
+	for (int i = 0;i < 8;i++) {
+		if (m_conf->foc_hall_table[i] <= 200 && m_conf->foc_hall_edge[i] < 0.0) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/**
+ * The state after hall in the positive direction, from the learned edges.
+ */
+static int hall_learned_next(int hall, float *width) {
+	int next = hall;
+	float dist_min = 360.0;
+
+	for (int i = 0;i < 8;i++) {
+		if (i == hall || m_conf->foc_hall_table[i] > 200) {
+			continue;
+		}
+
+		float dist = m_conf->foc_hall_edge[i] - m_conf->foc_hall_edge[hall];
+		utils_norm_angle(&dist);
+		if (dist > 0.0 && dist < dist_min) {
+			dist_min = dist;
+			next = i;
+		}
+	}
+
+	*width = dist_min * (M_PI / 180.0);
+	return next;
+}
+
+/**
+ * Hall sensor angle from the learned sector edges. On a transition the
+ * angle is set to the edge that was crossed, and within a sector it is
+ * interpolated with the speed over the previous sector, but not beyond the
+ * sector. When the sector takes much longer than the previous one, the
+ * sector center is used, as there is no good speed estimate.
+ *
+ * @param hall
+ * The hall sensor state.
+ *
+ * @param reset
+ * The previous state is not valid.
+ *
+ * @param angle
+ * The angle to start with after a reset.
+ *
+ * @param dt
+ * The time since the last call.
+ *
+ * @return
+ * The interpolated angle.
+ */
+static float hall_learned_angle(int hall, bool reset, float angle, float dt) {
+	static int hall_prev = -1;
+	static float pos = 0.0;
+	static float width = 0.0;
+	static float sector_speed = 0.0;
+	static float sector_time = 0.0;
+	static float sector_time_prev = 0.0;
+	static bool period_valid = false;
+
+	if (reset || hall_prev < 0) {
+		hall_learned_next(hall, &width);
+		pos = utils_angle_difference_rad(angle, m_conf->foc_hall_edge[hall] * (M_PI / 180.0));
+		if (pos < 0.0) {
+			pos += 2.0 * M_PI;
+		}
+		if (pos > width) {
+			pos = width / 2.0;
+		}
+		sector_speed = 0.0;
+		sector_time = 0.0;
+		period_valid = false;
+	} else if (hall != hall_prev) {
+		float width_prev;
+		const int next_prev = hall_learned_next(hall_prev, &width_prev);
+		const int next = hall_learned_next(hall, &width);
+
+		if (next_prev == hall) {
+			// Forward over the edge of hall
+			pos = 0.0;
+			sector_speed = period_valid ? width_prev / sector_time : 0.0;
+			period_valid = true;
+		} else if (next == hall_prev) {
+			// Backward over the edge of the previous state
+			pos = width;
+			sector_speed = period_valid ? -width_prev / sector_time : 0.0;
+			period_valid = true;
+		} else {
+			// Skipped a state
+			pos = width / 2.0;
+			sector_speed = 0.0;
+			period_valid = false;
+		}
+
+		sector_time_prev = sector_time;
+		sector_time = 0.0;
+	}
+
+	hall_prev = hall;
+	sector_time += dt;
+
+	if (period_valid && sector_time < sector_time_prev * MCPWM_FOC_HALL_LEARN_TIMEOUT) {
+		pos += sector_speed * dt;
+		utils_truncate_number(&pos, 0.0, width);
+	} else if (sector_speed != 0.0) {
+		pos = width / 2.0;
+		sector_speed = 0.0;
+		period_valid = false;
+	}
+
+	float angle_out = m_conf->foc_hall_edge[hall] * (M_PI / 180.0) + pos;
+	utils_norm_angle_rad(&angle_out);
+	return angle_out;
+}
+
+/**
+ * Switch between the HFI estimator and the observer, with the same hysteresis
+ * as for encoders. When switching from the observer to HFI while running, the
+ * HFI estimator continues from the observer angle, which has the right
+ * polarity at that speed. Otherwise the angle and polarity are detected first.
+ *
+ * @param obs_angle
+ * The observer angle.
+ *
+ * @param speed
+ * The electrical speed in rad/s.
+ *
+ * @return
+ * The angle to use.
+ */
+static float correct_hfi(float obs_angle, float speed) {
+	float rpm_abs = fabsf(speed / ((2.0 * M_PI) / 60.0));
+
+	// Hysteresis 5 % of total speed
+	float hyst = m_conf->foc_sl_erpm * 0.05;
+	if (m_hfi.active) {
+		if (rpm_abs > (m_conf->foc_sl_erpm + hyst) && m_hfi.state == HFI_STATE_RUN) {
+			m_hfi.active = false;
+		}
+	} else {
+		if (rpm_abs < (m_conf->foc_sl_erpm - hyst)) {
+			if (m_hfi.state == HFI_STATE_RUN) {
+				m_hfi.speed = speed;
+			} else {
+				m_hfi.speed = 0.0;
+			}
+
+			m_hfi.phase = obs_angle;
+			m_hfi.time = 0.0;
+			m_hfi.did = 0.0;
+			m_hfi.diq = 0.0;
+			m_hfi.ripple_pos = 0.0;
+			m_hfi.ripple_neg = 0.0;
+			m_hfi.samples = 0;
+			m_hfi.active = true;
+		} else {
+			m_hfi.state = HFI_STATE_RUN;
+		}
+	}
+
+	return m_hfi.active ? m_hfi.phase : obs_angle;
+}
+
+/**
+ * Estimate the rotor angle from the saliency with square wave voltage
+ * injection on the estimated D axis, alternating every control period.
+ * With Ld < Lq, the demodulated current ripple in the estimated frame points
+ * at twice the angle error, which is tracked with a PLL. As that only finds
+ * the angle modulo 180 degrees, the polarity is detected by comparing the
+ * ripple with positive and negative D axis current.
+ *
+ * @param state_m
+ * The motor state with the currents from this sample. The currents are
+ * replaced with the average over the last two samples, without the ripple.
+ *
+ * @param dt
+ * The control period in seconds.
+ */
+static void hfi_update(volatile motor_state_t *state_m, float dt) {
+	const float i_alpha = state_m->i_alpha;
+	const float i_beta = state_m->i_beta;
+	const float di_alpha = i_alpha - m_hfi.i_alpha_last;
+	const float di_beta = i_beta - m_hfi.i_beta_last;
+	m_hfi.i_alpha_last = i_alpha;
+	m_hfi.i_beta_last = i_beta;
+
+	if (!m_hfi.active || m_phase_override) {
+		m_hfi.v_inj = 0.0;
+		return;
+	}
+
+	state_m->i_alpha = i_alpha - 0.5 * di_alpha;
+	state_m->i_beta = i_beta - 0.5 * di_beta;
+
+	// The output is applied one control period after it is calculated, so the
+	// current change over the last period comes from the injection two periods
+	// ago. That has the same sign as the injection calculated now.
+	m_hfi.v_inj = m_hfi.v_inj > 0.0 ? -m_conf->foc_hfi_voltage : m_conf->foc_hfi_voltage;
+	const float sign = m_hfi.v_inj > 0.0 ? 1.0 : -1.0;
+
+	// Wait until the current changes come from the injection
+	if (m_hfi.samples < 2) {
+		m_hfi.samples++;
+		return;
+	}
+
+	float s, c;
+	utils_fast_sincos_better(m_hfi.phase, &s, &c);
+	const float did = c * di_alpha + s * di_beta;
+	const float diq = c * di_beta - s * di_alpha;
+	UTILS_LP_FAST(m_hfi.did, sign * did, MCPWM_FOC_HFI_FILTER_CONST);
+	UTILS_LP_FAST(m_hfi.diq, sign * diq, MCPWM_FOC_HFI_FILTER_CONST);
+
+	float phase = m_hfi.phase + 0.5 * utils_fast_atan2(m_hfi.diq, m_hfi.did);
+	utils_norm_angle_rad(&phase);
+	foc_pll_run(phase, dt, m_conf->foc_pll_kp, m_conf->foc_pll_ki, &m_hfi.phase, &m_hfi.speed);
+
+	m_hfi.time += dt;
+
+	switch (m_hfi.state) {
+	case HFI_STATE_LOCK:
+		if (m_hfi.time > MCPWM_FOC_HFI_LOCK_TIME) {
+			m_hfi.state = HFI_STATE_POL_POS;
+			m_hfi.time = 0.0;
+		}
+		break;
+
+	case HFI_STATE_POL_POS:
+		if (m_hfi.time > (0.5 * MCPWM_FOC_HFI_POL_TIME)) {
+			m_hfi.ripple_pos += m_hfi.did;
+		}
+
+		if (m_hfi.time > MCPWM_FOC_HFI_POL_TIME) {
+			m_hfi.state = HFI_STATE_POL_NEG;
+			m_hfi.time = 0.0;
+		}
+		break;
+
+	case HFI_STATE_POL_NEG:
+		if (m_hfi.time > (0.5 * MCPWM_FOC_HFI_POL_TIME)) {
+			m_hfi.ripple_neg += m_hfi.did;
+		}
+
+		if (m_hfi.time > MCPWM_FOC_HFI_POL_TIME) {
+			// Current along the magnet flux saturates the iron and lowers the
+			// inductance, which gives more ripple.
+			if (m_hfi.ripple_pos < m_hfi.ripple_neg) {
+				m_hfi.phase += M_PI;
+				utils_norm_angle_rad(&m_hfi.phase);
+			}
+
+			m_hfi.state = HFI_STATE_RUN;
+		}
+		break;
+
+	default:
+		break;
+	}
+}
+
+/**
+ * Look up the observer gain scale in the gain schedule, with bilinear
+ * interpolation between the speed breakpoints and the current points at
+ * 0 %, 50 % and 100 % of l_current_max.
+ *
+ * @param erpm
+ * The absolute electrical speed.
+ *
+ * @param current_rel
+ * The absolute current relative to l_current_max.
+ *
+ * @return
+ * The scale to apply to foc_observer_gain.
+ */
+static float observer_gain_sched(float erpm, float current_rel) {
+	const volatile float *breakpoints = m_conf->foc_observer_sched_erpm;
+
+	int s = 0;
+	while (s < 2 && erpm > breakpoints[s + 1]) {
+		s++;
+	}
+
+	float speed_frac = 1.0;
+	if (breakpoints[s + 1] > breakpoints[s]) {
+		speed_frac = (erpm - breakpoints[s]) / (breakpoints[s + 1] - breakpoints[s]);
+	}
+	utils_truncate_number(&speed_frac, 0.0, 1.0);
+
+	float current_pos = current_rel * 2.0;
+	utils_truncate_number(&current_pos, 0.0, 2.0);
+	const int c = current_pos >= 1.0 ? 1 : 0;
+	const float current_frac = current_pos - (float)c;
+
+	const float gain_low = utils_map(speed_frac, 0.0, 1.0,
+			m_conf->foc_observer_sched_gain[c][s], m_conf->foc_observer_sched_gain[c][s + 1]);
+	const float gain_high = utils_map(speed_frac, 0.0, 1.0,
+			m_conf->foc_observer_sched_gain[c + 1][s], m_conf->foc_observer_sched_gain[c + 1][s + 1]);
+
+	return utils_map(current_frac, 0.0, 1.0, gain_low, gain_high);
+}
+
+static void offset_track_reset(void) {
+	memset(&m_offset_track, 0, sizeof(m_offset_track));
+
+	m_offset_track.cal[0] = m_curr0_offset;
+	m_offset_track.cal[1] = m_curr1_offset;
+#ifdef HW_HAS_3_SHUNTS
+	m_offset_track.cal[2] = m_curr2_offset;
+#endif
+
+	for (int i = 0;i < 3;i++) {
+		m_offset_track.offset[i] = (float)m_offset_track.cal[i];
+	}
+}
+
+/**
+ * Update the tracked current offsets with raw ADC samples that were taken
+ * while the phase currents were zero.
+ *
+ * @param curr0
+ * Raw sample of the first current sensor.
+ *
+ * @param curr1
+ * Raw sample of the second current sensor.
+ *
+ * @param curr2
+ * Raw sample of the third current sensor. Ignored on hardware with two
+ * current sensors.
+ */
+static void offset_track_update(int curr0, int curr1, int curr2) {
+	const int samples[3] = {curr0, curr1, curr2};
+#ifdef HW_HAS_3_SHUNTS
+	const int channels = 3;
+#else
+	const int channels = 2;
+#endif
+
+	// A sample far away from the tracked offset means that the current was
+	// not zero after all, so discard all channels.
+	for (int i = 0;i < channels;i++) {
+		if (abs(samples[i] - (int)m_offset_track.offset[i]) > MCPWM_FOC_OFFSET_MAX_ERR) {
+			m_offset_track.rejected++;
+			return;
+		}
+	}
+
+	for (int i = 0;i < channels;i++) {
+		UTILS_LP_FAST(m_offset_track.offset[i], (float)samples[i], MCPWM_FOC_OFFSET_FILTER_CONST);
+		utils_truncate_number(&m_offset_track.offset[i],
+				(float)(m_offset_track.cal[i] - MCPWM_FOC_OFFSET_MAX_DRIFT),
+				(float)(m_offset_track.cal[i] + MCPWM_FOC_OFFSET_MAX_DRIFT));
+	}
+
+	m_curr0_offset = (int)roundf(m_offset_track.offset[0]);
+	m_curr1_offset = (int)roundf(m_offset_track.offset[1]);
+#ifdef HW_HAS_3_SHUNTS
+	m_curr2_offset = (int)roundf(m_offset_track.offset[2]);
+#endif
+}
+
+static void offset_track_v7(void) {
+	// The low side switch of the leg with the shortest duty cycle turned off
+	// most recently. Its shunt amplifier needs some time to settle.
+	uint32_t ccr_min = TIM1->CCR1;
+	if (TIM1->CCR2 < ccr_min) {
+		ccr_min = TIM1->CCR2;
+	}
+	if (TIM1->CCR3 < ccr_min) {
+		ccr_min = TIM1->CCR3;
+	}
+
+	if (ccr_min < MCPWM_FOC_OFFSET_V7_MARGIN) {
+		return;
+	}
+
+#ifdef HW_HAS_3_SHUNTS
+	offset_track_update(ADC_Value[ADC_IND_CURR1], ADC_Value[ADC_IND_CURR2],
+			ADC_Value[ADC_IND_CURR3]);
+#else
+	offset_track_update(ADC_Value[ADC_IND_CURR1], ADC_Value[ADC_IND_CURR2], 0);
+#endif
+}
+
+static void offset_track_hist(float dt) {
+	if (!m_conf->foc_offset_track || !m_dccal_done) {
+		return;
+	}
+
+	m_offset_track.hist_time += dt;
+	if (m_offset_track.hist_time < MCPWM_FOC_OFFSET_HIST_TIME) {
+		return;
+	}
+
+	m_offset_track.hist_time -= MCPWM_FOC_OFFSET_HIST_TIME;
+	m_offset_track.hist[m_offset_track.hist_ind][0] = m_curr0_offset;
+	m_offset_track.hist[m_offset_track.hist_ind][1] = m_curr1_offset;
+#ifdef HW_HAS_3_SHUNTS
+	m_offset_track.hist[m_offset_track.hist_ind][2] = m_curr2_offset;
+#endif
+
+	m_offset_track.hist_ind++;
+	if (m_offset_track.hist_ind >= MCPWM_FOC_OFFSET_HIST_LEN) {
+		m_offset_track.hist_ind = 0;
+	}
+	if (m_offset_track.hist_num < MCPWM_FOC_OFFSET_HIST_LEN) {
+		m_offset_track.hist_num++;
+	}
+}
+
+/**
+ * Set up the injected group of every ADC to convert the channel of its
+ * regular current sample MCPWM_FOC_OVERSAMPLE_NUM times in a row. The
+ * channel and sample time are taken from the regular sequence, so this
+ * has to run after hw_setup_adc_channels.
+ */
+static void oversample_init(void) {
+	static const uint16_t sample_cycles[] = {3, 15, 28, 56, 84, 112, 144, 480};
+	ADC_TypeDef *adcs[3] = {ADC1, ADC2, ADC3};
+	const int rank = ADC_IND_CURR1 / 3;
+	uint8_t sample_time = 0;
+
+	for (int i = 0;i < 3;i++) {
+		uint8_t channel;
+		if (rank < 6) {
+			channel = (adcs[i]->SQR3 >> (5 * rank)) & 0x1F;
+		} else if (rank < 12) {
+			channel = (adcs[i]->SQR2 >> (5 * (rank - 6))) & 0x1F;
+		} else {
+			channel = (adcs[i]->SQR1 >> (5 * (rank - 12))) & 0x1F;
+		}
+
+		if (channel < 10) {
+			sample_time = (adcs[i]->SMPR2 >> (3 * channel)) & 0x07;
+		} else {
+			sample_time = (adcs[i]->SMPR1 >> (3 * (channel - 10))) & 0x07;
+		}
+
+		// The rank positions depend on the sequencer length, so set it first
+		ADC_InjectedSequencerLengthConfig(adcs[i], MCPWM_FOC_OVERSAMPLE_NUM);
+		for (int j = 0;j < MCPWM_FOC_OVERSAMPLE_NUM;j++) {
+			ADC_InjectedChannelConfig(adcs[i], channel, j + 1, sample_time);
+		}
+	}
+
+	// In simultaneous mode ADC1 triggers the injected group of all ADCs
+	ADC_ExternalTrigInjectedConvConfig(ADC1, ADC_ExternalTrigInjecConv_T8_CC2);
+	ADC_ExternalTrigInjectedConvEdgeConfig(ADC1, ADC_ExternalTrigInjecConvEdge_Falling);
+
+	// The ADC runs at a quarter of the timer clock and needs 12 cycles
+	// for the conversion after sampling.
+	const uint32_t sample_ticks = 4 * sample_cycles[sample_time];
+	const uint32_t conv_ticks = 4 * (sample_cycles[sample_time] + 12);
+	m_oversample_len = (MCPWM_FOC_OVERSAMPLE_NUM - 1) * conv_ticks + sample_ticks;
+	m_oversample_lead = m_oversample_len / 2;
+}
+
+/**
+ * Schedule the injected conversions for the next zero vector so that the
+ * samples are centered around the timer update, which is where the regular
+ * current sample is taken as well. When the zero vector is too short for
+ * all samples to fit between the switching edges the trigger is left out
+ * and the regular sample is used.
+ */
+static void oversample_update(void) {
+	const uint32_t top = TIM1->ARR;
+	uint32_t samp = 0xFFFF;
+
+	if (m_conf->foc_sample_oversample && m_output_on && !m_samples.measure_inductance_now) {
+		uint32_t ccr_max = TIM1->CCR1;
+		uint32_t ccr_min = TIM1->CCR1;
+		if (TIM1->CCR2 > ccr_max) {
+			ccr_max = TIM1->CCR2;
+		}
+		if (TIM1->CCR3 > ccr_max) {
+			ccr_max = TIM1->CCR3;
+		}
+		if (TIM1->CCR2 < ccr_min) {
+			ccr_min = TIM1->CCR2;
+		}
+		if (TIM1->CCR3 < ccr_min) {
+			ccr_min = TIM1->CCR3;
+		}
+
+		// Half of the zero vector length around the sample point
+		uint32_t zero_half = top > ccr_max ? top - ccr_max : 0;
+#ifdef HW_HAS_PHASE_SHUNTS
+		if (m_conf->foc_sample_v0_v7 && ccr_min < zero_half) {
+			zero_half = ccr_min;
+		}
+#else
+		(void)ccr_min;
+#endif
+
+		const uint32_t after = m_oversample_len - m_oversample_lead;
+		if (zero_half >= (m_oversample_lead + MCPWM_FOC_OVERSAMPLE_MARGIN) &&
+				zero_half >= (after + MCPWM_FOC_OVERSAMPLE_MARGIN)) {
+			samp = top - m_oversample_lead;
+		}
+	}
+
+	TIM8->CCR2 = samp;
+}
+
+static int oversample_read(ADC_TypeDef *adc) {
+	const volatile uint32_t *jdr = &adc->JDR1;
+	int sum = 0;
+
+	for (int i = 0;i < MCPWM_FOC_OVERSAMPLE_NUM;i++) {
+		sum += jdr[i] & 0xFFFF;
+	}
+
+	return (sum + MCPWM_FOC_OVERSAMPLE_NUM / 2) / MCPWM_FOC_OVERSAMPLE_NUM;
+}
+
+/**
+ * Limit a switching frequency to what the timer and the control interrupt
+ * can handle. The interrupt runs at half the switching frequency, or at the
+ * switching frequency when sampling in both V0 and V7.
+ *
+ * @param f_sw
+ * The switching frequency in Hz.
+ *
+ * @return
+ * The limited switching frequency.
+ */
+static float f_sw_limit(float f_sw) {
+	float f_sw_max = 2.0 * MCPWM_FOC_INT_RATE_MAX;
+#ifdef HW_HAS_PHASE_SHUNTS
+	if (m_conf->foc_sample_v0_v7) {
+		f_sw_max = MCPWM_FOC_INT_RATE_MAX;
+	}
+#endif
+
+	if (UTILS_IS_NAN(f_sw)) {
+		f_sw = MCPWM_FOC_F_SW_MIN;
+	}
+
+	utils_truncate_number(&f_sw, MCPWM_FOC_F_SW_MIN, f_sw_max);
+	return f_sw;
+}
+
+static uint32_t f_sw_top(float f_sw) {
+	return (uint32_t)((float)SYSTEM_CORE_CLOCK / f_sw + 0.5);
+}
+
+static void set_f_sw(float f_sw) {
+	f_sw = f_sw_limit(f_sw);
+	m_f_sw_sched = f_sw;
+	m_f_sw_top = f_sw_top(f_sw);
+	m_f_sw_now = (float)SYSTEM_CORE_CLOCK / (float)m_f_sw_top;
+	TIMER_UPDATE_SAMP_TOP(MCPWM_FOC_CURRENT_SAMP_OFFSET, m_f_sw_top);
+}
+
+/**
+ * Calculate the switching frequency for the current operating point. It
+ * rises from foc_f_sw at standstill to foc_f_sw_high at foc_f_sw_sched_erpm
+ * for better current control at high speed. At low speed and high current
+ * it is lowered towards foc_f_sw_low to reduce the switching losses. The
+ * interrupt handler applies the new timer top. A foc_f_sw_sched_erpm that is
+ * not positive disables the scheduling.
+ *
+ * @param dt
+ * Time since the last call in seconds.
+ */
+static void f_sw_sched_update(float dt) {
+	if (!m_conf->foc_f_sw_sched || !(m_conf->foc_f_sw_sched_erpm > 0.0)) {
+		return;
+	}
+
+	float f_sw = m_conf->foc_f_sw;
+
+	if (m_state == MC_STATE_RUNNING) {
+		float speed_rel = fabsf(mcpwm_foc_get_rpm()) / m_conf->foc_f_sw_sched_erpm;
+		utils_truncate_number(&speed_rel, 0.0, 1.0);
+
+		float derate = utils_map(m_motor_state.i_abs_filter / m_conf->l_current_max,
+				MCPWM_FOC_F_SW_SCHED_CURRENT, 1.0, 0.0, 1.0);
+		utils_truncate_number(&derate, 0.0, 1.0);
+
+		f_sw += (m_conf->foc_f_sw_high - f_sw) * speed_rel;
+		f_sw -= (f_sw - m_conf->foc_f_sw_low) * derate * (1.0 - speed_rel);
+	}
+
+	float f_sw_sched = m_f_sw_sched;
+	utils_step_towards(&f_sw_sched, f_sw_limit(f_sw), MCPWM_FOC_F_SW_SCHED_RATE * dt);
+	m_f_sw_sched = f_sw_sched;
+	m_f_sw_top = f_sw_top(f_sw_sched);
+}
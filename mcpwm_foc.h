@@ -65,12 +65,24 @@ float mcpwm_foc_get_phase_observer(void);
 float mcpwm_foc_get_phase_encoder(void);
 float mcpwm_foc_get_vd(void);
 float mcpwm_foc_get_vq(void);
+void mcpwm_foc_get_param_est(float *res, float *ind, float *flux_linkage);
+void mcpwm_foc_get_current_offsets(int *curr0_offset, int *curr1_offset, int *curr2_offset);
 void mcpwm_foc_encoder_detect(float current, bool print, float *offset, float *ratio, bool *inverted);
+bool mcpwm_foc_encoder_nl_cal(float current, float erpm, float *coef);
+bool mcpwm_foc_cogging_cal(float time, int8_t *table, float *scale);
 float mcpwm_foc_measure_resistance(float current, int samples);
 float mcpwm_foc_measure_inductance(float duty, int samples, float *curr);
 bool mcpwm_foc_measure_res_ind(float *res, float *ind);
+bool mcpwm_foc_measure_current_step(float current, float *rise_time,
+		float *settling_time, float *overshoot);
+bool mcpwm_foc_measure_relay(bool pos, float setpoint, float current, float hyst,
+		float *ku, float *tu);
+bool mcpwm_foc_measure_pid_step(bool pos, float setpoint, float step, float time,
+		float *rise_time, float *settling_time, float *overshoot);
 bool mcpwm_foc_hall_detect(float current, uint8_t *hall_table);
 void mcpwm_foc_print_state(void);
+void mcpwm_foc_print_offsets(void);
+void mcpwm_foc_print_hall_edges(void);
 float mcpwm_foc_get_last_inj_adc_isr_duration(void);
 
 // Interrupt handlers
@@ -82,5 +94,43 @@ void mcpwm_foc_adc_int_handler(void *p, uint32_t flags);
 #define MCPWM_FOC_INDUCTANCE_SAMPLE_RISE_COMP		50 // Current rise time compensation
 #define MCPWM_FOC_I_FILTER_CONST					0.1 // Filter constant for the current filters
 #define MCPWM_FOC_CURRENT_SAMP_OFFSET				(2) // Offset from timer top for injected ADC samples
+#define MCPWM_FOC_STEP_SAMPLES						200 // Samples to record in the current and PID step tests
+#define MCPWM_FOC_RELAY_SKIP_CYCLES					2 // Relay oscillation periods to skip before measuring
+#define MCPWM_FOC_RELAY_CYCLES						4 // Relay oscillation periods to average
+#define MCPWM_FOC_PARAM_EST_DECIMATION				10 // Control periods per parameter estimator update
+#define MCPWM_FOC_PARAM_EST_MIN_CURRENT				0.05 // Minimum current for parameter estimation, relative to l_current_max
+#define MCPWM_FOC_PARAM_EST_MIN						0.5 // Lowest estimated parameter relative to the configured value
+#define MCPWM_FOC_PARAM_EST_MAX						2.0 // Highest estimated parameter relative to the configured value
+#define MCPWM_FOC_HFI_FILTER_CONST					0.1 // Filter constant for the demodulated HFI current ripple
+#define MCPWM_FOC_HFI_LOCK_TIME						0.05 // Time for the HFI angle to converge before detecting the polarity
+#define MCPWM_FOC_HFI_POL_TIME						0.02 // Time to apply each polarity detection current
+#define MCPWM_FOC_HFI_POL_CURRENT					0.3 // Polarity detection D axis current, relative to l_current_max
+#define MCPWM_FOC_OBSERVER_ITERATIONS_MAX			6 // Maximum observer iterations per control period
+#define MCPWM_FOC_OBSERVER_ANGLE_STEP				0.1 // Maximum rotation per observer iteration in radians
+#define MCPWM_FOC_OBSERVER_GAIN_STEP				0.2 // Maximum observer gain * lambda^2 * dt per iteration
+#define MCPWM_FOC_OFFSET_FILTER_CONST				0.0002 // Filter constant for the current offset tracking
+#define MCPWM_FOC_OFFSET_MAX_ERR					40 // Largest sample deviation from the tracked offset in ADC counts
+#define MCPWM_FOC_OFFSET_MAX_DRIFT					100 // Largest offset drift from the startup calibration in ADC counts
+#define MCPWM_FOC_OFFSET_MAX_MOD					0.3 // Largest back emf while stopped for offset tracking, in modulation units
+#define MCPWM_FOC_OFFSET_V7_MARGIN					300 // Low side off time before a V7 offset sample in timer ticks
+#define MCPWM_FOC_OFFSET_HIST_LEN					32 // Number of entries in the offset history
+#define MCPWM_FOC_OFFSET_HIST_TIME					1.0 // Time between offset history entries in seconds
+#define MCPWM_FOC_OVERSAMPLE_NUM					4 // Injected conversions per current sample when oversampling (1 - 4)
+#define MCPWM_FOC_OVERSAMPLE_MARGIN					50 // Distance between oversampled conversions and switching edges in timer ticks
+#define MCPWM_FOC_F_SW_SCHED_CURRENT				0.5 // Current above which the switching frequency is lowered, relative to l_current_max
+#define MCPWM_FOC_F_SW_SCHED_RATE					20000.0 // Largest switching frequency change in Hz per second
+#define MCPWM_FOC_F_SW_MIN							3000.0 // Lowest switching frequency, the timer top must fit in 16 bits
+#define MCPWM_FOC_INT_RATE_MAX						20000.0 // Highest control interrupt rate in Hz that the interrupt has time for
+#define MCPWM_FOC_ENCODER_COMP_MAX					(M_PI / 3.0) // Largest encoder latency compensation in radians
+#define MCPWM_FOC_ENCODER_NL_SPINUP_TIME			2000 // Time for the speed to settle before the nonlinearity calibration in ms
+#define MCPWM_FOC_ENCODER_NL_PLL_BW					0.1 // Calibration PLL bandwidth relative to the mechanical speed
+#define MCPWM_FOC_ENCODER_NL_SETTLE					5.0 // Calibration PLL settling time in time constants
+#define MCPWM_FOC_ENCODER_NL_REVS					5 // Mechanical revolutions to fit the nonlinearity over
+#define MCPWM_FOC_ENCODER_NL_MAX					15.0 // Largest plausible nonlinearity harmonic in degrees
+#define MCPWM_FOC_COGGING_LEN						128 // Length of foc_cogging_table
+#define MCPWM_FOC_HALL_LEARN_FILTER					0.05 // Filter constant for the learned hall sector edges
+#define MCPWM_FOC_HALL_LEARN_MIN_EDGES				20 // Transitions to see on every edge before the learned edges are used
+#define MCPWM_FOC_HALL_LEARN_TIMEOUT				2.0 // Sector time relative to the previous sector after which interpolation stops
+#define MCPWM_FOC_SIX_STEP_MOD						(0.95492965855) // Six-step fundamental in modulation units (3 / pi)
 
 #endif /* MCPWM_FOC_H_ */
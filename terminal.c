@@ -226,12 +226,105 @@ void terminal_process_string(char *str) {
 			if (msg->id >= 0 && UTILS_AGE_S(msg->rx_time) < 1.0) {
 				commands_printf("ID                 : %i", msg->id);
 				commands_printf("RX Time            : %i", msg->rx_time);
+				commands_printf("RX Bus Time (us)   : %u", msg->rx_time_sync);
 				commands_printf("Age (milliseconds) : %.2f", (double)(UTILS_AGE_S(msg->rx_time) * 1000.0));
 				commands_printf("RPM                : %.2f", (double)msg->rpm);
 				commands_printf("Current            : %.2f", (double)msg->current);
 				commands_printf("Duty               : %.2f\n", (double)msg->duty);
 			}
 		}
+	} else if (strcmp(argv[0], "can_stats") == 0) {
+		can_bus_stats stats;
+		comm_can_get_stats(&stats);
+
+		uint32_t tx_tot = stats.tx_timeouts;
+		for (int i = 0;i < CAN_STATS_PACKET_TYPES;i++) {
+			tx_tot += stats.tx_frames[i];
+		}
+
+		commands_printf("Bus load           : %.1f %% (max %.1f %%)", (double)stats.bus_load, (double)stats.bus_load_max);
+		commands_printf("TEC / REC          : %u / %u", stats.tec, stats.rec);
+		commands_printf("Bus off events     : %u", stats.bus_off_events);
+		commands_printf("Framing errors     : %u", stats.framing_errors);
+		commands_printf("RX overflows       : %u", stats.rx_overflows);
+		commands_printf("TX mailbox full    : %u", stats.tx_mailbox_full);
+		commands_printf("TX timeouts        : %u", stats.tx_timeouts);
+		commands_printf("TX wait avg (us)   : %.1f", tx_tot > 0 ?
+				(double)((float)stats.tx_wait_sum_us / (float)tx_tot) : (double)0.0);
+		commands_printf("TX wait max (us)   : %u", stats.tx_wait_max_us);
+
+		commands_printf("Type  TX frames  RX frames");
+		for (int i = 0;i < CAN_STATS_PACKET_TYPES;i++) {
+			if (stats.tx_frames[i] || stats.rx_frames[i]) {
+				if (i == CAN_STATS_PACKET_TYPES - 1) {
+					commands_printf("Other %9u  %9u", stats.tx_frames[i], stats.rx_frames[i]);
+				} else {
+					commands_printf("%4i  %9u  %9u", i, stats.tx_frames[i], stats.rx_frames[i]);
+				}
+			}
+		}
+		commands_printf(" ");
+	} else if (strcmp(argv[0], "can_stats_reset") == 0) {
+		comm_can_reset_stats();
+		commands_printf("CAN statistics reset.\n");
+	} else if (strcmp(argv[0], "can_sync") == 0) {
+		int master_id;
+		float offset, drift;
+		comm_can_get_sync_state(&master_id, &offset, &drift);
+
+		if (comm_can_is_sync_master()) {
+			commands_printf("Role               : Master");
+		} else if (comm_can_sync_is_valid()) {
+			commands_printf("Role               : Slave");
+			commands_printf("Master ID          : %i", master_id);
+			commands_printf("Offset (us)        : %.1f", (double)offset);
+			commands_printf("Drift (ppm)        : %.2f", (double)drift);
+		} else {
+			commands_printf("Role               : Slave (not synchronized)");
+		}
+
+		commands_printf("Bus time (us)      : %u\n", comm_can_sync_time_us());
+	} else if (strcmp(argv[0], "can_sync_master") == 0) {
+		if (argc == 2) {
+			int master = -1;
+			sscanf(argv[1], "%d", &master);
+
+			if (master == 0 || master == 1) {
+				comm_can_set_sync_master(master);
+				commands_printf(master ? "This controller is now time master.\n" :
+						"This controller now follows the time master on the bus.\n");
+			} else {
+				commands_printf("Invalid argument(s).\n");
+			}
+		} else {
+			commands_printf("This command requires one argument.\n");
+		}
+	} else if (strcmp(argv[0], "can_sample_sync") == 0) {
+		if (argc == 5) {
+			int mode = -1;
+			int len = -1;
+			int decimation = -1;
+			int delay = -1;
+			sscanf(argv[1], "%d", &mode);
+			sscanf(argv[2], "%d", &len);
+			sscanf(argv[3], "%d", &decimation);
+			sscanf(argv[4], "%d", &delay);
+
+			if (mode > DEBUG_SAMPLING_OFF && mode < DEBUG_SAMPLING_SEND_LAST_SAMPLES &&
+					len > 0 && len <= 65535 && decimation > 0 && decimation <= 255 &&
+					delay >= 10 && delay <= 10000) {
+				if (comm_can_sync_is_valid()) {
+					uint32_t start = comm_can_sample_sync(mode, len, decimation, delay);
+					commands_printf("Capture starts at bus time %u us\n", start);
+				} else {
+					commands_printf("The bus time is not synchronized.\n");
+				}
+			} else {
+				commands_printf("Invalid argument(s).\n");
+			}
+		} else {
+			commands_printf("This command requires four arguments.\n");
+		}
 	} else if (strcmp(argv[0], "foc_encoder_detect") == 0) {
 		if (argc == 2) {
 			float current = -1.0;
@@ -263,6 +356,55 @@ void terminal_process_string(char *str) {
 		} else {
 			commands_printf("This command requires one argument.\n");
 		}
+	} else if (strcmp(argv[0], "foc_encoder_nl_cal") == 0) {
+		if (argc == 3) {
+			float current = -1.0;
+			float erpm = 0.0;
+			sscanf(argv[1], "%f", &current);
+			sscanf(argv[2], "%f", &erpm);
+
+			if (current > 0.0 && current <= mcconf.l_current_max && fabsf(erpm) > 0.0) {
+				if (encoder_is_configured()) {
+					float coef[4];
+					if (conf_general_encoder_nl_cal(current, erpm, coef)) {
+						commands_printf("1st harmonic sin : %.3f deg", (double)coef[0]);
+						commands_printf("1st harmonic cos : %.3f deg", (double)coef[1]);
+						commands_printf("2nd harmonic sin : %.3f deg", (double)coef[2]);
+						commands_printf("2nd harmonic cos : %.3f deg\n", (double)coef[3]);
+					} else {
+						commands_printf("Calibration failed, the configuration is unchanged.\n");
+					}
+				} else {
+					commands_printf("Encoder not enabled.\n");
+				}
+			} else {
+				commands_printf("Invalid argument(s).\n");
+			}
+		} else {
+			commands_printf("This command requires two arguments.\n");
+		}
+	} else if (strcmp(argv[0], "foc_cogging_cal") == 0) {
+		if (argc == 2) {
+			float time = -1.0;
+			sscanf(argv[1], "%f", &time);
+
+			if (time >= 1.0) {
+				if (encoder_is_configured()) {
+					float scale = 0.0;
+					if (conf_general_cogging_cal(time, &scale)) {
+						commands_printf("Largest cogging current: %.3f A\n", (double)scale);
+					} else {
+						commands_printf("Calibration failed, the configuration is unchanged.\n");
+					}
+				} else {
+					commands_printf("Encoder not enabled.\n");
+				}
+			} else {
+				commands_printf("Invalid argument(s).\n");
+			}
+		} else {
+			commands_printf("This command requires one argument.\n");
+		}
 	} else if (strcmp(argv[0], "measure_res") == 0) {
 		if (argc == 2) {
 			float current = -1.0;
@@ -334,6 +476,76 @@ void terminal_process_string(char *str) {
 		commands_printf("Inductance: %.2f microhenry\n", (double)ind);
 
 		mc_interface_set_configuration(&mcconf_old);
+	} else if (strcmp(argv[0], "tune_current_loop") == 0) {
+		if (argc == 3 || argc == 4) {
+			float bandwidth = -1.0;
+			float current = -1.0;
+			int measure = 0;
+			sscanf(argv[1], "%f", &bandwidth);
+			sscanf(argv[2], "%f", &current);
+			if (argc == 4) {
+				sscanf(argv[3], "%d", &measure);
+			}
+
+			if (bandwidth > 0.0 && bandwidth <= (mcconf.foc_f_sw / 10.0) &&
+					current > 0.0 && current <= mcconf.l_current_max) {
+				float kp, ki, rise_time, settling_time, overshoot;
+
+				if (conf_general_tune_current_loop(bandwidth, current, measure,
+						&kp, &ki, &rise_time, &settling_time, &overshoot)) {
+					commands_printf("Current controller tuned for %.0f Hz", (double)bandwidth);
+					commands_printf("Kp:            %.5f", (double)kp);
+					commands_printf("Ki:            %.3f", (double)ki);
+					commands_printf("Rise time:     %.1f us", (double)(rise_time * 1e6));
+					commands_printf("Settling time: %.1f us", (double)(settling_time * 1e6));
+					commands_printf("Overshoot:     %.1f %%\n", (double)overshoot);
+				} else {
+					commands_printf("Tuning failed, the configuration is unchanged.\n");
+				}
+			} else {
+				commands_printf("Invalid argument(s).\n");
+			}
+		} else {
+			commands_printf("This command requires two or three arguments.\n");
+		}
+	} else if (strcmp(argv[0], "autotune_pid") == 0) {
+		if (argc == 4 || argc == 5) {
+			bool pos = strcmp(argv[1], "pos") == 0;
+			bool speed = strcmp(argv[1], "speed") == 0;
+			float setpoint = 0.0;
+			float current = -1.0;
+			int rule = PID_TUNE_RULE_ZN_PID;
+			sscanf(argv[2], "%f", &setpoint);
+			sscanf(argv[3], "%f", &current);
+			if (argc == 5) {
+				sscanf(argv[4], "%d", &rule);
+			}
+
+			if ((pos || (speed && setpoint != 0.0 && fabsf(setpoint) >= mcconf.s_pid_min_erpm)) &&
+					current > 0.0 && current <= mcconf.l_current_max &&
+					rule >= PID_TUNE_RULE_ZN_PID && rule <= PID_TUNE_RULE_NO_OVERSHOOT) {
+				float ku, tu, kp, ki, kd, rise_time, settling_time, overshoot;
+
+				if (conf_general_autotune_pid(pos, setpoint, current, rule, &ku, &tu,
+						&kp, &ki, &kd, &rise_time, &settling_time, &overshoot)) {
+					commands_printf("%s controller tuned", pos ? "Position" : "Speed");
+					commands_printf("Ku:            %.5f", (double)ku);
+					commands_printf("Tu:            %.2f ms", (double)(tu * 1e3));
+					commands_printf("Kp:            %.5f", (double)kp);
+					commands_printf("Ki:            %.5f", (double)ki);
+					commands_printf("Kd:            %.6f", (double)kd);
+					commands_printf("Rise time:     %.1f ms", (double)(rise_time * 1e3));
+					commands_printf("Settling time: %.1f ms", (double)(settling_time * 1e3));
+					commands_printf("Overshoot:     %.1f %%\n", (double)overshoot);
+				} else {
+					commands_printf("Tuning failed, the configuration is unchanged.\n");
+				}
+			} else {
+				commands_printf("Invalid argument(s).\n");
+			}
+		} else {
+			commands_printf("This command requires three or four arguments.\n");
+		}
 	} else if (strcmp(argv[0], "measure_linkage_foc") == 0) {
 		if (argc == 2) {
 			float duty = -1.0;
@@ -389,6 +601,18 @@ void terminal_process_string(char *str) {
 	} else if (strcmp(argv[0], "foc_state") == 0) {
 		mcpwm_foc_print_state();
 		commands_printf(" ");
+	} else if (strcmp(argv[0], "foc_hall_edges") == 0) {
+		mcpwm_foc_print_hall_edges();
+
+		if (argc == 2 && strcmp(argv[1], "store") == 0) {
+			conf_general_store_mc_configuration(&mcconf);
+			commands_printf("Configuration stored.");
+		}
+
+		commands_printf(" ");
+	} else if (strcmp(argv[0], "foc_offsets") == 0) {
+		mcpwm_foc_print_offsets();
+		commands_printf(" ");
 	} else if (strcmp(argv[0], "hw_status") == 0) {
 		commands_printf("Firmware: %d.%d", FW_VERSION_MAJOR, FW_VERSION_MINOR);
 #ifdef HW_NAME
@@ -399,6 +623,8 @@ void terminal_process_string(char *str) {
 				STM32_UUID_8[4], STM32_UUID_8[5], STM32_UUID_8[6], STM32_UUID_8[7],
 				STM32_UUID_8[8], STM32_UUID_8[9], STM32_UUID_8[10], STM32_UUID_8[11]);
 		commands_printf("Permanent NRF found: %s", conf_general_permanent_nrf_found ? "Yes" : "No");
+		commands_printf("Encoder SPI errors: %u", (unsigned int)encoder_spi_get_error_cnt());
+		commands_printf("Encoder sin/cos errors: %u", (unsigned int)encoder_sincos_get_error_cnt());
 		commands_printf(" ");
 	} else if (strcmp(argv[0], "drv8301_read_reg") == 0) {
 #ifdef HW_HAS_DRV8301
@@ -609,9 +835,33 @@ void terminal_process_string(char *str) {
 		commands_printf("can_devs");
 		commands_printf("  Prints all CAN devices seen on the bus the past second");
 
+		commands_printf("can_stats");
+		commands_printf("  Prints CAN bus load, error counters and frame counters per packet type");
+
+		commands_printf("can_stats_reset");
+		commands_printf("  Resets the CAN bus statistics");
+
+		commands_printf("can_sync");
+		commands_printf("  Prints the CAN bus time synchronization state");
+
+		commands_printf("can_sync_master [0 or 1]");
+		commands_printf("  Make this controller time master on the CAN bus, or follow the master");
+
+		commands_printf("can_sample_sync [mode] [len] [decimation] [delay_ms]");
+		commands_printf("  Start a debug capture on all synchronized controllers at the same time");
+		commands_printf("  delay_ms after now. Mode is the same as for COMM_SAMPLE_PRINT.");
+
 		commands_printf("foc_encoder_detect [current]");
 		commands_printf("  Run the motor at 1Hz on open loop and compute encoder settings");
 
+		commands_printf("foc_encoder_nl_cal [current] [erpm]");
+		commands_printf("  Run the motor on open loop at a constant speed, fit the first and second");
+		commands_printf("  harmonic of the encoder error and store and enable the correction.");
+
+		commands_printf("foc_cogging_cal [time]");
+		commands_printf("  Turn the motor one revolution forward and back in position control over");
+		commands_printf("  time seconds each, and store and enable the recorded cogging current.");
+
 		commands_printf("measure_res [current]");
 		commands_printf("  Lock the motor with a current and calculate its resistance");
 
@@ -626,12 +876,32 @@ void terminal_process_string(char *str) {
 		commands_printf("measure_res_ind");
 		commands_printf("  Measure the motor resistance and inductance with an incremental adaptive algorithm.");
 
+		commands_printf("tune_current_loop [bandwidth_hz] [current] [measure]");
+		commands_printf("  Calculate the current controller gains for a bandwidth from the motor");
+		commands_printf("  resistance and inductance, verify them with a current step and store them.");
+		commands_printf("  Set measure to 1 to measure the resistance and inductance first.");
+
+		commands_printf("autotune_pid [speed|pos] [setpoint] [current] [rule]");
+		commands_printf("  Measure the ultimate gain and period of the speed or position loop with a");
+		commands_printf("  relay experiment around the setpoint in ERPM or degrees, calculate the");
+		commands_printf("  gains, verify them with a setpoint step and store them. The relay switches");
+		commands_printf("  the current by +-current. Rules: 0 = Ziegler-Nichols PID (default),");
+		commands_printf("  1 = Ziegler-Nichols PI, 2 = Tyreus-Luyben, 3 = Some overshoot,");
+		commands_printf("  4 = No overshoot.");
+
 		commands_printf("measure_linkage_foc [duty]");
 		commands_printf("  Run the motor with FOC and measure the flux linkage.");
 
 		commands_printf("foc_state");
 		commands_printf("  Print some FOC state variables.");
 
+		commands_printf("foc_offsets");
+		commands_printf("  Print the current sensor offsets and their history.");
+
+		commands_printf("foc_hall_edges [store]");
+		commands_printf("  Print the hall sensor sector edges learned while running sensorless.");
+		commands_printf("  With store, the configuration including the learned edges is stored.");
+
 		commands_printf("hw_status");
 		commands_printf("  Print some hardware status information.");
 
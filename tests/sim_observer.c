@@ -0,0 +1,181 @@
+/*
+	Copyright 2017 Benjamin Vedder	benjamin@vedder.se
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+/*
+ * Host simulation of the flux observer convergence. A motor turning at a
+ * constant speed with a constant q current is fed to foc_observer_update,
+ * starting from a zero observer state. The result is compared with the
+ * previous fixed count of six iterations per control period.
+ *
+ * Run again when MCPWM_FOC_OBSERVER_ANGLE_STEP, MCPWM_FOC_OBSERVER_GAIN_STEP
+ * or MCPWM_FOC_OBSERVER_ITERATIONS_MAX change.
+ */
+
+#include "foc_math.h"
+#include "utils.h"
+#include <stdio.h>
+#include <math.h>
+
+// Motor and controller
+#define MOTOR_R				0.015
+#define MOTOR_L				10e-6
+#define MOTOR_LAMBDA		0.00245
+#define MOTOR_IQ			20.0
+#define OBSERVER_R_ERR		1.1 // The observer resistance is 10 % off
+#define DT					1e-4
+#define SIM_TIME			0.05
+#define CONV_ERR			0.05 // Angle error in radians that counts as converged
+#define FIXED_ITERATIONS	6
+
+typedef struct {
+	float conv_time;
+	float err_max;
+	int iterations_max;
+} sim_result;
+
+// The observer as it was before the adaptive iteration count
+static void observer_fixed(float v_alpha, float v_beta, float i_alpha, float i_beta,
+		float dt, float R, float L, float lambda, float gamma, float *x1, float *x2,
+		float *phase) {
+	const float L_ia = L * i_alpha;
+	const float L_ib = L * i_beta;
+	const float R_ia = R * i_alpha;
+	const float R_ib = R * i_beta;
+	const float lambda_2 = SQ(lambda);
+	const float gamma_half = gamma * 0.5;
+	const float dt_iteration = dt / (float)FIXED_ITERATIONS;
+
+	for (int i = 0;i < FIXED_ITERATIONS;i++) {
+		float err = lambda_2 - (SQ(*x1 - L_ia) + SQ(*x2 - L_ib));
+		float gamma_tmp = gamma_half;
+		if (utils_truncate_number_abs(&err, lambda_2 * 0.2)) {
+			gamma_tmp *= 10.0;
+		}
+		*x1 += (-R_ia + v_alpha + gamma_tmp * (*x1 - L_ia) * err) * dt_iteration;
+		*x2 += (-R_ib + v_beta + gamma_tmp * (*x2 - L_ib) * err) * dt_iteration;
+	}
+
+	*phase = utils_fast_atan2(*x2 - L_ib, *x1 - L_ia);
+}
+
+static sim_result sim(float erpm, float gamma, bool adaptive) {
+	// The same 3/2 scaling as in the firmware
+	const double R = 1.5 * MOTOR_R;
+	const double L = 1.5 * MOTOR_L;
+	const double lambda = MOTOR_LAMBDA;
+	const double w = erpm * (2.0 * M_PI / 60.0);
+	const int steps = (int)(SIM_TIME / DT);
+
+	float x1 = 0.0, x2 = 0.0, phase = 0.0;
+	volatile float vx1 = 0.0, vx2 = 0.0, vphase = 0.0;
+	sim_result res = {-1.0, 0.0, 0};
+
+	for (int k = 0;k < steps;k++) {
+		const double th0 = w * k * DT;
+		const double th1 = w * (k + 1) * DT;
+		const double i_alpha = -sin(th0) * MOTOR_IQ;
+		const double i_beta = cos(th0) * MOTOR_IQ;
+
+		// Average voltage over the period from the change of the flux linkage
+		// psi = L * i + lambda * e^(j * th), with the current rotating along.
+		const double psi_a0 = -L * sin(th0) * MOTOR_IQ + lambda * cos(th0);
+		const double psi_b0 = L * cos(th0) * MOTOR_IQ + lambda * sin(th0);
+		const double psi_a1 = -L * sin(th1) * MOTOR_IQ + lambda * cos(th1);
+		const double psi_b1 = L * cos(th1) * MOTOR_IQ + lambda * sin(th1);
+		double ri_a = R * i_alpha;
+		double ri_b = R * i_beta;
+		if (w != 0.0) {
+			ri_a = R * MOTOR_IQ * (cos(th1) - cos(th0)) / (w * DT);
+			ri_b = R * MOTOR_IQ * (sin(th1) - sin(th0)) / (w * DT);
+		}
+		const double v_alpha = (psi_a1 - psi_a0) / DT + ri_a;
+		const double v_beta = (psi_b1 - psi_b0) / DT + ri_b;
+
+		if (adaptive) {
+			const int it = foc_observer_update(v_alpha, v_beta, i_alpha, i_beta, DT,
+					R * OBSERVER_R_ERR, L, lambda, gamma, w, &vx1, &vx2, &vphase);
+			if (it > res.iterations_max) {
+				res.iterations_max = it;
+			}
+			phase = vphase;
+		} else {
+			observer_fixed(v_alpha, v_beta, i_alpha, i_beta, DT,
+					R * OBSERVER_R_ERR, L, lambda, gamma, &x1, &x2, &phase);
+			res.iterations_max = FIXED_ITERATIONS;
+		}
+
+		// The phase is the rotor angle at the end of the period, using the
+		// current from the start of it as the firmware does.
+		float err = phase - th1;
+		utils_norm_angle_rad(&err);
+		err = fabsf(err);
+
+		if (res.conv_time < 0.0 && err < CONV_ERR) {
+			res.conv_time = k * DT;
+		} else if (res.conv_time >= 0.0 && err >= CONV_ERR && k < steps * 8 / 10) {
+			res.conv_time = -1.0;
+		}
+
+		if (k >= steps - 100 && err > res.err_max) {
+			res.err_max = err;
+		}
+	}
+
+	return res;
+}
+
+static void conv_str(char *str, float conv_time) {
+	if (conv_time < 0.0) {
+		sprintf(str, "--");
+	} else {
+		sprintf(str, "%.1f ms", (double)(conv_time * 1e3));
+	}
+}
+
+int main(void) {
+	static const float gains[] = {9e7, 3e8};
+	static const float speeds[] = {1000, 5000, 20000, 50000, 100000};
+
+	printf("R %.1f mOhm, L %.1f uH, lambda %.2f mWb, iq %.0f A, %.0f kHz, observer R %+.0f %%\n",
+			MOTOR_R * 1e3, MOTOR_L * 1e6, MOTOR_LAMBDA * 1e3, MOTOR_IQ, 1e-3 / DT,
+			(OBSERVER_R_ERR - 1.0) * 100.0);
+	printf("Max angle error in the last 100 periods, time to converge within %.2f rad\n\n",
+			CONV_ERR);
+
+	for (unsigned int g = 0;g < sizeof(gains) / sizeof(gains[0]);g++) {
+		printf("Gain %.1e\n", (double)gains[g]);
+		printf("  ERPM      fixed %d                    adaptive\n", FIXED_ITERATIONS);
+
+		for (unsigned int i = 0;i < sizeof(speeds) / sizeof(speeds[0]);i++) {
+			const sim_result f = sim(speeds[i], gains[g], false);
+			const sim_result a = sim(speeds[i], gains[g], true);
+			char f_conv[16], a_conv[16];
+			conv_str(f_conv, f.conv_time);
+			conv_str(a_conv, a.conv_time);
+
+			printf("  %-8.0f  %6.2f deg  %8s       %6.2f deg  %8s  (%d iterations)\n",
+					(double)speeds[i], (double)(f.err_max * 180.0 / M_PI), f_conv,
+					(double)(a.err_max * 180.0 / M_PI), a_conv, a.iterations_max);
+		}
+
+		printf("\n");
+	}
+
+	return 0;
+}
@@ -0,0 +1,211 @@
+/*
+	Copyright 2017 Benjamin Vedder	benjamin@vedder.se
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+/*
+ * Host simulation of the speed PLL for constant speeds, a speed ramp and a
+ * speed step. It compares the fixed gain PLL with the adaptive bandwidth PLL,
+ * with and without the observer feedforward, using the default gains from
+ * mcconf_default.h.
+ *
+ * The measured phase has white noise that drops with speed, as the observer
+ * angle does. The feedforward comes from foc_observer_speed on a flux state
+ * that rotates at the true speed with a gain error and white noise added,
+ * like a resistance error and the current ripple would cause.
+ */
+
+#include "foc_math.h"
+#include "utils.h"
+#include "mcconf_default.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <math.h>
+
+#define DT					1e-4
+#define RAD_TO_ERPM			(60.0 / (2.0 * M_PI))
+#define PHASE_NOISE			0.05 // Phase noise at standstill in radians, falls with speed
+#define PHASE_NOISE_ERPM	300.0 // Speed where the phase noise is halved
+#define FF_NOISE			4.0 // Feedforward noise in rad/s
+#define FF_GAIN_ERR			0.02 // Relative feedforward gain error
+#define FLUX_LINKAGE		0.00245
+#define STEPS_MAX			10000 // 1 s
+
+typedef enum {
+	PLL_FIXED = 0,
+	PLL_ADAPTIVE,
+	PLL_ADAPTIVE_FF
+} pll_mode;
+
+static const char *mode_names[] = {"fixed", "adaptive", "adaptive + ff"};
+
+typedef float (*speed_profile)(float t);
+
+static uint64_t rng_state;
+
+static double rand_uniform(void) {
+	// xorshift64*
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return (double)((rng_state * 2685821657736338717ULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static double rand_normal(void) {
+	// Box-Muller
+	double u1 = rand_uniform();
+	if (u1 < 1e-30) {
+		u1 = 1e-30;
+	}
+	const double u2 = rand_uniform();
+	return sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2);
+}
+
+static float profile_300(float t) {
+	(void)t;
+	return 300.0 / RAD_TO_ERPM;
+}
+
+static float profile_3000(float t) {
+	(void)t;
+	return 3000.0 / RAD_TO_ERPM;
+}
+
+static float profile_ramp(float t) {
+	float ramp = (t - 0.1) / 0.2;
+	utils_truncate_number(&ramp, 0.0, 1.0);
+	return ramp * 20000.0 / RAD_TO_ERPM;
+}
+
+static float profile_step(float t) {
+	return (t < 0.2 ? 1000.0 : 5000.0) / RAD_TO_ERPM;
+}
+
+/*
+ * Run the PLL and store the speed error in ERPM for each time step.
+ */
+static void sim(pll_mode mode, speed_profile profile, int steps, float *err) {
+	volatile float phase = 0.0, speed = 0.0, speed_corr = 0.0, speed_ff_filter = 0.0;
+	double th = 0.0;
+	double th_flux = 0.0;
+
+	rng_state = 88172645463325252ULL;
+
+	for (int k = 0;k < steps;k++) {
+		const float w = profile(k * DT);
+		th += w * DT;
+
+		const double noise = PHASE_NOISE * (PHASE_NOISE_ERPM / (fabs(w * RAD_TO_ERPM) + PHASE_NOISE_ERPM));
+		float phase_meas = th + rand_normal() * noise;
+		utils_norm_angle_rad(&phase_meas);
+
+		const float x1_last = FLUX_LINKAGE * cos(th_flux);
+		const float x2_last = FLUX_LINKAGE * sin(th_flux);
+		th_flux += (w * (1.0 + FF_GAIN_ERR) + rand_normal() * FF_NOISE) * DT;
+		const float x1 = FLUX_LINKAGE * cos(th_flux);
+		const float x2 = FLUX_LINKAGE * sin(th_flux);
+
+		switch (mode) {
+		case PLL_FIXED:
+			foc_pll_run(phase_meas, DT, MCCONF_FOC_PLL_KP, MCCONF_FOC_PLL_KI, &phase, &speed);
+			break;
+
+		case PLL_ADAPTIVE:
+			foc_pll_run_adaptive(phase_meas, 0.0, DT, MCCONF_FOC_PLL_BW_MIN,
+					MCCONF_FOC_PLL_BW_MAX, MCCONF_FOC_PLL_BW_ERPM, &phase,
+					&speed_corr, &speed_ff_filter, &speed);
+			break;
+
+		case PLL_ADAPTIVE_FF: {
+			const float speed_ff = foc_observer_speed(x1_last, x2_last, x1, x2,
+					0.1 * FLUX_LINKAGE, DT);
+			foc_pll_run_adaptive(phase_meas, speed_ff, DT, MCCONF_FOC_PLL_BW_MIN,
+					MCCONF_FOC_PLL_BW_MAX, MCCONF_FOC_PLL_BW_ERPM, &phase,
+					&speed_corr, &speed_ff_filter, &speed);
+		} break;
+		}
+
+		err[k] = (speed - w) * RAD_TO_ERPM;
+	}
+}
+
+static float rms(const float *err, int start, int end) {
+	double sum = 0.0;
+	for (int i = start;i < end;i++) {
+		sum += SQ((double)err[i]);
+	}
+	return sqrt(sum / (double)(end - start));
+}
+
+static float max_abs(const float *err, int start, int end) {
+	float res = 0.0;
+	for (int i = start;i < end;i++) {
+		if (fabsf(err[i]) > res) {
+			res = fabsf(err[i]);
+		}
+	}
+	return res;
+}
+
+// Time after start until the error stays below limit
+static float settle_time(const float *err, int start, int end, float limit) {
+	int last = -1;
+	for (int i = start;i < end;i++) {
+		if (fabsf(err[i]) > limit) {
+			last = i - start;
+		}
+	}
+	return last < 0 ? 0.0 : (float)last * DT;
+}
+
+int main(void) {
+	static float err[STEPS_MAX];
+
+	printf("Fixed: kp %.0f, ki %.0f. Adaptive: %.0f - %.0f Hz up to %.0f ERPM\n",
+			(double)MCCONF_FOC_PLL_KP, (double)MCCONF_FOC_PLL_KI, (double)MCCONF_FOC_PLL_BW_MIN,
+			(double)MCCONF_FOC_PLL_BW_MAX, (double)MCCONF_FOC_PLL_BW_ERPM);
+	printf("%.0f kHz, phase noise %.2f rad at standstill, feedforward noise %.1f rad/s and %.0f %% gain error\n\n",
+			1e-3 / DT, PHASE_NOISE, FF_NOISE, FF_GAIN_ERR * 100.0);
+
+	printf("%-15s %12s %12s %12s %12s %12s\n", "", "300 ERPM", "3000 ERPM", "ramp max", "ramp 1 %", "step 2 %");
+	printf("%-15s %12s %12s %12s %12s %12s\n", "", "rms err", "rms err", "lag", "settle", "settle");
+
+	for (int m = PLL_FIXED;m <= PLL_ADAPTIVE_FF;m++) {
+		// Constant speed, the noise in the second half of 1 s
+		int steps = STEPS_MAX;
+		sim(m, profile_300, steps, err);
+		const float rms_300 = rms(err, steps / 2, steps);
+		sim(m, profile_3000, steps, err);
+		const float rms_3000 = rms(err, steps / 2, steps);
+
+		// Ramp from 0 to 20k ERPM between 0.1 s and 0.3 s
+		steps = (int)(0.6 / DT);
+		sim(m, profile_ramp, steps, err);
+		const float ramp_lag = max_abs(err, (int)(0.15 / DT), (int)(0.3 / DT));
+		const float ramp_settle = settle_time(err, (int)(0.3 / DT), steps, 0.01 * 20000.0);
+
+		// Step from 1k to 5k ERPM at 0.2 s
+		sim(m, profile_step, steps, err);
+		const float step_settle = settle_time(err, (int)(0.2 / DT), steps, 0.02 * 5000.0);
+
+		printf("%-15s %7.1f ERPM %7.1f ERPM %7.0f ERPM %9.1f ms %9.1f ms\n", mode_names[m],
+				(double)rms_300, (double)rms_3000, (double)ramp_lag,
+				(double)(ramp_settle * 1e3), (double)(step_settle * 1e3));
+	}
+
+	return 0;
+}
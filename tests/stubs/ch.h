@@ -0,0 +1,16 @@
+/*
+	Minimal stand-in for the ChibiOS header so that the hardware independent
+	modules can be compiled for the host tests.
+ */
+
+#ifndef CH_H_
+#define CH_H_
+
+#include <stdint.h>
+
+typedef uint32_t systime_t;
+
+#define chSysLock()
+#define chSysUnlock()
+
+#endif /* CH_H_ */
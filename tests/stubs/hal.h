@@ -0,0 +1,9 @@
+/*
+	Minimal stand-in for the ChibiOS HAL header so that the hardware independent
+	modules can be compiled for the host tests.
+ */
+
+#ifndef HAL_H_
+#define HAL_H_
+
+#endif /* HAL_H_ */
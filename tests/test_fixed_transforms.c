@@ -0,0 +1,111 @@
+/*
+	Copyright 2016 Benjamin Vedder	benjamin@vedder.se
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+/*
+ * Host test of the fixed point Clarke and Park transforms against the float
+ * transforms in mcpwm_foc.c. The error is measured in ADC counts, and must stay
+ * below TOLERANCE_COUNTS, which is one LSB of the current measurement.
+ */
+
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#define TOLERANCE_COUNTS	1.0
+#define ADC_MAX				2047
+#define ADC_STEP			13
+#define ANGLE_STEPS			720
+
+static int check(const char *what, double err, double *err_max) {
+	if (err > *err_max) {
+		*err_max = err;
+	}
+
+	if (err > TOLERANCE_COUNTS) {
+		printf("FAIL: %s error %.3f counts\n", what, err);
+		return 1;
+	}
+
+	return 0;
+}
+
+int main(void) {
+	int fails = 0;
+	double clarke_err_max = 0.0;
+	double park_err_max = 0.0;
+	const double clarke_scale = 1.0 / (double)(1 << UTILS_FIXED_CLARKE_FRAC);
+	const double park_scale = 1.0 / (double)(1 << UTILS_FIXED_PARK_FRAC);
+
+	for (int a = -ADC_MAX;a <= ADC_MAX;a += ADC_STEP) {
+		for (int b = -ADC_MAX;b <= ADC_MAX;b += ADC_STEP) {
+			// Balanced currents must fit in the ADC range for phase C as well
+			if (abs(a + b) > ADC_MAX) {
+				continue;
+			}
+
+			int16_t alpha, beta;
+			utils_fixed_clarke(a, b, &alpha, &beta);
+
+			const float alpha_f = a;
+			const float beta_f = ONE_BY_SQRT3 * a + TWO_BY_SQRT3 * b;
+
+			fails += check("clarke alpha", fabs(alpha * clarke_scale - alpha_f), &clarke_err_max);
+			fails += check("clarke beta", fabs(beta * clarke_scale - beta_f), &clarke_err_max);
+
+			for (int i = 0;i < ANGLE_STEPS;i += 7) {
+				const float angle = 2.0 * M_PI * (float)i / (float)ANGLE_STEPS;
+				const float s = sinf(angle);
+				const float c = cosf(angle);
+
+				int32_t d, q;
+				utils_fixed_park(alpha, beta, utils_float_to_q15(s),
+						utils_float_to_q15(c), &d, &q);
+
+				const float d_f = c * alpha_f + s * beta_f;
+				const float q_f = c * beta_f - s * alpha_f;
+
+				fails += check("park d", fabs(d * park_scale - d_f), &park_err_max);
+				fails += check("park q", fabs(q * park_scale - q_f), &park_err_max);
+
+				if (fails > 10) {
+					return 1;
+				}
+			}
+		}
+	}
+
+	if (utils_float_to_q15(1.0) != INT16_MAX || utils_float_to_q15(-1.0) != INT16_MIN ||
+			utils_float_to_q15(1.01) != INT16_MAX || utils_float_to_q15(-1.01) != INT16_MIN) {
+		printf("FAIL: utils_float_to_q15 saturation\n");
+		fails++;
+	}
+
+	printf("Clarke max error: %.3f counts\n", clarke_err_max);
+	printf("Park max error: %.3f counts\n", park_err_max);
+	printf("Tolerance: %.3f counts\n", TOLERANCE_COUNTS);
+
+	if (fails) {
+		printf("FAILED\n");
+		return 1;
+	}
+
+	printf("OK\n");
+	return 0;
+}
@@ -477,6 +477,124 @@ void utils_fast_sincos_better(float angle, float *sin, float *cos) {
 	}
 }
 
+/**
+ * Clarke transform of two phase currents in fixed point, assuming balanced
+ * currents. On the Cortex-M4 the beta component uses a dual 16-bit multiply
+ * and add.
+ *
+ * @param a
+ * Current of phase A in ADC counts. Must fit in 16 bits.
+ *
+ * @param b
+ * Current of phase B in ADC counts. Must fit in 16 bits.
+ *
+ * @param alpha
+ * A pointer to store the alpha current in ADC counts with
+ * UTILS_FIXED_CLARKE_FRAC fractional bits.
+ *
+ * @param beta
+ * A pointer to store the beta current in ADC counts with
+ * UTILS_FIXED_CLARKE_FRAC fractional bits.
+ */
+void utils_fixed_clarke(int a, int b, int16_t *alpha, int16_t *beta) {
+	// 1 / sqrt(3) and 2 / sqrt(3) with 14 fractional bits
+	const int32_t one_by_sqrt3 = 9459;
+	const int32_t two_by_sqrt3 = 18919;
+	const int shift = 14 - UTILS_FIXED_CLARKE_FRAC;
+
+#if defined(__ARM_FEATURE_DSP) && __ARM_FEATURE_DSP
+	const uint32_t ab = __PKHBT(a, b, 16);
+	int32_t beta_tmp = __SMUAD(ab, (two_by_sqrt3 << 16) | one_by_sqrt3);
+	beta_tmp = __SSAT((beta_tmp + (1 << (shift - 1))) >> shift, 16);
+	*alpha = __SSAT(a << UTILS_FIXED_CLARKE_FRAC, 16);
+#else
+	int32_t beta_tmp = a * one_by_sqrt3 + b * two_by_sqrt3;
+	beta_tmp = (beta_tmp + (1 << (shift - 1))) >> shift;
+	int32_t alpha_tmp = a << UTILS_FIXED_CLARKE_FRAC;
+
+	if (beta_tmp > INT16_MAX) {
+		beta_tmp = INT16_MAX;
+	} else if (beta_tmp < INT16_MIN) {
+		beta_tmp = INT16_MIN;
+	}
+
+	if (alpha_tmp > INT16_MAX) {
+		alpha_tmp = INT16_MAX;
+	} else if (alpha_tmp < INT16_MIN) {
+		alpha_tmp = INT16_MIN;
+	}
+
+	*alpha = alpha_tmp;
+#endif
+
+	*beta = beta_tmp;
+}
+
+/**
+ * Convert a value in the range [-1.0, 1.0] to Q15. The scale is a power of two,
+ * so that the Cortex-M4 can do the conversion with a single VCVT. 1.0 saturates
+ * to INT16_MAX.
+ *
+ * @param x
+ * The value to convert.
+ *
+ * @return
+ * The value in Q15.
+ */
+int16_t utils_float_to_q15(float x) {
+	int32_t res = (int32_t)(x * 32768.0);
+
+#if defined(__ARM_FEATURE_DSP) && __ARM_FEATURE_DSP
+	res = __SSAT(res, 16);
+#else
+	if (res > INT16_MAX) {
+		res = INT16_MAX;
+	} else if (res < INT16_MIN) {
+		res = INT16_MIN;
+	}
+#endif
+
+	return res;
+}
+
+/**
+ * Park transform in fixed point. On the Cortex-M4 each output is a single dual
+ * 16-bit multiply and add or subtract.
+ *
+ * @param alpha
+ * The alpha current from utils_fixed_clarke.
+ *
+ * @param beta
+ * The beta current from utils_fixed_clarke.
+ *
+ * @param sin
+ * The sine of the rotor angle in Q15, see utils_float_to_q15.
+ *
+ * @param cos
+ * The cosine of the rotor angle in Q15, see utils_float_to_q15.
+ *
+ * @param d
+ * A pointer to store the d current in ADC counts with
+ * UTILS_FIXED_PARK_FRAC fractional bits.
+ *
+ * @param q
+ * A pointer to store the q current in ADC counts with
+ * UTILS_FIXED_PARK_FRAC fractional bits.
+ */
+void utils_fixed_park(int16_t alpha, int16_t beta, int16_t sin, int16_t cos, int32_t *d, int32_t *q) {
+#if defined(__ARM_FEATURE_DSP) && __ARM_FEATURE_DSP
+	// Beta in the low and alpha in the high half word
+	const uint32_t ba = __PKHBT(beta, alpha, 16);
+	const uint32_t cs = __PKHBT(cos, sin, 16);
+
+	*d = __SMUADX(ba, cs); // beta * s + alpha * c
+	*q = __SMUSD(ba, cs); // beta * c - alpha * s
+#else
+	*d = (int32_t)cos * alpha + (int32_t)sin * beta;
+	*q = (int32_t)cos * beta - (int32_t)sin * alpha;
+#endif
+}
+
 /**
  * Calculate the values with the lowest magnitude.
  *
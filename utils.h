@@ -21,6 +21,7 @@
 #define UTILS_H_
 
 #include <stdbool.h>
+#include <stdint.h>
 
 void utils_step_towards(float *value, float goal, float step);
 float utils_calc_ratio(float low, float high, float val);
@@ -42,6 +43,9 @@ float utils_fast_atan2(float y, float x);
 bool utils_saturate_vector_2d(float *x, float *y, float max);
 void utils_fast_sincos(float angle, float *sin, float *cos);
 void utils_fast_sincos_better(float angle, float *sin, float *cos);
+void utils_fixed_clarke(int a, int b, int16_t *alpha, int16_t *beta);
+int16_t utils_float_to_q15(float x);
+void utils_fixed_park(int16_t alpha, int16_t beta, int16_t sin, int16_t cos, int32_t *d, int32_t *q);
 float utils_min_abs(float va, float vb);
 float utils_max_abs(float va, float vb);
 void utils_byte_to_binary(int x, char *b);
@@ -82,4 +86,8 @@ void utils_sys_unlock_cnt(void);
 #define TWO_BY_SQRT3			(2.0f * 0.57735026919)
 #define SQRT3_BY_2				(0.86602540378)
 
+// Fractional bits of the fixed point Clarke and Park transform outputs
+#define UTILS_FIXED_CLARKE_FRAC		2
+#define UTILS_FIXED_PARK_FRAC		(UTILS_FIXED_CLARKE_FRAC + 15)
+
 #endif /* UTILS_H_ */